@@ -59,9 +59,19 @@ void ::Murmur::${class}I::${func}_async('. join(", ", @{$wrapargs}).qq') {
 	}
 #endif
 	ExecEvent *ie = new ExecEvent(boost::bind(&impl_${class}_$func, ' . join(", ", @${callargs}).qq'));
-	QCoreApplication::instance()->postEvent(mi, ie);
+';
+
+  # Calls addressing a booted server are run on its control thread, except
+  # for those managing the server itself.
+  if (($class eq "Server") && ! grep($_ eq $func, qw(isRunning start stop delete id))) {
+    print I qq'	QCoreApplication::instance()->postEvent(mi, new ExecEvent(boost::bind(&runOnServer, QString::fromStdString(current.id.name).toInt(), ie)));
 }
 ';
+  } else {
+    print I qq'	QCoreApplication::instance()->postEvent(mi, ie);
+}
+';
+  }
 
   if( ! grep(/impl_${class}_$func/,@mi)) {
     print B "static void impl_${class}_$func(".join(", ", @${implargs}). ") {}\n";
@@ -83,6 +83,29 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 		return granted;
 	}
 
+	// The chain and the group index are shared; the server holds its
+	// qmCache for us, with or without a result cache.
+	if (! chan->acChain)
+		chan->acChain = new ACLChain(chan);
+	granted = chan->acChain->evaluate(p);
+
+	if (granted & Write) {
+		granted |= Traverse|Enter|MuteDeafen|Move|MakeChannel|LinkChannel|TextMessage|MakeTempChannel;
+		if (chan->iId == 0)
+			granted |= Kick|Ban|Register|SelfRegister;
+	}
+
+	if (cache) {
+		if (! cache->contains(p))
+			cache->insert(p, new QHash<Channel *, Permissions>);
+
+		cache->value(p)->insert(chan, granted | Cached);
+	}
+
+	return granted;
+}
+
+ACLChain::ACLChain(Channel *chan) {
 	QStack<Channel *> chanstack;
 	Channel *ch = chan;
 
@@ -91,65 +114,111 @@ QFlags<ChanACL::Perm> ChanACL::effectivePermissions(ServerUser *p, Channel *chan
 		ch = ch->cParent;
 	}
 
-	// Default permissions
-	Permissions def = Traverse | Enter | Speak | Whisper | TextMessage;
+	while (! chanstack.isEmpty()) {
+		ch = chanstack.pop();
+
+		Segment s;
+		s.iFirst = qvEntries.count();
+		s.bReset = ! ch->bInheritACL;
+		s.bCheck = false;
+
+		foreach(ChanACL *acl, ch->qlACL) {
+			Entry e;
+			e.iUserId = acl->iUserId;
+			e.uiFlags = 0;
+
+			if (acl->pAllow & ChanACL::Traverse)
+				e.uiFlags |= TraverseAllow;
+			if (acl->pDeny & ChanACL::Traverse)
+				e.uiFlags |= TraverseDeny;
+			if (acl->pAllow & ChanACL::Write)
+				e.uiFlags |= WriteAllow;
+			if (acl->pDeny & ChanACL::Write)
+				e.uiFlags |= WriteDeny;
+
+			if (ch->iId == 0 && chan == ch && acl->bApplyHere)
+				e.pGrant = acl->pAllow & (ChanACL::Kick|ChanACL::Ban|ChanACL::Register|ChanACL::SelfRegister);
+			if ((ch==chan && acl->bApplyHere) || (ch!=chan && acl->bApplySubs)) {
+				e.pGrant |= (acl->pAllow & ~(ChanACL::Kick|ChanACL::Ban|ChanACL::Register|ChanACL::SelfRegister|ChanACL::Cached));
+				e.pRevoke = acl->pDeny;
+			}
+
+			if (! e.uiFlags && ! e.pGrant && ! e.pRevoke)
+				continue;
+
+			GroupRef ref(chan, ch, acl->qsGroup);
+			if (ref.kKind == GroupRef::Never) {
+				if (e.iUserId == -1)
+					continue;
+				e.iGroup = MatchNone;
+			} else if (ref.kKind == GroupRef::Always) {
+				e.iGroup = MatchAll;
+			} else {
+				e.iGroup = qvGroups.indexOf(ref);
+				if (e.iGroup == -1) {
+					e.iGroup = qvGroups.count();
+					qvGroups.append(ref);
+				}
+			}
+
+			if (e.uiFlags)
+				s.bCheck = true;
+			qvEntries.append(e);
+		}
 
-	granted = def;
+		s.iLast = qvEntries.count();
 
+		// A channel that neither resets nor changes traverse/write can't
+		// fail the traverse check either.
+		if (s.bReset || (s.iLast > s.iFirst))
+			qvSegments.append(s);
+	}
+}
+
+ChanACL::Permissions ACLChain::evaluate(ServerUser *p) const {
+	const ChanACL::Permissions def = ChanACL::Traverse | ChanACL::Enter | ChanACL::Speak | ChanACL::Whisper | ChanACL::TextMessage;
+
+	QVarLengthArray<quint32, 4> members((qvGroups.count() + 31) / 32);
+	for (int i=0;i<members.count();++i)
+		members[i] = 0;
+	for (int i=0;i<qvGroups.count();++i)
+		if (qvGroups.at(i).isMember(p))
+			members[i >> 5] |= (1U << (i & 31));
+
+	ChanACL::Permissions granted = def;
 	bool traverse = true;
 	bool write = false;
-	ChanACL *acl;
 
-	while (! chanstack.isEmpty()) {
-		ch = chanstack.pop();
-		if (! ch->bInheritACL)
+	foreach(const Segment &s, qvSegments) {
+		if (s.bReset)
 			granted = def;
 
-		foreach(acl, ch->qlACL) {
-			bool matchUser = (acl->iUserId != -1) && (acl->iUserId == p->iId);
-			bool matchGroup = Group::isMember(chan, ch, acl->qsGroup, p);
-			if (matchUser || matchGroup) {
-				if (acl->pAllow & Traverse)
+		for (int i=s.iFirst;i<s.iLast;++i) {
+			const Entry &e = qvEntries.at(i);
+
+			bool match = (e.iUserId != -1) && (e.iUserId == p->iId);
+			if (e.iGroup == MatchAll)
+				match = true;
+			else if (e.iGroup >= 0)
+				match = match || (members[e.iGroup >> 5] & (1U << (e.iGroup & 31)));
+			if (! match)
+				continue;
+
+			if (e.uiFlags) {
+				if (e.uiFlags & TraverseAllow)
 					traverse = true;
-				if (acl->pDeny & Traverse)
+				if (e.uiFlags & TraverseDeny)
 					traverse = false;
-				if (acl->pAllow & Write)
+				if (e.uiFlags & WriteAllow)
 					write = true;
-				if (acl->pDeny & Write)
+				if (e.uiFlags & WriteDeny)
 					write = false;
-				if (ch->iId == 0 && chan == ch && acl->bApplyHere) {
-					if (acl->pAllow & Kick)
-						granted |= Kick;
-					if (acl->pAllow & Ban)
-						granted |= Ban;
-					if (acl->pAllow & Register)
-						granted |= Register;
-					if (acl->pAllow & SelfRegister)
-						granted |= SelfRegister;
-				}
-				if ((ch==chan && acl->bApplyHere) || (ch!=chan && acl->bApplySubs)) {
-					granted |= (acl->pAllow & ~(Kick|Ban|Register|SelfRegister|Cached));
-					granted &= ~acl->pDeny;
-				}
 			}
+			granted = (granted | e.pGrant) & ~e.pRevoke;
 		}
-		if (! traverse && ! write) {
-			granted = None;
-			break;
-		}
-	}
-
-	if (granted & Write) {
-		granted |= Traverse|Enter|MuteDeafen|Move|MakeChannel|LinkChannel|TextMessage|MakeTempChannel;
-		if (chan->iId == 0)
-			granted |= Kick|Ban|Register|SelfRegister;
-	}
-
-	if (cache) {
-		if (! cache->contains(p))
-			cache->insert(p, new QHash<Channel *, Permissions>);
 
-		cache->value(p)->insert(chan, granted | Cached);
+		if (s.bCheck && ! traverse && ! write)
+			return ChanACL::None;
 	}
 
 	return granted;
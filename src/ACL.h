@@ -33,6 +33,11 @@
 
 #include <QtCore/QHash>
 #include <QtCore/QObject>
+#ifdef MURMUR
+#include <QtCore/QVector>
+
+#include "Group.h"
+#endif
 
 class Channel;
 class User;
@@ -96,4 +101,40 @@ class ChanACL : public QObject {
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(ChanACL::Permissions)
 
+#ifdef MURMUR
+// The ACLs of a channel and its ancestors, flattened into the order
+// effectivePermissions() applies them. Entries that can't change the
+// outcome are dropped and group names are parsed into GroupRefs, so an
+// evaluation is one membership bitset per user plus a pass of masks.
+class ACLChain {
+	private:
+		Q_DISABLE_COPY(ACLChain)
+	public:
+		enum Match { MatchNone = -1, MatchAll = -2 };
+		enum Flag { TraverseAllow = 0x1, TraverseDeny = 0x2, WriteAllow = 0x4, WriteDeny = 0x8 };
+
+		struct Entry {
+			int iUserId;
+			int iGroup;
+			unsigned int uiFlags;
+			ChanACL::Permissions pGrant;
+			ChanACL::Permissions pRevoke;
+		};
+
+		struct Segment {
+			int iFirst;
+			int iLast;
+			bool bReset;
+			bool bCheck;
+		};
+
+		QVector<GroupRef> qvGroups;
+		QVector<Entry> qvEntries;
+		QVector<Segment> qvSegments;
+
+		ACLChain(Channel *c);
+		ChanACL::Permissions evaluate(ServerUser *p) const;
+};
+#endif
+
 #endif
@@ -46,6 +46,7 @@ Channel::Channel(int id, const QString &name, QObject *p) : QObject(p) {
 	qsName = name;
 	bInheritACL = true;
 	bTemporary = false;
+	qvAllLinks << this;
 	cParent = qobject_cast<Channel *>(p);
 	if (cParent)
 		cParent->addChannel(this);
@@ -53,6 +54,9 @@ Channel::Channel(int id, const QString &name, QObject *p) : QObject(p) {
 	uiPermissions = 0;
 	bFiltered = false;
 #endif
+#ifdef MURMUR
+	acChain = NULL;
+#endif
 }
 
 Channel::~Channel() {
@@ -68,6 +72,10 @@ Channel::~Channel() {
 		delete g;
 	foreach(Channel *l, qhLinks.keys())
 		unlink(l);
+#ifdef MURMUR
+	delete acChain;
+	qDeleteAll(qhGroupIndex);
+#endif
 
 	Q_ASSERT(qlChannels.count() == 0);
 	Q_ASSERT(children().count() == 0);
@@ -114,6 +122,12 @@ void Channel::link(Channel *l) {
 	qhLinks[l]++;
 	l->qsPermLinks.insert(this);
 	l->qhLinks[this]++;
+
+	if (! qvAllLinks.contains(l)) {
+		QVector<Channel *> merged = qvAllLinks + l->qvAllLinks;
+		foreach(Channel *c, merged)
+			c->qvAllLinks = merged;
+	}
 }
 
 void Channel::unlink(Channel *l) {
@@ -122,6 +136,37 @@ void Channel::unlink(Channel *l) {
 		qhLinks.remove(l);
 		l->qsPermLinks.remove(this);
 		l->qhLinks.remove(this);
+
+		// Split the group if l can no longer be reached some other way.
+		QSet<Channel *> seen;
+		QStack<Channel *> stack;
+		seen.insert(this);
+		stack.push(this);
+
+		while (! stack.isEmpty() && ! seen.contains(l)) {
+			Channel *lnk = stack.pop();
+			foreach(Channel *c, lnk->qhLinks.keys()) {
+				if (! seen.contains(c)) {
+					seen.insert(c);
+					stack.push(c);
+				}
+			}
+		}
+
+		if (! seen.contains(l)) {
+			QVector<Channel *> mine;
+			QVector<Channel *> other;
+			foreach(Channel *c, qvAllLinks) {
+				if (seen.contains(c))
+					mine << c;
+				else
+					other << c;
+			}
+			foreach(Channel *c, mine)
+				c->qvAllLinks = mine;
+			foreach(Channel *c, other)
+				c->qvAllLinks = other;
+		}
 	} else {
 		foreach(Channel *c, qhLinks.keys())
 			unlink(c);
@@ -130,22 +175,9 @@ void Channel::unlink(Channel *l) {
 
 QSet<Channel *> Channel::allLinks() {
 	QSet<Channel *> seen;
-	seen.insert(this);
-	if (qhLinks.isEmpty())
-		return seen;
-
-	QStack<Channel *> stack;
-	stack.push(this);
-
-	while (! stack.isEmpty()) {
-		Channel *lnk = stack.pop();
-		foreach(Channel *l, lnk->qhLinks.keys()) {
-			if (! seen.contains(l)) {
-				seen.insert(l);
-				stack.push(l);
-			}
-		}
-	}
+	seen.reserve(qvAllLinks.count());
+	foreach(Channel *c, qvAllLinks)
+		seen.insert(c);
 	return seen;
 }
 
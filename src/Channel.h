@@ -37,10 +37,15 @@
 #include <QtCore/QReadWriteLock>
 #include <QtCore/QSet>
 #include <QtCore/QString>
+#include <QtCore/QVector>
 
 class User;
 class Group;
 class ChanACL;
+#ifdef MURMUR
+class ACLChain;
+class GroupIndex;
+#endif
 
 class ClientUser;
 
@@ -65,6 +70,10 @@ class Channel : public QObject {
 
 		QSet<Channel *> qsPermLinks;
 		QHash<Channel *, int> qhLinks;
+		// Every channel reachable through links, this one included. All
+		// members share the same implicitly shared vector; link() and
+		// unlink() keep it current.
+		QVector<Channel *> qvAllLinks;
 
 		bool bInheritACL;
 
@@ -83,6 +92,12 @@ class Channel : public QObject {
 		static void remove(Channel *);
 
 		void addClientUser(ClientUser *p);
+#endif
+#ifdef MURMUR
+		// Flattened ACLs and group members, built on demand under
+		// Server::qmCache.
+		ACLChain *acChain;
+		QHash<QString, GroupIndex *> qhGroupIndex;
 #endif
 		static bool lessThan(const Channel *, const Channel *);
 
@@ -42,6 +42,9 @@
 #include "Mumble.pb.h"
 
 
+// Receive buffer size; grown while a larger message is pending.
+#define CONNECTION_INPUT_SIZE 16384
+
 #ifdef Q_OS_WIN
 HANDLE Connection::hQoS = NULL;
 #endif
@@ -49,8 +52,13 @@ HANDLE Connection::hQoS = NULL;
 Connection::Connection(QObject *p, QSslSocket *qtsSock) : QObject(p) {
 	qtsSocket = qtsSock;
 	qtsSocket->setParent(this);
-	iPacketLength = -1;
+	qbaInput.resize(CONNECTION_INPUT_SIZE);
+	iInputHead = iInputTail = 0;
+	bReading = false;
 	bDisconnectedEmitted = false;
+	qtFlush = NULL;
+	bFlushQueued = false;
+	iCoalesceUsec = -1;
 
 	static bool bDeclared = false;
 	if (! bDeclared) {
@@ -117,46 +125,93 @@ void Connection::resetActivityTime() {
 }
 
 /**
- * This function waits until a complete package is received and then emits it as a message.
- * It gets called everytime new data is available and interprets the message prefix header
- * to figure out the type and length. It then waits until the complete message is buffered
- * and emits it as a message so it can be handled by the corresponding message handler
- * routine.
+ * This function hands out every complete message as soon as it has been received.
+ * It gets called everytime new data is available. It reads all of it into the
+ * receive buffer, interprets the message prefix headers there to figure out type
+ * and length, and emits each complete message so it can be handled by the
+ * corresponding message handler routine.
+ *
+ * Messages are emitted as views into the receive buffer rather than copies, so
+ * steady control traffic allocates nothing here.
  *
  * @see QSslSocket::readyRead()
  * @see void ServerHandler::message(unsigned int msgType, const QByteArray &qbaMsg)
  * @see void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *u)
  */
 void Connection::socketRead() {
-	while (true) {
-		qint64 iAvailable = qtsSocket->bytesAvailable();
-		if (iPacketLength == -1) {
-			if (iAvailable < 6)
+	// A handler must not move the buffer out from under the message it is
+	// looking at; the outer call picks up anything that arrives meanwhile.
+	if (bReading)
+		return;
+	bReading = true;
+
+	forever {
+		while (iInputTail - iInputHead >= 6) {
+			const unsigned char *uc = reinterpret_cast<const unsigned char *>(qbaInput.constData() + iInputHead);
+			unsigned int uiType = qFromBigEndian<quint16>(&uc[0]);
+			quint32 uiLength = qFromBigEndian<quint32>(&uc[2]);
+
+			if (uiLength > 0x7fffff) {
+				qWarning() << "Host tried to send huge packet";
+				bReading = false;
+				disconnectSocket(true);
 				return;
+			}
 
-			unsigned char a_ucBuffer[6];
+			int len = static_cast<int>(uiLength);
+			if (iInputTail - iInputHead - 6 < len)
+				break;
 
-			qtsSocket->read(reinterpret_cast<char *>(a_ucBuffer), 6);
-			uiType = qFromBigEndian<quint16>(&a_ucBuffer[0]);
-			iPacketLength = qFromBigEndian<quint32>(&a_ucBuffer[2]);
-			iAvailable -= 6;
-		}
+			const char *data = qbaInput.constData() + iInputHead + 6;
+			iInputHead += 6 + len;
 
-		if ((iPacketLength == -1) || (iAvailable < iPacketLength))
-			return;
+			emit message(uiType, QByteArray::fromRawData(data, len));
 
-		if (iPacketLength > 0x7fffff) {
-			qWarning() << "Host tried to send huge packet";
-			disconnectSocket(true);
-			return;
+			// The handler may have dropped the connection.
+			if (! qtsSocket->isOpen()) {
+				bReading = false;
+				return;
+			}
 		}
 
-		QByteArray qbaBuffer = qtsSocket->read(iPacketLength);
-		iPacketLength = -1;
-		iAvailable -= iPacketLength;
+		if (qtsSocket->bytesAvailable() <= 0)
+			break;
+
+		reserveInput();
+		qint64 got = qtsSocket->read(qbaInput.data() + iInputTail, qbaInput.size() - iInputTail);
+		if (got <= 0)
+			break;
+		iInputTail += static_cast<int>(got);
+	}
+
+	// Give back what a large message made us grow to once it has been handled.
+	if (iInputHead == iInputTail) {
+		iInputHead = iInputTail = 0;
+		if (qbaInput.size() > CONNECTION_INPUT_SIZE)
+			qbaInput = QByteArray(CONNECTION_INPUT_SIZE, 0);
+	}
+
+	bReading = false;
+}
 
-		emit message(uiType, qbaBuffer);
+/// Move the unhandled bytes to the front of the receive buffer, so there is
+/// room to read into. Once a pending message fills the buffer, it is grown
+/// towards the message size, at most doubling each time: a peer has to send
+/// the bytes, not just a header claiming them, to make us reserve memory.
+void Connection::reserveInput() {
+	if (iInputHead > 0) {
+		memmove(qbaInput.data(), qbaInput.constData() + iInputHead, iInputTail - iInputHead);
+		iInputTail -= iInputHead;
+		iInputHead = 0;
 	}
+
+	if ((iInputTail < qbaInput.size()) || (iInputTail < 6))
+		return;
+
+	const unsigned char *uc = reinterpret_cast<const unsigned char *>(qbaInput.constData());
+	int need = qMin(6 + static_cast<int>(qFromBigEndian<quint32>(&uc[2])), qbaInput.size() * 2);
+	if (qbaInput.size() < need)
+		qbaInput.resize(need);
 }
 
 void Connection::socketError(QAbstractSocket::SocketError err) {
@@ -196,11 +251,86 @@ void Connection::sendMessage(const ::google::protobuf::Message &msg, unsigned in
 }
 
 void Connection::sendMessage(const QByteArray &qbaMsg) {
-	if (! qbaMsg.isEmpty())
+	if (qbaMsg.isEmpty())
+		return;
+
+	if (iCoalesceUsec < 0)
 		qtsSocket->write(qbaMsg);
+	else
+		queueOutput(qbaMsg.constData(), qbaMsg.size());
+}
+
+/// Write an already framed message without wrapping it in a QByteArray.
+void Connection::sendMessage(const char *data, int len) {
+	if (len <= 0)
+		return;
+
+	if (iCoalesceUsec < 0)
+		qtsSocket->write(data, len);
+	else
+		queueOutput(data, len);
+}
+
+/// Gather outgoing messages and hand them to the socket in one write, so
+/// they share a TLS record. With usec 0, everything sent while handling one
+/// event goes out together once control returns to the event loop; a
+/// positive usec holds messages back for up to that long. A negative usec
+/// writes every message through as it is sent.
+///
+/// Messages that must not wait can be pushed out with flushOutput() or
+/// forceFlush().
+void Connection::setCoalesce(int usec) {
+	if (usec < 0)
+		flushOutput();
+
+	iCoalesceUsec = usec;
+
+	if ((usec >= 0) && ! qtFlush) {
+		qtFlush = new QTimer(this);
+		qtFlush->setSingleShot(true);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+		qtFlush->setTimerType(Qt::PreciseTimer);
+#endif
+		connect(qtFlush, SIGNAL(timeout()), this, SLOT(flushOutput()));
+	}
+}
+
+void Connection::queueOutput(const char *data, int len) {
+	qbaOutput.append(data, len);
+
+	// A TLS record carries at most 16KB, so there is nothing to gain from
+	// holding on to more.
+	if (qbaOutput.size() >= 16384) {
+		flushOutput();
+		return;
+	}
+
+	if (bFlushQueued)
+		return;
+	bFlushQueued = true;
+
+	if (iCoalesceUsec == 0)
+		QMetaObject::invokeMethod(this, "flushOutput", Qt::QueuedConnection);
+	else
+		qtFlush->start((iCoalesceUsec + 999) / 1000);
+}
+
+void Connection::flushOutput() {
+	bFlushQueued = false;
+	if (qtFlush)
+		qtFlush->stop();
+
+	if (qbaOutput.isEmpty())
+		return;
+
+	qtsSocket->write(qbaOutput);
+	qbaOutput.clear();
+	qtsSocket->flush();
 }
 
 void Connection::forceFlush() {
+	flushOutput();
+
 	if (qtsSocket->state() != QAbstractSocket::ConnectedState)
 		return;
 
@@ -218,6 +348,8 @@ void Connection::forceFlush() {
 }
 
 void Connection::disconnectSocket(bool force) {
+	flushOutput();
+
 	if (qtsSocket->state() == QAbstractSocket::UnconnectedState) {
 		emit connectionClosed(QAbstractSocket::UnknownSocketError, QString());
 		return;
@@ -39,6 +39,7 @@
 #endif
 #include <QtCore/QList>
 #include <QtCore/QObject>
+#include <QtCore/QTimer>
 #include <QtNetwork/QSslSocket>
 #ifdef Q_OS_WIN
 #include <windows.h>
@@ -63,8 +64,19 @@ class Connection : public QObject {
 #else
 		QTime qtLastPacket;
 #endif
-		unsigned int uiType;
-		int iPacketLength;
+		// Received bytes; frames are parsed and handed out in place.
+		// [iInputHead, iInputTail) has not been handed out yet.
+		QByteArray qbaInput;
+		int iInputHead, iInputTail;
+		bool bReading;
+		void reserveInput();
+
+		// Outgoing messages gathered into one TLS record, see setCoalesce().
+		QByteArray qbaOutput;
+		QTimer *qtFlush;
+		bool bFlushQueued;
+		int iCoalesceUsec;
+		void queueOutput(const char *data, int len);
 #ifdef Q_OS_WIN
 		static HANDLE hQoS;
 		DWORD dwFlow;
@@ -76,9 +88,12 @@ class Connection : public QObject {
 		void socketSslErrors(const QList<QSslError> &errors);
 	public slots:
 		void proceedAnyway();
+		void flushOutput();
 	signals:
 		void encrypted();
 		void connectionClosed(QAbstractSocket::SocketError, const QString &reason);
+		// The array points into the receive buffer and is only valid while the
+		// signal is delivered; receivers that keep it must make a deep copy.
 		void message(unsigned int type, const QByteArray &);
 		void handleSslErrors(const QList<QSslError> &);
 	public:
@@ -87,8 +102,10 @@ class Connection : public QObject {
 		static void messageToNetwork(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache);
 		void sendMessage(const ::google::protobuf::Message &msg, unsigned int msgType, QByteArray &cache);
 		void sendMessage(const QByteArray &qbaMsg);
+		void sendMessage(const char *data, int len);
 		void disconnectSocket(bool force=false);
 		void forceFlush();
+		void setCoalesce(int usec);
 		int activityTime() const;
 		void resetActivityTime();
 
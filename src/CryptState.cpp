@@ -43,34 +43,161 @@
 
 #include "Net.h"
 
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+#define CRYPT_HAVE_GCM
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305)
+#define CRYPT_HAVE_CHACHA
+#endif
+
+// Tag bytes carried in each packet. OCB2 keeps its historical 3 bytes; the
+// AEAD modes use 8, since short tags weaken GCM far more than OCB.
+#define OCB_TAG_SIZE 3
+#define AEAD_TAG_SIZE 8
+
+static QMutex qmFastestModes;
+static QList<CryptState::Mode> qlFastestModes;
+static bool bFastestModesRanked = false;
+
 CryptState::CryptState() {
 	for (int i=0;i<0x100;i++)
 		decrypt_history[i] = 0;
+	mMode = OCB2_AES128;
 	bInit = false;
 	uiGood=uiLate=uiLost=uiResync=0;
 	uiRemoteGood=uiRemoteLate=uiRemoteLost=uiRemoteResync=0;
+	ectxEncrypt = ectxDecrypt = NULL;
+}
+
+CryptState::~CryptState() {
+	if (ectxEncrypt)
+		EVP_CIPHER_CTX_free(ectxEncrypt);
+	if (ectxDecrypt)
+		EVP_CIPHER_CTX_free(ectxDecrypt);
+}
+
+static const EVP_CIPHER *modeCipher(CryptState::Mode mode) {
+	switch (mode) {
+		case CryptState::OCB2_AES128:
+			return EVP_aes_128_ecb();
+#ifdef CRYPT_HAVE_GCM
+		case CryptState::AES128_GCM:
+			return EVP_aes_128_gcm();
+#endif
+#ifdef CRYPT_HAVE_CHACHA
+		case CryptState::CHACHA20_POLY1305:
+			return EVP_chacha20_poly1305();
+#endif
+		default:
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * For OCB2 the block loop is fed to EVP in batches of raw ECB blocks. EVP
+ * picks the fastest AES implementation for the running CPU (AES-NI where
+ * present) and pipelines several blocks per call. If a context can't be set
+ * up, the plain AES_encrypt/AES_decrypt path is used instead.
+ *
+ * The AEAD modes are keyed once here and only get a new nonce per packet.
+ * They have no fallback, so a failure leaves the state invalid.
+ */
+void CryptState::initCipherContexts() {
+	const EVP_CIPHER *cipher = modeCipher(mMode);
+
+	if (! ectxEncrypt)
+		ectxEncrypt = EVP_CIPHER_CTX_new();
+	if (! ectxDecrypt)
+		ectxDecrypt = EVP_CIPHER_CTX_new();
+
+	if (ectxEncrypt && (! cipher || (EVP_EncryptInit_ex(ectxEncrypt, cipher, NULL, raw_key, NULL) != 1) || ((mMode == OCB2_AES128) && (EVP_CIPHER_CTX_set_padding(ectxEncrypt, 0) != 1)))) {
+		EVP_CIPHER_CTX_free(ectxEncrypt);
+		ectxEncrypt = NULL;
+	}
+	if (ectxDecrypt && (! cipher || (EVP_DecryptInit_ex(ectxDecrypt, cipher, NULL, raw_key, NULL) != 1) || ((mMode == OCB2_AES128) && (EVP_CIPHER_CTX_set_padding(ectxDecrypt, 0) != 1)))) {
+		EVP_CIPHER_CTX_free(ectxDecrypt);
+		ectxDecrypt = NULL;
+	}
+
+	bInit = (mMode == OCB2_AES128) || (ectxEncrypt && ectxDecrypt);
+}
+
+unsigned int CryptState::keyLength(Mode mode) {
+	return (mode == CHACHA20_POLY1305) ? 32 : AES_BLOCK_SIZE;
+}
+
+unsigned int CryptState::overhead(Mode mode) {
+	return 1 + ((mode == OCB2_AES128) ? OCB_TAG_SIZE : AEAD_TAG_SIZE);
+}
+
+unsigned int CryptState::overhead() const {
+	return overhead(mMode);
+}
+
+/*
+ * Modes this build can use, fastest first. Which one wins depends on the
+ * CPU (GCM with AES-NI, ChaCha20 on cores without AES instructions), so it
+ * is measured once rather than guessed.
+ */
+QList<CryptState::Mode> CryptState::fastestModes() {
+	QMutexLocker qml(&qmFastestModes);
+
+	if (bFastestModesRanked)
+		return qlFastestModes;
+
+	QList<QPair<quint64, int> > timings;
+	const Mode modes[] = { OCB2_AES128, AES128_GCM, CHACHA20_POLY1305 };
+	unsigned char plain[100], crypted[100 + 16];
+	memset(plain, 0, sizeof(plain));
+
+	for (unsigned int m=0;m<sizeof(modes)/sizeof(modes[0]);++m) {
+		CryptState cs;
+		cs.genKey(modes[m]);
+		if (! cs.isValid())
+			continue;
+
+		for (int i=0;i<100;++i)
+			cs.encrypt(plain, crypted, sizeof(plain));
+
+		Timer t;
+		for (int i=0;i<2000;++i)
+			cs.encrypt(plain, crypted, sizeof(plain));
+		timings << QPair<quint64, int>(t.elapsed(), modes[m]);
+	}
+
+	qSort(timings);
+
+	typedef QPair<quint64, int> Timing;
+	foreach(const Timing &timing, timings)
+		qlFastestModes << static_cast<Mode>(timing.second);
+
+	bFastestModesRanked = true;
+	return qlFastestModes;
 }
 
 bool CryptState::isValid() const {
 	return bInit;
 }
 
-void CryptState::genKey() {
-	RAND_bytes(raw_key, AES_BLOCK_SIZE);
+void CryptState::genKey(Mode mode) {
+	mMode = mode;
+	RAND_bytes(raw_key, keyLength(mode));
 	RAND_bytes(encrypt_iv, AES_BLOCK_SIZE);
 	RAND_bytes(decrypt_iv, AES_BLOCK_SIZE);
 	AES_set_encrypt_key(raw_key, 128, &encrypt_key);
 	AES_set_decrypt_key(raw_key, 128, &decrypt_key);
-	bInit = true;
+	initCipherContexts();
 }
 
-void CryptState::setKey(const unsigned char *rkey, const unsigned char *eiv, const unsigned char *div) {
-	memcpy(raw_key, rkey, AES_BLOCK_SIZE);
+void CryptState::setKey(const unsigned char *rkey, const unsigned char *eiv, const unsigned char *div, Mode mode) {
+	mMode = mode;
+	memcpy(raw_key, rkey, keyLength(mode));
 	memcpy(encrypt_iv, eiv, AES_BLOCK_SIZE);
 	memcpy(decrypt_iv, div, AES_BLOCK_SIZE);
 	AES_set_encrypt_key(raw_key, 128, &encrypt_key);
 	AES_set_decrypt_key(raw_key, 128, &decrypt_key);
-	bInit = true;
+	initCipherContexts();
 }
 
 void CryptState::setDecryptIV(const unsigned char *iv) {
@@ -85,19 +212,28 @@ void CryptState::encrypt(const unsigned char *source, unsigned char *dst, unsign
 		if (++encrypt_iv[i])
 			break;
 
-	ocb_encrypt(source, dst+4, plain_length, encrypt_iv, tag);
+	if (mMode == OCB2_AES128) {
+		ocb_encrypt(source, dst+4, plain_length, encrypt_iv, tag);
+
+		dst[0] = encrypt_iv[0];
+		dst[1] = tag[0];
+		dst[2] = tag[1];
+		dst[3] = tag[2];
+	} else {
+		// A failure leaves a bad tag, which the receiver drops.
+		if (! aead_encrypt(source, dst + 1 + AEAD_TAG_SIZE, plain_length, encrypt_iv, tag))
+			memset(tag, 0, AEAD_TAG_SIZE);
 
-	dst[0] = encrypt_iv[0];
-	dst[1] = tag[0];
-	dst[2] = tag[1];
-	dst[3] = tag[2];
+		dst[0] = encrypt_iv[0];
+		memcpy(dst + 1, tag, AEAD_TAG_SIZE);
+	}
 }
 
 bool CryptState::decrypt(const unsigned char *source, unsigned char *dst, unsigned int crypted_length) {
-	if (crypted_length < 4)
+	if (crypted_length < overhead())
 		return false;
 
-	unsigned int plain_length = crypted_length - 4;
+	unsigned int plain_length = crypted_length - overhead();
 
 	unsigned char saveiv[AES_BLOCK_SIZE];
 	unsigned char ivbyte = source[0];
@@ -166,9 +302,15 @@ bool CryptState::decrypt(const unsigned char *source, unsigned char *dst, unsign
 		}
 	}
 
-	ocb_decrypt(source+4, dst, plain_length, decrypt_iv, tag);
+	bool authentic;
+	if (mMode == OCB2_AES128) {
+		ocb_decrypt(source+4, dst, plain_length, decrypt_iv, tag);
+		authentic = (memcmp(tag, source+1, OCB_TAG_SIZE) == 0);
+	} else {
+		authentic = aead_decrypt(source + 1 + AEAD_TAG_SIZE, dst, plain_length, decrypt_iv, source+1);
+	}
 
-	if (memcmp(tag, source+1, 3) != 0) {
+	if (! authentic) {
 		memcpy(decrypt_iv, saveiv, AES_BLOCK_SIZE);
 		return false;
 	}
@@ -230,32 +372,60 @@ static void inline ZERO(keyblock &block) {
 		block[i]=0;
 }
 
-#define AESencrypt(src,dst,key) AES_encrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
-#define AESdecrypt(src,dst,key) AES_decrypt(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), key);
+// Number of full OCB blocks handed to the block cipher in one go.
+#define OCB_BATCH 8
+
+void CryptState::aes_encrypt_blocks(const unsigned char *src, unsigned char *dst, unsigned int nblocks) {
+	int outl = 0;
+	if (ectxEncrypt && (EVP_EncryptUpdate(ectxEncrypt, dst, &outl, src, nblocks * AES_BLOCK_SIZE) == 1) && (outl == static_cast<int>(nblocks * AES_BLOCK_SIZE)))
+		return;
+	for (unsigned int i=0;i<nblocks;i++)
+		AES_encrypt(src + i * AES_BLOCK_SIZE, dst + i * AES_BLOCK_SIZE, &encrypt_key);
+}
+
+void CryptState::aes_decrypt_blocks(const unsigned char *src, unsigned char *dst, unsigned int nblocks) {
+	int outl = 0;
+	if (ectxDecrypt && (EVP_DecryptUpdate(ectxDecrypt, dst, &outl, src, nblocks * AES_BLOCK_SIZE) == 1) && (outl == static_cast<int>(nblocks * AES_BLOCK_SIZE)))
+		return;
+	for (unsigned int i=0;i<nblocks;i++)
+		AES_decrypt(src + i * AES_BLOCK_SIZE, dst + i * AES_BLOCK_SIZE, &decrypt_key);
+}
+
+#define AESencrypt(src,dst) aes_encrypt_blocks(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), 1);
+#define AESencryptN(src,dst,n) aes_encrypt_blocks(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), n);
+#define AESdecryptN(src,dst,n) aes_decrypt_blocks(reinterpret_cast<const unsigned char *>(src),reinterpret_cast<unsigned char *>(dst), n);
 
 void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
+	keyblock deltas[OCB_BATCH], blocks[OCB_BATCH];
 
 	// Initialize
-	AESencrypt(nonce, delta, &encrypt_key);
+	AESencrypt(nonce, delta);
 	ZERO(checksum);
 
 	while (len > AES_BLOCK_SIZE) {
-		S2(delta);
-		XOR(tmp, delta, reinterpret_cast<const subblock *>(plain));
-		AESencrypt(tmp, tmp, &encrypt_key);
-		XOR(reinterpret_cast<subblock *>(encrypted), delta, tmp);
-		XOR(checksum, checksum, reinterpret_cast<const subblock *>(plain));
-		len -= AES_BLOCK_SIZE;
-		plain += AES_BLOCK_SIZE;
-		encrypted += AES_BLOCK_SIZE;
+		// Offsets are a serial chain, the block cipher calls are not.
+		unsigned int nblocks = qMin((len - 1) / AES_BLOCK_SIZE, static_cast<unsigned int>(OCB_BATCH));
+		const subblock *src = reinterpret_cast<const subblock *>(plain);
+		for (unsigned int i=0;i<nblocks;i++) {
+			S2(delta);
+			memcpy(deltas[i], delta, AES_BLOCK_SIZE);
+			XOR(blocks[i], delta, src + i * BLOCKSIZE);
+			XOR(checksum, checksum, src + i * BLOCKSIZE);
+		}
+		AESencryptN(blocks, blocks, nblocks);
+		for (unsigned int i=0;i<nblocks;i++)
+			XOR(reinterpret_cast<subblock *>(encrypted) + i * BLOCKSIZE, deltas[i], blocks[i]);
+		len -= nblocks * AES_BLOCK_SIZE;
+		plain += nblocks * AES_BLOCK_SIZE;
+		encrypted += nblocks * AES_BLOCK_SIZE;
 	}
 
 	S2(delta);
 	ZERO(tmp);
 	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
 	XOR(tmp, tmp, delta);
-	AESencrypt(tmp, pad, &encrypt_key);
+	AESencrypt(tmp, pad);
 	memcpy(tmp, plain, len);
 	memcpy(reinterpret_cast<unsigned char *>(tmp)+len, reinterpret_cast<const unsigned char *>(pad)+len, AES_BLOCK_SIZE - len);
 	XOR(checksum, checksum, tmp);
@@ -264,32 +434,41 @@ void CryptState::ocb_encrypt(const unsigned char *plain, unsigned char *encrypte
 
 	S3(delta);
 	XOR(tmp, delta, checksum);
-	AESencrypt(tmp, tag, &encrypt_key);
+	AESencrypt(tmp, tag);
 }
 
 void CryptState::ocb_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
+	keyblock deltas[OCB_BATCH], blocks[OCB_BATCH];
 
 	// Initialize
-	AESencrypt(nonce, delta, &encrypt_key);
+	AESencrypt(nonce, delta);
 	ZERO(checksum);
 
 	while (len > AES_BLOCK_SIZE) {
-		S2(delta);
-		XOR(tmp, delta, reinterpret_cast<const subblock *>(encrypted));
-		AESdecrypt(tmp, tmp, &decrypt_key);
-		XOR(reinterpret_cast<subblock *>(plain), delta, tmp);
-		XOR(checksum, checksum, reinterpret_cast<const subblock *>(plain));
-		len -= AES_BLOCK_SIZE;
-		plain += AES_BLOCK_SIZE;
-		encrypted += AES_BLOCK_SIZE;
+		unsigned int nblocks = qMin((len - 1) / AES_BLOCK_SIZE, static_cast<unsigned int>(OCB_BATCH));
+		const subblock *src = reinterpret_cast<const subblock *>(encrypted);
+		for (unsigned int i=0;i<nblocks;i++) {
+			S2(delta);
+			memcpy(deltas[i], delta, AES_BLOCK_SIZE);
+			XOR(blocks[i], delta, src + i * BLOCKSIZE);
+		}
+		AESdecryptN(blocks, blocks, nblocks);
+		for (unsigned int i=0;i<nblocks;i++) {
+			subblock *dst = reinterpret_cast<subblock *>(plain) + i * BLOCKSIZE;
+			XOR(dst, deltas[i], blocks[i]);
+			XOR(checksum, checksum, dst);
+		}
+		len -= nblocks * AES_BLOCK_SIZE;
+		plain += nblocks * AES_BLOCK_SIZE;
+		encrypted += nblocks * AES_BLOCK_SIZE;
 	}
 
 	S2(delta);
 	ZERO(tmp);
 	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
 	XOR(tmp, tmp, delta);
-	AESencrypt(tmp, pad, &encrypt_key);
+	AESencrypt(tmp, pad);
 	memset(tmp, 0, AES_BLOCK_SIZE);
 	memcpy(tmp, encrypted, len);
 	XOR(tmp, tmp, pad);
@@ -298,5 +477,35 @@ void CryptState::ocb_decrypt(const unsigned char *encrypted, unsigned char *plai
 
 	S3(delta);
 	XOR(tmp, delta, checksum);
-	AESencrypt(tmp, tag, &encrypt_key);
+	AESencrypt(tmp, tag);
+}
+
+// The AEAD nonce is the first 12 bytes (the ciphers' default IV length) of
+// the 16 byte IV counter, which is still unique per packet.
+bool CryptState::aead_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	int outl = 0;
+
+	if (! ectxEncrypt || (EVP_EncryptInit_ex(ectxEncrypt, NULL, NULL, NULL, nonce) != 1))
+		return false;
+	if (len && (EVP_EncryptUpdate(ectxEncrypt, encrypted, &outl, plain, len) != 1))
+		return false;
+	if (EVP_EncryptFinal_ex(ectxEncrypt, encrypted + outl, &outl) != 1)
+		return false;
+	return (EVP_CIPHER_CTX_ctrl(ectxEncrypt, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_SIZE, tag) == 1);
+}
+
+bool CryptState::aead_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, const unsigned char *tag) {
+	int outl = 0;
+	unsigned char expected[AEAD_TAG_SIZE];
+	unsigned char scratch[AES_BLOCK_SIZE];
+
+	memcpy(expected, tag, AEAD_TAG_SIZE);
+
+	if (! ectxDecrypt || (EVP_DecryptInit_ex(ectxDecrypt, NULL, NULL, NULL, nonce) != 1))
+		return false;
+	if (len && (EVP_DecryptUpdate(ectxDecrypt, plain, &outl, encrypted, len) != 1))
+		return false;
+	if (EVP_CIPHER_CTX_ctrl(ectxDecrypt, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_SIZE, expected) != 1)
+		return false;
+	return (EVP_DecryptFinal_ex(ectxDecrypt, scratch, &outl) == 1);
 }
@@ -32,14 +32,26 @@
 #define MUMBLE_CRYPTSTATE_H_
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <QtCore/QList>
 
 #include "Timer.h"
 
+// Large enough for the longest key of any mode (ChaCha20).
+#define CRYPT_MAX_KEY_SIZE 32
+// Largest per-packet header (IV byte and tag) of any mode.
+#define CRYPT_MAX_OVERHEAD 9
+
 class CryptState {
 	private:
 		Q_DISABLE_COPY(CryptState)
+		void initCipherContexts();
 	public:
-		unsigned char raw_key[AES_BLOCK_SIZE];
+		// Values match MumbleProto::CryptSetup::Mode.
+		enum Mode { OCB2_AES128 = 0, AES128_GCM = 1, CHACHA20_POLY1305 = 2 };
+
+		Mode mMode;
+		unsigned char raw_key[CRYPT_MAX_KEY_SIZE];
 		unsigned char encrypt_iv[AES_BLOCK_SIZE];
 		unsigned char decrypt_iv[AES_BLOCK_SIZE];
 		unsigned char decrypt_history[0x100];
@@ -56,19 +68,33 @@ class CryptState {
 
 		AES_KEY	encrypt_key;
 		AES_KEY decrypt_key;
+		EVP_CIPHER_CTX *ectxEncrypt;
+		EVP_CIPHER_CTX *ectxDecrypt;
 		Timer tLastGood;
 		Timer tLastRequest;
 		bool bInit;
 		CryptState();
+		~CryptState();
+
+		static unsigned int keyLength(Mode mode);
+		static unsigned int overhead(Mode mode);
+		static QList<Mode> fastestModes();
 
 		bool isValid() const;
-		void genKey();
-		void setKey(const unsigned char *rkey, const unsigned char *eiv, const unsigned char *div);
+		unsigned int overhead() const;
+		void genKey(Mode mode = OCB2_AES128);
+		void setKey(const unsigned char *rkey, const unsigned char *eiv, const unsigned char *div, Mode mode = OCB2_AES128);
 		void setDecryptIV(const unsigned char *iv);
 
+		void aes_encrypt_blocks(const unsigned char *src, unsigned char *dst, unsigned int nblocks);
+		void aes_decrypt_blocks(const unsigned char *src, unsigned char *dst, unsigned int nblocks);
+
 		void ocb_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag);
 		void ocb_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag);
 
+		bool aead_encrypt(const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag);
+		bool aead_decrypt(const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, const unsigned char *tag);
+
 		bool decrypt(const unsigned char *source, unsigned char *dst, unsigned int crypted_length);
 		void encrypt(const unsigned char *source, unsigned char *dst, unsigned int plain_length);
 };
@@ -121,32 +121,41 @@ QSet<QString> Group::groupNames(Channel *chan) {
 	return m;
 }
 
-#define RET_FALSE (invert ? true : false)
-#define RET_TRUE (invert ? false : true)
-
 bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUser *pl) {
-	Channel *p;
-	Channel *c;
-	Group *g;
+	return GroupRef(curChan, aclChan, name).isMember(pl);
+}
 
-	bool m = false;
-	bool invert = false;
+GroupRef::GroupRef() {
+	kKind = Never;
+	bInvert = false;
+	cContext = NULL;
+	iMinDepth = iMaxDepth = 0;
+}
+
+GroupRef::GroupRef(Channel *curChan, Channel *aclChan, QString name) {
+	Channel *p;
 	bool token = false;
 	bool hash = false;
-	c = curChan;
+
+	kKind = Never;
+	bInvert = false;
+	cContext = curChan;
+	iMinDepth = iMaxDepth = 0;
 
 	while (true) {
-		if (name.isEmpty())
-			return false;
+		if (name.isEmpty()) {
+			bInvert = false;
+			return;
+		}
 
 		if (name.startsWith(QChar::fromLatin1('!'))) {
-			invert = true;
+			bInvert = true;
 			name = name.remove(0,1);
 			continue;
 		}
 
 		if (name.startsWith(QChar::fromLatin1('~'))) {
-			c = aclChan;
+			cContext = aclChan;
 			name = name.remove(0,1);
 			continue;
 		}
@@ -165,22 +174,24 @@ bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUse
 		break;
 	}
 
-	if (token)
-		m = pl->qslAccessTokens.contains(name, Qt::CaseInsensitive);
-	else if (hash)
-		m = pl->qsHash == name;
-	else if (name == QLatin1String("none"))
-		m = false;
+	if (token) {
+		kKind = Token;
+		qsName = name.toCaseFolded();
+	} else if (hash) {
+		kKind = Hash;
+		qsName = name;
+	} else if (name == QLatin1String("none"))
+		kKind = bInvert ? Always : Never;
 	else if (name == QLatin1String("all"))
-		m = true;
+		kKind = bInvert ? Never : Always;
 	else if (name == QLatin1String("auth"))
-		m = (pl->iId >= 0);
+		kKind = Auth;
 	else if (name == QLatin1String("strong"))
-		m = pl->bVerified;
+		kKind = Strong;
 	else if (name == QLatin1String("in"))
-		m = (pl->cChannel == c);
+		kKind = In;
 	else if (name == QLatin1String("out"))
-		m = !(pl->cChannel == c);
+		kKind = Out;
 	else if (name.startsWith(QLatin1String("sub"))) {
 		name = name.remove(0,4);
 		int mindesc = 1;
@@ -199,72 +210,200 @@ bool Group::isMember(Channel *curChan, Channel *aclChan, QString name, ServerUse
 				break;
 		}
 
-		Channel *home = pl->cChannel;
-		QList<Channel *> playerChain;
+		// The group side of the chain only depends on the channels, so
+		// resolve it now and leave the user's depth for isMember().
 		QList<Channel *> groupChain;
 
-		p = home;
-		while (p) {
-			playerChain.prepend(p);
-			p = p->cParent;
-		}
-
 		p = curChan;
 		while (p) {
 			groupChain.prepend(p);
 			p = p->cParent;
 		}
 
-		int cofs = groupChain.indexOf(c);
+		int cofs = groupChain.indexOf(cContext);
 		Q_ASSERT(cofs != -1);
 
 		cofs += minpath;
 
 		if (cofs >= groupChain.count()) {
-			return RET_FALSE;
+			kKind = bInvert ? Always : Never;
+			bInvert = false;
+			return;
 		} else if (cofs < 0) {
 			cofs = 0;
 		}
 
-		Channel *needed = groupChain[cofs];
-		if (playerChain.indexOf(needed) == -1) {
-			return RET_FALSE;
-		}
+		kKind = Sub;
+		cContext = groupChain[cofs];
+		iMinDepth = cofs + mindesc;
+		iMaxDepth = cofs + maxdesc;
+	} else {
+		kKind = Named;
+		qsName = name;
+	}
 
-		int mindepth = cofs + mindesc;
-		int maxdepth = cofs + maxdesc;
+	if ((kKind == Always) || (kKind == Never))
+		bInvert = false;
+}
 
-		int pdepth = playerChain.count() - 1;
+bool GroupRef::isMember(ServerUser *pl) const {
+	Channel *p;
+	bool m = false;
 
-		m = (pdepth >= mindepth) && (pdepth <= maxdepth);
-	} else {
-		QStack<Group *> s;
+	switch (kKind) {
+		case Never:
+			return false;
+		case Always:
+			return true;
+		case Auth:
+			m = (pl->iId >= 0);
+			break;
+		case Strong:
+			m = pl->bVerified;
+			break;
+		case In:
+			m = (pl->cChannel == cContext);
+			break;
+		case Out:
+			m = !(pl->cChannel == cContext);
+			break;
+		case Token:
+			m = pl->qsAccessTokens.contains(qsName);
+			break;
+		case Hash:
+			m = pl->qsHash == qsName;
+			break;
+		case Sub: {
+				bool found = false;
+				int pdepth = -1;
+
+				p = pl->cChannel;
+				while (p) {
+					if (p == cContext)
+						found = true;
+					++pdepth;
+					p = p->cParent;
+				}
+
+				m = found && (pdepth >= iMinDepth) && (pdepth <= iMaxDepth);
+			}
+			break;
+		case Named: {
+				GroupIndex *gi = cContext->qhGroupIndex.value(qsName);
+				if (! gi) {
+					gi = new GroupIndex(cContext, qsName);
+					cContext->qhGroupIndex.insert(qsName, gi);
+				}
+				m = gi->isMember(pl);
+			}
+			break;
+	}
+	return bInvert ? !m : m;
+}
 
-		p = c;
+bool GroupRef::operator ==(const GroupRef &other) const {
+	return (kKind == other.kKind) && (bInvert == other.bInvert) && (cContext == other.cContext) && (qsName == other.qsName) && (iMinDepth == other.iMinDepth) && (iMaxDepth == other.iMaxDepth);
+}
 
-		while (p) {
-			g = p->qhGroups.value(name);
-
-			if (g) {
-				if ((p != c) && ! g->bInheritable)
-					break;
-				s.push(g);
-				if (! g->bInherit)
-					break;
-			}
+GroupIndex::GroupIndex(Channel *c, const QString &name) {
+	Channel *p = c;
+	Group *g;
 
-			p = p->cParent;
+	while (p) {
+		g = p->qhGroups.value(name);
+
+		if (g) {
+			if ((p != c) && ! g->bInheritable)
+				break;
+			qlStack.prepend(g);
+			if (! g->bInherit)
+				break;
+		}
+
+		p = p->cParent;
+	}
+
+	for (int i=0;i<qlStack.count();++i) {
+		g = qlStack.at(i);
+		int pos = i + 1;
+
+		foreach(int key, g->qsAdd)
+			qhIds.insert(key, pos);
+		foreach(int key, g->qsTemporary) {
+			qhIds.insert(key, pos);
+			qhTemporary.insert(key, pos);
 		}
+		foreach(int key, g->qsRemove)
+			qhIds.insert(key, -pos);
+	}
+}
+
+void GroupIndex::update(int key) {
+	int id = 0;
+	int temp = 0;
+
+	for (int i=0;i<qlStack.count();++i) {
+		const Group *g = qlStack.at(i);
+		int pos = i + 1;
 
-		while (! s.isEmpty()) {
-			g = s.pop();
-			if (g->qsAdd.contains(pl->iId) || g->qsTemporary.contains(pl->iId) || g->qsTemporary.contains(- static_cast<int>(pl->uiSession)))
-				m = true;
-			if (g->qsRemove.contains(pl->iId))
-				m = false;
+		if (g->qsAdd.contains(key))
+			id = pos;
+		if (g->qsTemporary.contains(key))
+			id = temp = pos;
+		if (g->qsRemove.contains(key))
+			id = -pos;
+	}
+
+	if (id)
+		qhIds.insert(key, id);
+	else
+		qhIds.remove(key);
+
+	if (temp)
+		qhTemporary.insert(key, temp);
+	else
+		qhTemporary.remove(key);
+}
+
+// The user matches by id in qsAdd, qsTemporary and qsRemove, and by session
+// in qsTemporary only. Whichever was decided by the later group wins; on a
+// tie the id decides, as a removal overrides a temporary session.
+bool GroupIndex::isMember(ServerUser *pl) const {
+	int id = qhIds.value(pl->iId);
+	int session = qhTemporary.value(- static_cast<int>(pl->uiSession));
+
+	if (session > qAbs(id))
+		return true;
+	return (id > 0);
+}
+
+// Drop the index of name (or of every group) in c and below.
+void Group::clearIndex(Channel *c, const QString &name) {
+	QSet<Channel *> chans = c->allChildren();
+	chans.insert(c);
+
+	foreach(Channel *ch, chans) {
+		if (name.isNull()) {
+			qDeleteAll(ch->qhGroupIndex);
+			ch->qhGroupIndex.clear();
+		} else {
+			delete ch->qhGroupIndex.take(name);
 		}
 	}
-	return invert ? !m : m;
+}
+
+// Refresh key in every index this group is part of, after key was added
+// to or removed from one of its sets. Only channels at or below ours can
+// inherit it.
+void Group::updateIndex(int key) {
+	QSet<Channel *> chans = c->allChildren();
+	chans.insert(c);
+
+	foreach(Channel *ch, chans) {
+		GroupIndex *gi = ch->qhGroupIndex.value(qsName);
+		if (gi && gi->qlStack.contains(this))
+			gi->update(key);
+	}
 }
 
 #endif
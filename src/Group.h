@@ -31,6 +31,8 @@
 #ifndef MUMBLE_GROUP_H_
 #define MUMBLE_GROUP_H_
 
+#include <QtCore/QHash>
+#include <QtCore/QList>
 #include <QtCore/QSet>
 
 class Channel;
@@ -56,7 +58,49 @@ class Group {
 		static Group *getGroup(Channel *c, QString name);
 
 		static bool isMember(Channel *c, Channel *aclChan, QString name, ServerUser *);
+
+		static void clearIndex(Channel *c, const QString &name = QString());
+		void updateIndex(int key);
 #endif
 };
 
+#ifdef MURMUR
+// A group name from an ACL, parsed once and resolved against the channel
+// it is evaluated in. Only the user dependent part is left for isMember().
+class GroupRef {
+	public:
+		enum Kind { Never, Always, Auth, Strong, In, Out, Sub, Token, Hash, Named };
+
+		Kind kKind;
+		bool bInvert;
+		Channel *cContext;
+		QString qsName;
+		int iMinDepth;
+		int iMaxDepth;
+
+		GroupRef();
+		GroupRef(Channel *c, Channel *aclChan, QString name);
+		bool isMember(ServerUser *) const;
+		bool operator ==(const GroupRef &) const;
+};
+
+// Members of a group name as seen from one channel, with the inherited
+// groups folded together. Keys are user ids and negated sessions, as in
+// Group::qsTemporary. Values are the 1-based position in qlStack of the
+// group that decided the key; qhIds stores it negated if that group
+// removed the user. Built on demand and kept under Server::qmCache.
+class GroupIndex {
+	private:
+		Q_DISABLE_COPY(GroupIndex)
+	public:
+		QList<Group *> qlStack;
+		QHash<int, int> qhIds;
+		QHash<int, int> qhTemporary;
+
+		GroupIndex(Channel *c, const QString &name);
+		void update(int key);
+		bool isMember(ServerUser *) const;
+};
+#endif
+
 #endif
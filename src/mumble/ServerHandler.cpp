@@ -179,7 +179,7 @@ void ServerHandler::udpReady() {
 			continue;
 		}
 
-		PacketDataStream pds(buffer + 1, buflen-5);
+		PacketDataStream pds(buffer + 1, buflen - connection->csCrypt.overhead() - 1);
 
 		MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
 		unsigned int msgFlags = buffer[0] & 0x1f;
@@ -220,7 +220,7 @@ void ServerHandler::handleVoicePacket(unsigned int msgFlags, PacketDataStream &p
 }
 
 void ServerHandler::sendMessage(const char *data, int len, bool force) {
-	STACKVAR(unsigned char, crypto, len+4);
+	STACKVAR(unsigned char, crypto, len + CRYPT_MAX_OVERHEAD);
 
 	QMutexLocker qml(&qmUdp);
 
@@ -243,7 +243,7 @@ void ServerHandler::sendMessage(const char *data, int len, bool force) {
 		QApplication::postEvent(this, new ServerHandlerMessageEvent(qba, MessageHandler::UDPTunnel, true));
 	} else {
 		connection->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), crypto, len);
-		qusUdp->writeDatagram(reinterpret_cast<const char *>(crypto), len + 4, qhaRemote, usPort);
+		qusUdp->writeDatagram(reinterpret_cast<const char *>(crypto), len + connection->csCrypt.overhead(), qhaRemote, usPort);
 	}
 }
 
@@ -489,7 +489,9 @@ void ServerHandler::message(unsigned int msgType, const QByteArray &qbaMsg) {
 			}
 		}
 	} else {
-		ServerHandlerMessageEvent *shme=new ServerHandlerMessageEvent(qbaMsg, msgType, false);
+		// qbaMsg points into the connection's receive buffer, so the event
+		// needs a copy of its own.
+		ServerHandlerMessageEvent *shme=new ServerHandlerMessageEvent(QByteArray(qbaMsg.constData(), qbaMsg.size()), msgType, false);
 		QApplication::postEvent(g.mw, shme);
 	}
 }
@@ -567,6 +569,8 @@ void ServerHandler::serverConnectionConnected() {
 
 	mpv.set_os(u8(OSInfo::getOS()));
 	mpv.set_os_version(u8(OSInfo::getOSVersion()));
+	foreach(CryptState::Mode mode, CryptState::fastestModes())
+		mpv.add_crypto_modes(static_cast<MumbleProto::CryptSetup_Mode>(mode));
 	sendMessage(mpv);
 
 	MumbleProto::Authenticate mpa;
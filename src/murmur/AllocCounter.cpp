@@ -0,0 +1,143 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "murmur_pch.h"
+
+#include "AllocCounter.h"
+
+#ifdef USE_ALLOC_COUNTER
+
+#include <new>
+#include <stdlib.h>
+
+static volatile quint64 uiAllocations = 0;
+
+#if defined(_MSC_VER)
+#define ALLOC_COUNT() InterlockedIncrement64(reinterpret_cast<volatile LONGLONG *>(&uiAllocations))
+#else
+#define ALLOC_COUNT() __sync_fetch_and_add(&uiAllocations, 1)
+#endif
+
+#if defined(__GLIBC__)
+
+// Count at the malloc level, so that allocations made by C code (OpenSSL,
+// the SQL drivers) and by Qt's own QArrayData are seen too. glibc lets a
+// program replace these and still reach its allocator through the
+// __libc_ names. operator new ends up here as well.
+
+extern "C" {
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) __THROW {
+	ALLOC_COUNT();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) __THROW {
+	ALLOC_COUNT();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *p, size_t size) __THROW {
+	ALLOC_COUNT();
+	return __libc_realloc(p, size);
+}
+
+}
+
+#else
+
+#if __cplusplus >= 201103L
+#define ALLOC_THROW
+#define ALLOC_NOTHROW noexcept
+#else
+#define ALLOC_THROW throw(std::bad_alloc)
+#define ALLOC_NOTHROW throw()
+#endif
+
+void *operator new(size_t size) ALLOC_THROW {
+	ALLOC_COUNT();
+	void *p = malloc(size ? size : 1);
+	if (! p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size) ALLOC_THROW {
+	ALLOC_COUNT();
+	void *p = malloc(size ? size : 1);
+	if (! p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) ALLOC_NOTHROW {
+	ALLOC_COUNT();
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) ALLOC_NOTHROW {
+	ALLOC_COUNT();
+	return malloc(size ? size : 1);
+}
+
+void operator delete(void *p) ALLOC_NOTHROW {
+	free(p);
+}
+
+void operator delete[](void *p) ALLOC_NOTHROW {
+	free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) ALLOC_NOTHROW {
+	free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) ALLOC_NOTHROW {
+	free(p);
+}
+
+#endif
+
+quint64 allocationCount() {
+	return uiAllocations;
+}
+
+#else
+
+quint64 allocationCount() {
+	return 0;
+}
+
+#endif
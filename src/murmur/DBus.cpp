@@ -330,6 +330,7 @@ void MurmurDBus::authenticateSlot(int &res, QString &uname, int sessionId, const
 #define PLAYER_SETUP PLAYER_SETUP_VAR(session)
 
 #define CHANNEL_SETUP_VAR2(dst,var) \
+  server->wake(); \
   Channel *dst = server->qhChannels.value(var); \
   if (! dst) { \
     qdbc.send(msg.createErrorReply("net.sourceforge.mumble.Error.channel", "Invalid channel id")); \
@@ -348,6 +349,7 @@ void MurmurDBus::getPlayers(QList<PlayerInfoExtended> &a) {
 
 void MurmurDBus::getChannels(QList<ChannelInfo> &a) {
 	a.clear();
+	server->wake();
 	QQueue<Channel *> q;
 	q << server->qhChannels.value(0);
 	while (! q.isEmpty()) {
@@ -536,7 +538,7 @@ void MurmurDBus::setACL(int id, const QList<ACLInfo> &acls, const QList<GroupInf
 		a->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(cChannel);
 	server->updateChannel(cChannel);
 }
 
@@ -0,0 +1,112 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_JOINIMAGE_H_
+#define MUMBLE_MURMUR_JOINIMAGE_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QPair>
+#include <QtCore/QSet>
+#include <QtCore/QtGlobal>
+
+/// Serialized messages for a joining client, one block per key (a session
+/// or a channel id) laid out back to back. A block that changes is spliced
+/// in place, so keeping the image current costs one serialization and a
+/// move of the bytes behind it, not a rebuild of every block.
+///
+/// The owner marks keys with invalidate() as changes are broadcast, and
+/// reserializes the keys in qsDirty before it hands out image() again.
+class JoinImage {
+	private:
+		Q_DISABLE_COPY(JoinImage)
+	protected:
+		QByteArray qbaImage;
+		// Offset and length of each block in qbaImage.
+		QHash<unsigned int, QPair<int, int> > qhBlocks;
+	public:
+		QSet<unsigned int> qsDirty;
+		// False until built in full, and again after clear().
+		bool bValid;
+
+		JoinImage() : bValid(false) {}
+
+		const QByteArray &image() const {
+			return qbaImage;
+		}
+
+		bool contains(unsigned int key) const {
+			return qhBlocks.contains(key);
+		}
+
+		void clear() {
+			qbaImage.clear();
+			qhBlocks.clear();
+			qsDirty.clear();
+			bValid = false;
+		}
+
+		/// Note that the block of key is out of date. Nothing to do while
+		/// the image is due for a full build anyway.
+		void invalidate(unsigned int key) {
+			if (bValid)
+				qsDirty.insert(key);
+		}
+
+		/// Replace the block of key, append it if key has none yet, or
+		/// remove it if block is empty.
+		void set(unsigned int key, const QByteArray &block) {
+			QHash<unsigned int, QPair<int, int> >::iterator i = qhBlocks.find(key);
+			if (i == qhBlocks.end()) {
+				if (! block.isEmpty()) {
+					qhBlocks.insert(key, qMakePair(qbaImage.size(), block.size()));
+					qbaImage.append(block);
+				}
+				return;
+			}
+
+			const int offset = i.value().first;
+			const int delta = block.size() - i.value().second;
+			qbaImage.replace(offset, i.value().second, block);
+			if (block.isEmpty())
+				qhBlocks.erase(i);
+			else
+				i.value().second = block.size();
+
+			if (delta != 0) {
+				for (i = qhBlocks.begin(); i != qhBlocks.end(); ++i)
+					if (i.value().first > offset)
+						i.value().first += delta;
+			}
+		}
+};
+
+#endif
@@ -96,6 +96,193 @@
 		sendMessage(uSource, mppd); \
 	}
 
+/// The ChannelState a joining client is sent for c. With hashes,
+/// descriptions are sent as hashes, which clients understand from 1.2.2 on.
+QByteArray Server::joinChannel(Channel *c, bool hashes) {
+	MumbleProto::ChannelState mpcs;
+
+	mpcs.set_channel_id(c->iId);
+	if (c->cParent)
+		mpcs.set_parent(c->cParent->iId);
+	if (c->iId == 0)
+		mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
+	else
+		mpcs.set_name(u8(c->qsName));
+
+	mpcs.set_position(c->iPosition);
+
+	if (hashes && ! c->qbaDescHash.isEmpty())
+		mpcs.set_description_hash(blob(c->qbaDescHash));
+	else if (! c->qsDesc.isEmpty())
+		mpcs.set_description(u8(c->qsDesc));
+
+	QByteArray block;
+	Connection::messageToNetwork(mpcs, MessageHandler::ChannelState, block);
+	return block;
+}
+
+/// Serialized ChannelState messages for the whole channel tree, parents
+/// first; what a joining client is sent ahead of joinLinks(). Built in full
+/// on first use and after a channel moves, otherwise patched one channel at
+/// a time.
+const QByteArray &Server::joinChannels(bool hashes) {
+	JoinImage &ji = jiChannels[hashes ? 1 : 0];
+	int serialized = 0;
+
+	if (! ji.bValid) {
+		ji.clear();
+
+		QQueue<Channel *> q;
+		q << qhChannels.value(0);
+		while (! q.isEmpty()) {
+			Channel *c = q.dequeue();
+			ji.set(c->iId, joinChannel(c, hashes));
+			++serialized;
+
+			foreach(c, c->qlChannels)
+				q.enqueue(c);
+		}
+		ji.bValid = true;
+
+		QMutexLocker qml(&qmStatistics);
+		++qhStatistics[QLatin1String("join.channels.rebuilds")];
+	} else if (! ji.qsDirty.isEmpty()) {
+		// New channels are appended, so parents have to go first.
+		QMultiMap<int, unsigned int> byDepth;
+		foreach(unsigned int id, ji.qsDirty) {
+			int depth = 0;
+			for (Channel *c = qhChannels.value(id); c; c = c->cParent)
+				++depth;
+			byDepth.insert(depth, id);
+		}
+		ji.qsDirty.clear();
+
+		foreach(unsigned int id, byDepth) {
+			Channel *c = qhChannels.value(id);
+			if (c) {
+				ji.set(id, joinChannel(c, hashes));
+				++serialized;
+			} else {
+				ji.set(id, QByteArray());
+			}
+		}
+	}
+
+	if (serialized > 0) {
+		QMutexLocker qml(&qmStatistics);
+		qhStatistics[QLatin1String("join.channels.serialized")] += serialized;
+	}
+
+	return ji.image();
+}
+
+/// Serialized ChannelState messages with the links of every linked channel,
+/// sent after joinChannels() so all the channels they name are known.
+const QByteArray &Server::joinLinks() {
+	if (! qbaJoinLinks.isNull())
+		return qbaJoinLinks;
+
+	qbaJoinLinks = QByteArray("");
+
+	MumbleProto::ChannelState mpcs;
+	QByteArray block;
+	foreach(Channel *c, qhChannels) {
+		if (c->qhLinks.isEmpty())
+			continue;
+
+		mpcs.Clear();
+		mpcs.set_channel_id(c->iId);
+		foreach(Channel *l, c->qhLinks.keys())
+			mpcs.add_links(l->iId);
+		Connection::messageToNetwork(mpcs, MessageHandler::ChannelState, block);
+		qbaJoinLinks.append(block);
+	}
+
+	return qbaJoinLinks;
+}
+
+/// The UserState a joining client of the given variant is sent for u.
+QByteArray Server::joinUser(ServerUser *u, JoinVariant jv) {
+	MumbleProto::UserState mpus;
+
+	mpus.set_session(u->uiSession);
+	mpus.set_name(u8(u->qsName));
+	if (u->iId >= 0)
+		mpus.set_user_id(u->iId);
+	if (jv == JoinHashes) {
+		if (! u->qbaTextureHash.isEmpty())
+			mpus.set_texture_hash(blob(u->qbaTextureHash));
+		else if (! u->qbaTexture.isEmpty())
+			mpus.set_texture(blob(u->qbaTexture));
+	} else if (jv == JoinTextures) {
+		mpus.set_texture(blob(u->qbaTexture));
+	}
+	if (u->cChannel->iId != 0)
+		mpus.set_channel_id(u->cChannel->iId);
+	if (u->bDeaf)
+		mpus.set_deaf(true);
+	else if (u->bMute)
+		mpus.set_mute(true);
+	if (u->bSuppress)
+		mpus.set_suppress(true);
+	if (u->bPrioritySpeaker)
+		mpus.set_priority_speaker(true);
+	if (u->bRecording)
+		mpus.set_recording(true);
+	if (u->bSelfDeaf)
+		mpus.set_self_deaf(true);
+	else if (u->bSelfMute)
+		mpus.set_self_mute(true);
+	if ((jv == JoinHashes) && ! u->qbaCommentHash.isEmpty())
+		mpus.set_comment_hash(blob(u->qbaCommentHash));
+	else if (! u->qsComment.isEmpty())
+		mpus.set_comment(u8(u->qsComment));
+	if (! u->qsHash.isEmpty())
+		mpus.set_hash(u8(u->qsHash));
+
+	QByteArray block;
+	Connection::messageToNetwork(mpus, MessageHandler::UserState, block);
+	return block;
+}
+
+/// Serialized UserState messages for every authenticated user, in the form
+/// a joining client of the given variant is sent. Built in full on first
+/// use; after that only the users updateJoinState() marked are serialized
+/// again and spliced in.
+const QByteArray &Server::joinUsers(JoinVariant jv) {
+	JoinImage &ji = jiUsers[jv];
+	int serialized = 0;
+
+	if (! ji.bValid) {
+		ji.clear();
+		foreach(ServerUser *u, qhUsers) {
+			if (u->sState != ServerUser::Authenticated)
+				continue;
+			ji.set(u->uiSession, joinUser(u, jv));
+			++serialized;
+		}
+		ji.bValid = true;
+	} else if (! ji.qsDirty.isEmpty()) {
+		foreach(unsigned int session, ji.qsDirty) {
+			ServerUser *u = qhUsers.value(session);
+			if (u && (u->sState == ServerUser::Authenticated)) {
+				ji.set(session, joinUser(u, jv));
+				++serialized;
+			} else {
+				ji.set(session, QByteArray());
+			}
+		}
+		ji.qsDirty.clear();
+	}
+
+	if (serialized > 0) {
+		QMutexLocker qml(&qmStatistics);
+		qhStatistics[QLatin1String("join.users.serialized")] += serialized;
+	}
+
+	return ji.image();
+}
+
 void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg) {
 	if ((msg.tokens_size() > 0) || (uSource->sState == ServerUser::Authenticated)) {
 		QStringList qsl;
@@ -104,13 +291,15 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		{
 			QMutexLocker qml(&qmCache);
 			uSource->qslAccessTokens = qsl;
+			uSource->qsAccessTokens.clear();
+			foreach(const QString &token, qsl)
+				uSource->qsAccessTokens.insert(token.toCaseFolded());
 		}
 		clearACLCache(uSource);
 	}
 	MSG_SETUP(ServerUser::Connected);
 
 	Channel *root = qhChannels.value(0);
-	Channel *c;
 
 	uSource->qsName = u8(msg.username());
 
@@ -194,13 +383,31 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		uOld->disconnectSocket(true);
 	}
 
-	// Setup UDP encryption
-	uSource->csCrypt.genKey();
+	// Setup UDP encryption. Use our fastest mode the client also knows;
+	// clients that announce nothing only speak OCB2.
+	CryptState::Mode mode = CryptState::OCB2_AES128;
+	foreach(CryptState::Mode m, CryptState::fastestModes()) {
+		if ((m == CryptState::OCB2_AES128) || uSource->qlCryptModes.contains(m)) {
+			mode = m;
+			break;
+		}
+	}
 
 	MumbleProto::CryptSetup mpcrypt;
-	mpcrypt.set_key(std::string(reinterpret_cast<const char *>(uSource->csCrypt.raw_key), AES_BLOCK_SIZE));
-	mpcrypt.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
-	mpcrypt.set_client_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.decrypt_iv), AES_BLOCK_SIZE));
+	{
+		QMutexLocker qml(&uSource->qmCrypt);
+		uSource->csCrypt.genKey(mode);
+
+		mpcrypt.set_key(std::string(reinterpret_cast<const char *>(uSource->csCrypt.raw_key), CryptState::keyLength(mode)));
+		mpcrypt.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
+		mpcrypt.set_client_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.decrypt_iv), AES_BLOCK_SIZE));
+		if (mode != CryptState::OCB2_AES128)
+			mpcrypt.set_mode(static_cast<MumbleProto::CryptSetup_Mode>(mode));
+	}
+	{
+		QWriteLocker wl(&qrwlUsers);
+		setUdpHint(uSource);
+	}
 	sendMessage(uSource, mpcrypt);
 
 	bool fake_celt_support = false;
@@ -225,49 +432,9 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 		sendTextMessage(NULL, uSource, false, QLatin1String("<strong>WARNING:</strong> Your client doesn't support the CELT codec, you won't be able to talk to or hear most clients. Please make sure your client was built with CELT support."));
 	}
 
-	// Transmit channel tree
-	QQueue<Channel *> q;
-	QSet<Channel *> chans;
-	q << root;
-	MumbleProto::ChannelState mpcs;
-	while (! q.isEmpty()) {
-		c = q.dequeue();
-		chans.insert(c);
-
-		mpcs.Clear();
-
-		mpcs.set_channel_id(c->iId);
-		if (c->cParent)
-			mpcs.set_parent(c->cParent->iId);
-		if (c->iId == 0)
-			mpcs.set_name(u8(qsRegName.isEmpty() ? QLatin1String("Root") : qsRegName));
-		else
-			mpcs.set_name(u8(c->qsName));
-
-		mpcs.set_position(c->iPosition);
-
-		if ((uSource->uiVersion >= 0x010202) && ! c->qbaDescHash.isEmpty())
-			mpcs.set_description_hash(blob(c->qbaDescHash));
-		else if (! c->qsDesc.isEmpty())
-			mpcs.set_description(u8(c->qsDesc));
-
-		sendMessage(uSource, mpcs);
-
-		foreach(c, c->qlChannels)
-			q.enqueue(c);
-	}
-
-	// Transmit links
-	foreach(c, chans) {
-		if (c->qhLinks.count() > 0) {
-			mpcs.Clear();
-			mpcs.set_channel_id(c->iId);
-
-			foreach(Channel *l, c->qhLinks.keys())
-				mpcs.add_links(l->iId);
-			sendMessage(uSource, mpcs);
-		}
-	}
+	// Transmit channel tree and links
+	uSource->sendMessage(joinChannels(uSource->uiVersion >= 0x010202));
+	uSource->sendMessage(joinLinks());
 
 	// Transmit user profile
 	MumbleProto::UserState mpus;
@@ -287,7 +454,6 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 
 	userEnterChannel(uSource, lc, mpus);
 
-	uSource->sState = ServerUser::Authenticated;
 	mpus.set_session(uSource->uiSession);
 	mpus.set_name(u8(uSource->qsName));
 	if (uSource->iId >= 0) {
@@ -314,6 +480,15 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	if (uSource->cChannel->iId != 0)
 		mpus.set_channel_id(uSource->cChannel->iId);
 
+	// Taken once a registered texture is loaded, which decides the variant,
+	// and before uSource counts as authenticated, so it isn't in there.
+	JoinVariant jv = JoinHashes;
+	if (uSource->uiVersion < 0x010202)
+		jv = ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4)) ? JoinTextures : JoinPlain;
+	const QByteArray qbaUsers = joinUsers(jv);
+
+	uSource->sState = ServerUser::Authenticated;
+
 	sendAll(mpus, 0x010202);
 
 	if ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4))
@@ -323,51 +498,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 	sendAll(mpus, ~ 0x010202);
 
 	// Transmit other users profiles
-	foreach(ServerUser *u, qhUsers) {
-		if (u->sState != ServerUser::Authenticated)
-			continue;
-
-		if (u == uSource)
-			continue;
-
-		mpus.Clear();
-		mpus.set_session(u->uiSession);
-		mpus.set_name(u8(u->qsName));
-		if (u->iId >= 0)
-			mpus.set_user_id(u->iId);
-		if (uSource->uiVersion >= 0x010202) {
-			if (! u->qbaTextureHash.isEmpty())
-				mpus.set_texture_hash(blob(u->qbaTextureHash));
-			else if (! u->qbaTexture.isEmpty())
-				mpus.set_texture(blob(u->qbaTexture));
-		} else if ((uSource->qbaTexture.length() >= 4) && (qFromBigEndian<unsigned int>(reinterpret_cast<const unsigned char *>(uSource->qbaTexture.constData())) == 600 * 60 * 4)) {
-			mpus.set_texture(blob(u->qbaTexture));
-		}
-		if (u->cChannel->iId != 0)
-			mpus.set_channel_id(u->cChannel->iId);
-		if (u->bDeaf)
-			mpus.set_deaf(true);
-		else if (u->bMute)
-			mpus.set_mute(true);
-		if (u->bSuppress)
-			mpus.set_suppress(true);
-		if (u->bPrioritySpeaker)
-			mpus.set_priority_speaker(true);
-		if (u->bRecording)
-			mpus.set_recording(true);
-		if (u->bSelfDeaf)
-			mpus.set_self_deaf(true);
-		else if (u->bSelfMute)
-			mpus.set_self_mute(true);
-		if ((uSource->uiVersion >= 0x010202) && ! u->qbaCommentHash.isEmpty())
-			mpus.set_comment_hash(blob(u->qbaCommentHash));
-		else if (! u->qsComment.isEmpty())
-			mpus.set_comment(u8(u->qsComment));
-		if (! u->qsHash.isEmpty())
-			mpus.set_hash(u8(u->qsHash));
-
-		sendMessage(uSource, mpus);
-	}
+	uSource->sendMessage(qbaUsers);
 
 	// Send syncronisation packet
 	MumbleProto::ServerSync mpss;
@@ -405,6 +536,7 @@ void Server::msgAuthenticate(ServerUser *uSource, MumbleProto::Authenticate &msg
 
 	log(uSource, "Authenticated");
 
+	ServerScope ss(this);
 	emit userConnected(uSource);
 }
 
@@ -471,7 +603,8 @@ void Server::msgUDPTunnel(ServerUser *uSource, MumbleProto::UDPTunnel &msg) {
 	int len = static_cast<int>(str.length());
 	if (len < 1)
 		return;
-	QReadLocker rl(&qrwlUsers);
+	// processMsg() takes qrwlUsers itself when it needs to. Users are only
+	// freed from this thread, so uSource outlives the call.
 	processMsg(uSource, str.data(), len);
 }
 
@@ -612,8 +745,20 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 		bBroadcast = true;
 	}
 
+	if (msg.has_self_deaf() || msg.has_self_mute()) {
+		QWriteLocker wl(&qrwlUsers);
+		++uiRouteGeneration;
+		rebuildWhisperRoutesTo(uSource);
+	}
+
 	if (msg.has_plugin_context()) {
-		uSource->ssContext = msg.plugin_context();
+		{
+			QWriteLocker wl(&qrwlUsers);
+			uSource->ssContext = msg.plugin_context();
+			++uiRouteGeneration;
+			rebuildWhisperRoutes(uSource);
+			rebuildWhisperRoutesTo(uSource);
+		}
 		// Make sure to clear this from the packet so we don't broadcast it
 		msg.clear_plugin_context();
 	}
@@ -650,6 +795,11 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 				pDstServerUser->bDeaf = false;
 			}
 		}
+		if (msg.has_deaf() || msg.has_mute()) {
+			QWriteLocker wl(&qrwlUsers);
+			++uiRouteGeneration;
+			rebuildWhisperRoutesTo(pDstServerUser);
+		}
 		if (msg.has_suppress())
 			pDstServerUser->bSuppress = msg.suppress();
 
@@ -741,6 +891,7 @@ void Server::msgUserState(ServerUser *uSource, MumbleProto::UserState &msg) {
 			clearACLCache(pDstServerUser);
 	}
 
+	ServerScope ss(this);
 	emit userStateChanged(pDstServerUser);
 }
 
@@ -894,12 +1045,13 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			a->pDeny=ChanACL::None;
 			a->pAllow=ChanACL::Write | ChanACL::Traverse;
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 		updateChannel(c);
 
 		msg.set_channel_id(c->iId);
 		log(uSource, QString("Added channel %1 under %2").arg(QString(*c), QString(*p)));
+		ServerScope ss(this);
 		emit channelCreated(c);
 
 		sendAll(msg, ~ 0x010202);
@@ -916,6 +1068,7 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			mpus.set_channel_id(c->iId);
 			userEnterChannel(uSource, c, mpus);
 			sendAll(mpus);
+			ServerScope ss(this);
 			emit userStateChanged(uSource);
 		}
 	} else {
@@ -1016,8 +1169,13 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 			        QString(* c->cParent),
 			        QString(*p)));
 
-			c->cParent->removeChannel(c);
+			Channel *oldparent = c->cParent;
+			oldparent->removeChannel(c);
 			p->addChannel(c);
+			// ACL chains and cached permissions follow the old ancestry.
+			clearACLCache(c, true);
+			rebuildWhisperRoutes(oldparent);
+			rebuildWhisperRoutes(p);
 		}
 		if (! qsName.isNull()) {
 			log(uSource, QString("Renamed channel %1 to %2").arg(QString(*c),
@@ -1038,6 +1196,7 @@ void Server::msgChannelState(ServerUser *uSource, MumbleProto::ChannelState &msg
 		}
 
 		updateChannel(c);
+		ServerScope ss(this);
 		emit channelStateChanged(c);
 
 		sendAll(msg, ~ 0x010202);
@@ -1162,6 +1321,7 @@ void Server::msgTextMessage(ServerUser *uSource, MumbleProto::TextMessage &msg)
 	foreach(ServerUser *u, users)
 		sendMessage(u, msg);
 
+	ServerScope ss(this);
 	emit userTextMessage(uSource, tm);
 }
 
@@ -1307,7 +1467,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 			a->pAllow=static_cast<ChanACL::Permissions>(mpacl.grant()) & ChanACL::All;
 		}
 
-		clearACLCache();
+		clearACLCache(c);
 
 		if (! hasPermission(uSource, c, ChanACL::Write) && ((uSource->iId >= 0) || !uSource->qsHash.isEmpty())) {
 			a = new ChanACL(c);
@@ -1321,7 +1481,7 @@ void Server::msgACL(ServerUser *uSource, MumbleProto::ACL &msg) {
 			a->pDeny=ChanACL::None;
 			a->pAllow=ChanACL::Write | ChanACL::Traverse;
 
-			clearACLCache();
+			clearACLCache(c);
 		}
 
 		updateChannel(c);
@@ -1384,19 +1544,31 @@ void Server::msgPing(ServerUser *uSource, MumbleProto::Ping &msg) {
 	msg.set_resync(cs.uiResync);
 
 	sendMessage(uSource, msg);
+	// Ping replies measure latency, so they skip the coalescing window.
+	uSource->flushOutput();
 }
 
 void Server::msgCryptSetup(ServerUser *uSource, MumbleProto::CryptSetup &msg) {
 	MSG_SETUP_NO_UNIDLE(ServerUser::Authenticated);
 	if (! msg.has_client_nonce()) {
 		log(uSource, "Requested crypt-nonce resync");
-		msg.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
+		{
+			QMutexLocker qml(&uSource->qmCrypt);
+			msg.set_server_nonce(std::string(reinterpret_cast<const char *>(uSource->csCrypt.encrypt_iv), AES_BLOCK_SIZE));
+		}
 		sendMessage(uSource, msg);
+		// Voice from us is undecryptable until the client has this.
+		uSource->flushOutput();
 	} else {
 		const std::string &str = msg.client_nonce();
 		if (str.size()  == AES_BLOCK_SIZE) {
-			uSource->csCrypt.uiResync++;
-			memcpy(uSource->csCrypt.decrypt_iv, str.data(), AES_BLOCK_SIZE);
+			{
+				QMutexLocker qml(&uSource->qmCrypt);
+				uSource->csCrypt.uiResync++;
+				memcpy(uSource->csCrypt.decrypt_iv, str.data(), AES_BLOCK_SIZE);
+			}
+			QWriteLocker wl(&qrwlUsers);
+			setUdpHint(uSource);
 		}
 	}
 }
@@ -1414,6 +1586,7 @@ void Server::msgContextAction(ServerUser *uSource, MumbleProto::ContextAction &m
 		return;
 	if ((id >= 0) && ! qhChannels.contains(id))
 		return;
+	ServerScope ss(this);
 	emit contextAction(uSource, u8(msg.action()), session, id);
 }
 
@@ -1427,6 +1600,9 @@ void Server::msgVersion(ServerUser *uSource, MumbleProto::Version &msg) {
 		if (msg.has_os_version())
 			uSource->qsOSVersion = u8(msg.os_version());
 	}
+	uSource->qlCryptModes.clear();
+	for (int i=0;i < msg.crypto_modes_size(); ++i)
+		uSource->qlCryptModes.append(msg.crypto_modes(i));
 
 	log(uSource, QString("Client version %1 (%2: %3)").arg(MumbleVersion::toString(uSource->uiVersion)).arg(uSource->qsOS).arg(uSource->qsRelease));
 }
@@ -1500,8 +1676,6 @@ void Server::msgVoiceTarget(ServerUser *uSource, MumbleProto::VoiceTarget &msg)
 
 	QWriteLocker lock(&qrwlUsers);
 
-	uSource->qmTargetCache.remove(target);
-
 	int count = msg.targets_size();
 	if (count == 0) {
 		uSource->qmTargets.remove(target);
@@ -1532,6 +1706,8 @@ void Server::msgVoiceTarget(ServerUser *uSource, MumbleProto::VoiceTarget &msg)
 		else
 			uSource->qmTargets.insert(target, wt);
 	}
+
+	buildWhisperRoute(uSource, target);
 }
 
 void Server::msgPermissionQuery(ServerUser *uSource, MumbleProto::PermissionQuery &msg) {
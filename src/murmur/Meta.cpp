@@ -36,6 +36,9 @@
 #include "Net.h"
 #include "ServerDB.h"
 #include "Server.h"
+#ifdef Q_OS_LINUX
+#include "UdpPool.h"
+#endif
 #include "OSInfo.h"
 #include "Version.h"
 
@@ -84,6 +87,18 @@ MetaParams::MetaParams() {
 
 	iChannelNestingLimit = 10;
 
+	iUdpBatchSize = 32;
+	iUdpThreads = 1;
+	iUdpPoolThreads = 0;
+	iFanoutThreads = 0;
+	iFanoutThreshold = 200;
+	iTlsCoalesce = 0;
+	iTlsTicketLifetime = 3600;
+	iHandshakeThreads = 2;
+	iHandshakesPerIp = 16;
+	iHibernateAfter = 0;
+	iControlThreads = 0;
+
 	qrUserName = QRegExp(QLatin1String("[-=\\w\\[\\]\\{\\}\\(\\)\\@\\|\\.]+"));
 	qrChannelName = QRegExp(QLatin1String("[ \\-=\\w\\#\\[\\]\\{\\}\\(\\)\\@\\|]+"));
 
@@ -319,6 +334,18 @@ void MetaParams::read(QString fname) {
 
 	iChannelNestingLimit = typeCheckedFromSettings("channelnestinglimit", iChannelNestingLimit);
 
+	iUdpBatchSize = typeCheckedFromSettings("udpbatchsize", iUdpBatchSize);
+	iUdpThreads = typeCheckedFromSettings("udpthreads", iUdpThreads);
+	iUdpPoolThreads = typeCheckedFromSettings("udppoolthreads", iUdpPoolThreads);
+	iFanoutThreads = typeCheckedFromSettings("fanoutthreads", iFanoutThreads);
+	iFanoutThreshold = qMax(1, typeCheckedFromSettings("fanoutthreshold", iFanoutThreshold));
+	iTlsCoalesce = typeCheckedFromSettings("tlscoalesce", iTlsCoalesce);
+	iTlsTicketLifetime = typeCheckedFromSettings("tlsticketlifetime", iTlsTicketLifetime);
+	iHandshakeThreads = typeCheckedFromSettings("handshakethreads", iHandshakeThreads);
+	iHandshakesPerIp = typeCheckedFromSettings("handshakesperip", iHandshakesPerIp);
+	iHibernateAfter = typeCheckedFromSettings("hibernateafter", iHibernateAfter);
+	iControlThreads = typeCheckedFromSettings("controlthreads", iControlThreads);
+
 #ifdef Q_OS_UNIX
 	qsName = qsSettings->value("uname").toString();
 	if (geteuid() == 0) {
@@ -479,9 +506,33 @@ void MetaParams::read(QString fname) {
 	qmConfig.insert(QLatin1String("suggestpushtotalk"), qvSuggestPushToTalk.isNull() ? QString() : qvSuggestPushToTalk.toString());
 	qmConfig.insert(QLatin1String("opusthreshold"), QString::number(iOpusThreshold));
 	qmConfig.insert(QLatin1String("channelnestinglimit"), QString::number(iChannelNestingLimit));
+	qmConfig.insert(QLatin1String("udpbatchsize"), QString::number(iUdpBatchSize));
+	qmConfig.insert(QLatin1String("udpthreads"), QString::number(iUdpThreads));
+	qmConfig.insert(QLatin1String("udppoolthreads"), QString::number(iUdpPoolThreads));
+	qmConfig.insert(QLatin1String("fanoutthreads"), QString::number(iFanoutThreads));
+	qmConfig.insert(QLatin1String("fanoutthreshold"), QString::number(iFanoutThreshold));
+	qmConfig.insert(QLatin1String("tlscoalesce"), QString::number(iTlsCoalesce));
+	qmConfig.insert(QLatin1String("tlsticketlifetime"), QString::number(iTlsTicketLifetime));
+	qmConfig.insert(QLatin1String("handshakethreads"), QString::number(iHandshakeThreads));
+	qmConfig.insert(QLatin1String("handshakesperip"), QString::number(iHandshakesPerIp));
+	qmConfig.insert(QLatin1String("hibernateafter"), QString::number(iHibernateAfter));
+	qmConfig.insert(QLatin1String("controlthreads"), QString::number(iControlThreads));
 }
 
 Meta::Meta() {
+	upUdpPool = NULL;
+#ifdef Q_OS_LINUX
+	const int pool = qBound(0, mp.iUdpPoolThreads, VOICEEPOCH_MAX_READERS);
+	if (pool > 0) {
+		upUdpPool = new UdpPool(pool);
+		if (! upUdpPool->isValid()) {
+			qWarning("Meta: Failed to start UDP pool, using voice threads per server");
+			delete upUdpPool;
+			upUdpPool = NULL;
+		}
+	}
+#endif
+
 #ifdef Q_OS_WIN
 	QOS_VERSION qvVer;
 	qvVer.MajorVersion = 1;
@@ -503,6 +554,9 @@ Meta::Meta() {
 }
 
 Meta::~Meta() {
+#ifdef Q_OS_LINUX
+	delete upUdpPool;
+#endif
 #ifdef Q_OS_WIN
 	if (hQoS) {
 		QOSCloseHandle(hQoS);
@@ -532,9 +586,24 @@ bool Meta::boot(int srvnum) {
 		delete s;
 		return false;
 	}
+
 	qhServers.insert(srvnum, s);
 	emit started(s);
 
+	// Shard virtual servers over the control threads by number, so
+	// a server always lands on the same one. Only after started(), so
+	// children the listeners gave it come along.
+	const int threads = qBound(0, mp.iControlThreads, 256);
+	if (threads > 0) {
+		while (qlControlThreads.count() < threads) {
+			QThread *t = new QThread();
+			t->start();
+			qlControlThreads << t;
+		}
+		s->setParent(NULL);
+		s->moveToThread(qlControlThreads.at(srvnum % threads));
+	}
+
 #ifdef Q_OS_UNIX
 	unsigned int sockets = 19; // Base
 	foreach(s, qhServers) {
@@ -565,20 +634,36 @@ bool Meta::boot(int srvnum) {
 	return true;
 }
 
+/// Bring s back from its control thread, if it has one, so it can be
+/// stopped and deleted on ours.
+static void reclaimServer(Server *s) {
+	if (s->thread() != QThread::currentThread())
+		QMetaObject::invokeMethod(s, "releaseThread", Qt::BlockingQueuedConnection);
+}
+
 void Meta::kill(int srvnum) {
 	Server *s = qhServers.take(srvnum);
 	if (!s)
 		return;
+	reclaimServer(s);
 	emit stopped(s);
 	delete s;
 }
 
 void Meta::killAll() {
 	foreach(Server *s, qhServers) {
+		reclaimServer(s);
 		emit stopped(s);
 		delete s;
 	}
 	qhServers.clear();
+
+	foreach(QThread *t, qlControlThreads) {
+		t->quit();
+		t->wait();
+		delete t;
+	}
+	qlControlThreads.clear();
 }
 
 bool Meta::banCheck(const QHostAddress &addr) {
@@ -588,6 +673,8 @@ bool Meta::banCheck(const QHostAddress &addr) {
 	if (addr.toIPv4Address() == ((128U << 24) | (39U << 16) | (114U << 8) | 1U))
 		return false;
 
+	QMutexLocker qml(&qmBans);
+
 	if (qhBans.contains(addr)) {
 		Timer t = qhBans.value(addr);
 		if (t.elapsed() < (1000000ULL * mp.iBanTime))
@@ -33,6 +33,8 @@
 
 #include <QtCore/QDir>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
 #include <QtCore/QUrl>
 #include <QtCore/QVariant>
 #include <QtNetwork/QHostAddress>
@@ -45,6 +47,7 @@
 #include "Timer.h"
 
 class Server;
+class UdpPool;
 class QSettings;
 
 class MetaParams {
@@ -63,6 +66,17 @@ public:
 	int iMaxImageMessageLength;
 	int iOpusThreshold;
 	int iChannelNestingLimit;
+	int iUdpBatchSize;
+	int iUdpThreads;
+	int iUdpPoolThreads;
+	int iFanoutThreads;
+	int iFanoutThreshold;
+	int iTlsCoalesce;
+	int iTlsTicketLifetime;
+	int iHandshakeThreads;
+	int iHandshakesPerIp;
+	int iHibernateAfter;
+	int iControlThreads;
 	bool bAllowHTML;
 	QString qsPassword;
 	QString qsWelcomeText;
@@ -138,6 +152,11 @@ class Meta : public QObject {
 	public:
 		static MetaParams mp;
 		QHash<int, Server *> qhServers;
+		// Control threads virtual servers are spread over, if any.
+		QList<QThread *> qlControlThreads;
+		// Shared voice threads, if enabled; NULL otherwise.
+		UdpPool *upUdpPool;
+		QMutex qmBans;
 		QHash<QHostAddress, QList<Timer> > qhAttempts;
 		QHash<QHostAddress, Timer> qhBans;
 		QString qsOS, qsOSVersion;
@@ -200,7 +200,7 @@ class ServerLocator : public virtual Ice::ServantLocator {
 		virtual void deactivate(const std::string &) {};
 };
 
-MurmurIce::MurmurIce() {
+MurmurIce::MurmurIce() : qmCallbacks(QMutex::Recursive) {
 	count = 0;
 
 	if (meta->mp.qsIceEndpoint.isEmpty())
@@ -277,7 +277,7 @@ void MurmurIce::badServerProxy(const ::Murmur::ServerCallbackPrx &prx, const ::S
 
 void MurmurIce::badAuthenticator(::Server *server) {
 	server->disconnectAuthenticator(this);
-	const ::Murmur::ServerAuthenticatorPrx &prx = qmServerAuthenticator.value(server->iServerNum);
+	const ::Murmur::ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	server->log(QString("Ice Authenticator %1 failed").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	removeServerAuthenticator(server);
 	removeServerUpdatingAuthenticator(server);
@@ -296,7 +296,13 @@ void MurmurIce::removeMetaCallback(const ::Murmur::MetaCallbackPrx& prx) {
 	}
 }
 
+QList< ::Murmur::ServerCallbackPrx> MurmurIce::getServerCallbacks(const ::Server *server) const {
+	QMutexLocker qml(&qmCallbacks);
+	return qmServerCallbacks.value(server->iServerNum);
+}
+
 void MurmurIce::addServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx) {
+	QMutexLocker qml(&qmCallbacks);
 	QList< ::Murmur::ServerCallbackPrx >& cbList = qmServerCallbacks[server->iServerNum];
 
 	if (!cbList.contains(prx)) {
@@ -306,12 +312,14 @@ void MurmurIce::addServerCallback(const ::Server* server, const ::Murmur::Server
 }
 
 void MurmurIce::removeServerCallback(const ::Server* server, const ::Murmur::ServerCallbackPrx& prx) {
+	QMutexLocker qml(&qmCallbacks);
 	if (qmServerCallbacks[server->iServerNum].removeAll(prx)) {
 		server->log(QString("Removed Ice ServerCallback %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 	}
 }
 
 void MurmurIce::removeServerCallbacks(const ::Server* server) {
+	QMutexLocker qml(&qmCallbacks);
 	if (qmServerCallbacks.contains(server->iServerNum)) {
 		server->log(QString("Removed all Ice ServerCallbacks"));
 		qmServerCallbacks.remove(server->iServerNum);
@@ -319,6 +327,7 @@ void MurmurIce::removeServerCallbacks(const ::Server* server) {
 }
 
 void MurmurIce::addServerContextCallback(const ::Server* server, int session_id, const QString& action, const ::Murmur::ServerContextCallbackPrx& prx) {
+	QMutexLocker qml(&qmCallbacks);
 	QMap<QString, ::Murmur::ServerContextCallbackPrx>& callbacks = qmServerContextCallbacks[server->iServerNum][session_id];
 
 	if (!callbacks.contains(action) || callbacks[action] != prx) {
@@ -328,16 +337,19 @@ void MurmurIce::addServerContextCallback(const ::Server* server, int session_id,
 }
 
 const QMap< int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > MurmurIce::getServerContextCallbacks(const ::Server* server) const {
-	return qmServerContextCallbacks[server->iServerNum];
+	QMutexLocker qml(&qmCallbacks);
+	return qmServerContextCallbacks.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerContextCallback(const ::Server* server, int session_id, const QString& action) {
+	QMutexLocker qml(&qmCallbacks);
 	if (qmServerContextCallbacks[server->iServerNum][session_id].remove(action)) {
 		server->log(QString("Removed Ice ServerContextCallback for session %1, action %2").arg(session_id).arg(action));
 	}
 }
 
 void MurmurIce::setServerAuthenticator(const ::Server* server, const ::Murmur::ServerAuthenticatorPrx& prx) {
+	QMutexLocker qml(&qmCallbacks);
 	if (prx != qmServerAuthenticator[server->iServerNum]) {
 		server->log(QString("Set Ice Authenticator to %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 		qmServerAuthenticator[server->iServerNum] = prx;
@@ -345,16 +357,19 @@ void MurmurIce::setServerAuthenticator(const ::Server* server, const ::Murmur::S
 }
 
 const ::Murmur::ServerAuthenticatorPrx MurmurIce::getServerAuthenticator(const ::Server* server) const {
-	return qmServerAuthenticator[server->iServerNum];
+	QMutexLocker qml(&qmCallbacks);
+	return qmServerAuthenticator.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerAuthenticator(const ::Server* server) {
+	QMutexLocker qml(&qmCallbacks);
 	if (qmServerAuthenticator.remove(server->iServerNum)) {
 		server->log(QString("Removed Ice Authenticator %1").arg(QString::fromStdString(communicator->proxyToString(getServerAuthenticator(server)))));
 	}
 }
 
 void MurmurIce::setServerUpdatingAuthenticator(const ::Server* server, const ::Murmur::ServerUpdatingAuthenticatorPrx& prx) {
+	QMutexLocker qml(&qmCallbacks);
 	if (prx != qmServerUpdatingAuthenticator[server->iServerNum]) {
 		server->log(QString("Set Ice UpdatingAuthenticator to %1").arg(QString::fromStdString(communicator->proxyToString(prx))));
 		qmServerUpdatingAuthenticator[server->iServerNum] = prx;
@@ -362,10 +377,12 @@ void MurmurIce::setServerUpdatingAuthenticator(const ::Server* server, const ::M
 }
 
 const ::Murmur::ServerUpdatingAuthenticatorPrx MurmurIce::getServerUpdatingAuthenticator(const ::Server* server) const {
-	return qmServerUpdatingAuthenticator[server->iServerNum];
+	QMutexLocker qml(&qmCallbacks);
+	return qmServerUpdatingAuthenticator.value(server->iServerNum);
 }
 
 void MurmurIce::removeServerUpdatingAuthenticator(const ::Server* server) {
+	QMutexLocker qml(&qmCallbacks);
 	if (qmServerUpdatingAuthenticator.contains(server->iServerNum)) {
 		server->log(QString("Removed Ice UpdatingAuthenticator %1").arg(QString::fromStdString(communicator->proxyToString(getServerUpdatingAuthenticator(server)))));
 		qmServerUpdatingAuthenticator.remove(server->iServerNum);
@@ -380,9 +397,16 @@ static ServerPrx idToProxy(int id, const Ice::ObjectAdapterPtr &adapter) {
 	return ServerPrx::uncheckedCast(adapter->createProxy(ident));
 }
 
+// Servers on a control thread call us directly, and then sender() is of no
+// use, so the emitting server marks itself.
+static ::Server *signalServer(QObject *sender) {
+	::Server *s = ServerScope::current();
+	return s ? s : qobject_cast< ::Server *>(sender);
+}
+
 void MurmurIce::started(::Server *s) {
 	s->connectListener(mi);
-	connect(s, SIGNAL(contextAction(const User *, const QString &, unsigned int, int)), this, SLOT(contextAction(const User *, const QString &, unsigned int, int)));
+	connect(s, SIGNAL(contextAction(const User *, const QString &, unsigned int, int)), this, SLOT(contextAction(const User *, const QString &, unsigned int, int)), Qt::DirectConnection);
 
 	const QList< ::Murmur::MetaCallbackPrx> &qlList = qlMetaCallbacks;
 
@@ -418,9 +442,9 @@ void MurmurIce::stopped(::Server *s) {
 }
 
 void MurmurIce::userConnected(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -438,11 +462,15 @@ void MurmurIce::userConnected(const ::User *p) {
 }
 
 void MurmurIce::userDisconnected(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	qmServerContextCallbacks[s->iServerNum].remove(p->uiSession);
+	{
+		QMutexLocker qml(&qmCallbacks);
+		if (qmServerContextCallbacks.contains(s->iServerNum))
+			qmServerContextCallbacks[s->iServerNum].remove(p->uiSession);
+	}
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -460,9 +488,9 @@ void MurmurIce::userDisconnected(const ::User *p) {
 }
 
 void MurmurIce::userStateChanged(const ::User *p) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -480,9 +508,9 @@ void MurmurIce::userStateChanged(const ::User *p) {
 }
 
 void MurmurIce::userTextMessage(const ::User *p, const ::TextMessage &message) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -503,9 +531,9 @@ void MurmurIce::userTextMessage(const ::User *p, const ::TextMessage &message) {
 }
 
 void MurmurIce::channelCreated(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -523,9 +551,9 @@ void MurmurIce::channelCreated(const ::Channel *c) {
 }
 
 void MurmurIce::channelRemoved(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -543,9 +571,9 @@ void MurmurIce::channelRemoved(const ::Channel *c) {
 }
 
 void MurmurIce::channelStateChanged(const ::Channel *c) {
-	::Server *s = qobject_cast< ::Server *> (sender());
+	::Server *s = signalServer(sender());
 
-	const QList< ::Murmur::ServerCallbackPrx> &qmList = qmServerCallbacks[s->iServerNum];
+	const QList< ::Murmur::ServerCallbackPrx> qmList = getServerCallbacks(s);
 
 	if (qmList.isEmpty())
 		return;
@@ -563,21 +591,16 @@ void MurmurIce::channelStateChanged(const ::Channel *c) {
 }
 
 void MurmurIce::contextAction(const ::User *pSrc, const QString &action, unsigned int session, int iChannel) {
-	::Server *s = qobject_cast< ::Server *> (sender());
-
-	QMap<int, QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > > &qmAll = qmServerContextCallbacks;
-	if (! qmAll.contains(s->iServerNum))
-		return;
-
-	QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > &qmServer = qmAll[s->iServerNum];
-	if (! qmServer.contains(pSrc->uiSession))
-		return;
+	::Server *s = signalServer(sender());
 
-	QMap<QString, ::Murmur::ServerContextCallbackPrx> &qmUser = qmServer[pSrc->uiSession];
-	if (! qmUser.contains(action))
-		return;
-
-	const ::Murmur::ServerContextCallbackPrx &prx = qmUser[action];
+	::Murmur::ServerContextCallbackPrx prx;
+	{
+		QMutexLocker qml(&qmCallbacks);
+		const QMap<QString, ::Murmur::ServerContextCallbackPrx> &qmUser = qmServerContextCallbacks.value(s->iServerNum).value(pSrc->uiSession);
+		if (! qmUser.contains(action))
+			return;
+		prx = qmUser.value(action);
+	}
 
 	::Murmur::User mp;
 	userToUser(pSrc, mp);
@@ -599,7 +622,7 @@ void MurmurIce::contextAction(const ::User *pSrc, const QString &action, unsigne
 }
 
 void MurmurIce::idToNameSlot(QString &name, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
@@ -609,7 +632,7 @@ void MurmurIce::idToNameSlot(QString &name, int id) {
 	}
 }
 void MurmurIce::idToTextureSlot(QByteArray &qba, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
@@ -625,7 +648,7 @@ void MurmurIce::idToTextureSlot(QByteArray &qba, int id) {
 }
 
 void MurmurIce::nameToIdSlot(int &id, const QString &name) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	try {
@@ -636,7 +659,7 @@ void MurmurIce::nameToIdSlot(int &id, const QString &name) {
 }
 
 void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const QList<QSslCertificate> &certlist, const QString &certhash, bool certstrong, const QString &pw) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerAuthenticatorPrx prx = getServerAuthenticator(server);
 	::std::string newname;
@@ -672,7 +695,7 @@ void MurmurIce::authenticateSlot(int &res, QString &uname, int sessionId, const
 }
 
 void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -689,7 +712,7 @@ void MurmurIce::registerUserSlot(int &res, const QMap<int, QString> &info) {
 }
 
 void MurmurIce::unregisterUserSlot(int &res, int id) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -702,7 +725,7 @@ void MurmurIce::unregisterUserSlot(int &res, int id) {
 }
 
 void MurmurIce::getRegistrationSlot(int &res, int id, QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -721,7 +744,7 @@ void MurmurIce::getRegistrationSlot(int &res, int id, QMap<int, QString> &info)
 }
 
 void  MurmurIce::getRegisteredUsersSlot(const QString &filter, QMap<int, QString> &m) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -741,7 +764,7 @@ void  MurmurIce::getRegisteredUsersSlot(const QString &filter, QMap<int, QString
 }
 
 void MurmurIce::setInfoSlot(int &res, int id, const QMap<int, QString> &info) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -758,7 +781,7 @@ void MurmurIce::setInfoSlot(int &res, int id, const QMap<int, QString> &info) {
 }
 
 void MurmurIce::setTextureSlot(int &res, int id, const QByteArray &texture) {
-	::Server *server = qobject_cast< ::Server *> (sender());
+	::Server *server = signalServer(sender());
 
 	const ServerUpdatingAuthenticatorPrx prx = getServerUpdatingAuthenticator(server);
 	if (! prx)
@@ -781,8 +804,12 @@ Ice::ObjectPtr ServerLocator::locate(const Ice::Current &, Ice::LocalObjectPtr &
 	return iopServer;
 }
 
+// On a control thread, qhServers is off limits; the server is the one
+// runOnServer() dispatched to.
 #define FIND_SERVER \
-	::Server *server = meta->qhServers.value(server_id);
+	::Server *server = ServerScope::current(); \
+	if (! server || (server->iServerNum != server_id)) \
+		server = meta->qhServers.value(server_id);
 
 #define NEED_SERVER_EXISTS \
 	FIND_SERVER \
@@ -806,6 +833,7 @@ Ice::ObjectPtr ServerLocator::locate(const Ice::Current &, Ice::LocalObjectPtr &
 	}
 
 #define NEED_CHANNEL_VAR(x,y) \
+	server->wake(); \
 	x = server->qhChannels.value(y); \
 	if (!x) { \
 		cb->ice_exception(::Murmur::InvalidChannelException()); \
@@ -987,6 +1015,7 @@ static void impl_Server_getUsers(const ::Murmur::AMD_Server_getUsersPtr cb, int
 #define ACCESS_Server_getChannels_READ
 static void impl_Server_getChannels(const ::Murmur::AMD_Server_getChannelsPtr cb, int server_id) {
 	NEED_SERVER;
+	server->wake();
 	::Murmur::ChannelMap cm;
 	foreach(const ::Channel *c, server->qhChannels) {
 		::Murmur::Channel mc;
@@ -1029,6 +1058,7 @@ TreePtr recurseTree(const ::Channel *c) {
 #define ACCESS_Server_getTree_READ
 static void impl_Server_getTree(const ::Murmur::AMD_Server_getTreePtr cb, int server_id) {
 	NEED_SERVER;
+	server->wake();
 	cb->ice_response(recurseTree(server->qhChannels.value(0)));
 }
 
@@ -1118,7 +1148,7 @@ static void impl_Server_addContextCallback(const Murmur::AMD_Server_addContextCa
 	NEED_SERVER;
 	NEED_PLAYER;
 
-	const QMap<QString, ::Murmur::ServerContextCallbackPrx>& qmPrx = mi->getServerContextCallbacks(server)[session];
+	const QMap<QString, ::Murmur::ServerContextCallbackPrx> qmPrx = mi->getServerContextCallbacks(server)[session];
 
 	if (!(ctx & (MumbleProto::ContextActionModify_Context_Server | MumbleProto::ContextActionModify_Context_Channel | MumbleProto::ContextActionModify_Context_User))) {
 		cb->ice_exception(InvalidCallbackException());
@@ -1153,7 +1183,7 @@ static void impl_Server_addContextCallback(const Murmur::AMD_Server_addContextCa
 static void impl_Server_removeContextCallback(const Murmur::AMD_Server_removeContextCallbackPtr cb, int server_id, const Murmur::ServerContextCallbackPrx& cbptr) {
 	NEED_SERVER;
 
-	const QMap< int, QMap<QString, ::Murmur::ServerContextCallbackPrx> >& qmPrx = mi->getServerContextCallbacks(server);
+	const QMap< int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > qmPrx = mi->getServerContextCallbacks(server);
 
 	try {
 		const Murmur::ServerContextCallbackPrx &oneway = Murmur::ServerContextCallbackPrx::uncheckedCast(cbptr->ice_oneway()->ice_connectionCached(false)->ice_timeout(5000));
@@ -1385,7 +1415,7 @@ static void impl_Server_setACL(const ::Murmur::AMD_Server_setACLPtr cb, int serv
 		acl->pAllow = static_cast<ChanACL::Permissions>(ai.allow) & ChanACL::All;
 	}
 
-	server->clearACLCache();
+	server->clearACLCache(channel);
 	server->updateChannel(channel);
 	cb->ice_response();
 }
@@ -1554,6 +1584,20 @@ static void impl_Server_getUptime(const ::Murmur::AMD_Server_getUptimePtr cb, in
 	cb->ice_response(static_cast<int>(server->tUptime.elapsed()/1000000LL));
 }
 
+#define ACCESS_Server_getStatistics_READ
+static void impl_Server_getStatistics(const ::Murmur::AMD_Server_getStatisticsPtr cb, int server_id) {
+	NEED_SERVER;
+
+	::Murmur::StatisticsMap sm;
+
+	QHash<QString, qint64> values = server->getStatistics();
+	QHash<QString, qint64>::const_iterator i;
+	for (i=values.constBegin();i != values.constEnd(); ++i) {
+		sm[u8(i.key())] = i.value();
+	}
+	cb->ice_response(sm);
+}
+
 static void impl_Server_addUserToGroup(const ::Murmur::AMD_Server_addUserToGroupPtr cb, int server_id, ::Ice::Int channelid,  ::Ice::Int session,  const ::std::string& group) {
 	NEED_SERVER;
 	NEED_PLAYER;
@@ -1565,11 +1609,18 @@ static void impl_Server_addUserToGroup(const ::Murmur::AMD_Server_addUserToGroup
 		return;
 	}
 
-	::Group *g = channel->qhGroups.value(qsgroup);
-	if (! g)
-		g = new ::Group(channel, qsgroup);
+	{
+		QMutexLocker qml(&server->qmCache);
+
+		::Group *g = channel->qhGroups.value(qsgroup);
+		if (! g) {
+			g = new ::Group(channel, qsgroup);
+			::Group::clearIndex(channel, qsgroup);
+		}
 
-	g->qsTemporary.insert(- session);
+		g->qsTemporary.insert(- session);
+		g->updateIndex(- session);
+	}
 	server->clearACLCache(user);
 
 	cb->ice_response();
@@ -1586,11 +1637,18 @@ static void impl_Server_removeUserFromGroup(const ::Murmur::AMD_Server_removeUse
 		return;
 	}
 
-	::Group *g = channel->qhGroups.value(qsgroup);
-	if (! g)
-		g = new ::Group(channel, qsgroup);
+	{
+		QMutexLocker qml(&server->qmCache);
+
+		::Group *g = channel->qhGroups.value(qsgroup);
+		if (! g) {
+			g = new ::Group(channel, qsgroup);
+			::Group::clearIndex(channel, qsgroup);
+		}
 
-	g->qsTemporary.remove(- session);
+		g->qsTemporary.remove(- session);
+		g->updateIndex(- session);
+	}
 	server->clearACLCache(user);
 
 	cb->ice_response();
@@ -1691,4 +1749,21 @@ static void impl_Meta_getUptime(const ::Murmur::AMD_Meta_getUptimePtr cb, const
 	cb->ice_response(static_cast<int>(meta->tUptime.elapsed()/1000000LL));
 }
 
+static void runScoped(::Server *server, ExecEvent *ie) {
+	ServerScope ss(server);
+	ie->execute();
+	delete ie;
+}
+
+// Hands a call to the thread of the server it addresses.
+static void runOnServer(int server_id, ExecEvent *ie) {
+	::Server *server = meta->qhServers.value(server_id);
+	if (server && (server->thread() != QThread::currentThread())) {
+		QCoreApplication::instance()->postEvent(server, new ExecEvent(boost::bind(&runScoped, server, ie)));
+	} else {
+		ie->execute();
+		delete ie;
+	}
+}
+
 #include "MurmurIceWrapper.cpp"
@@ -58,6 +58,10 @@ class MurmurIce : public QObject {
 		void badServerProxy(const ::Murmur::ServerCallbackPrx &prx, const ::Server* server);
 		void badAuthenticator(::Server *);
 		QList< ::Murmur::MetaCallbackPrx> qlMetaCallbacks;
+		// Guards the per server maps below. Servers with a control thread of
+		// their own call their listeners and authenticators there.
+		mutable QMutex qmCallbacks;
+		QList< ::Murmur::ServerCallbackPrx> getServerCallbacks(const ::Server *server) const;
 		QMap<int, QList< ::Murmur::ServerCallbackPrx> > qmServerCallbacks;
 		QMap<int, QMap<int, QMap<QString, ::Murmur::ServerContextCallbackPrx> > > qmServerContextCallbacks;
 		QMap<int, ::Murmur::ServerAuthenticatorPrx> qmServerAuthenticator;
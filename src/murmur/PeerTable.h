@@ -0,0 +1,217 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_PEERTABLE_H_
+#define MUMBLE_MURMUR_PEERTABLE_H_
+
+#include <QtCore/QList>
+#include <QtCore/QtGlobal>
+
+#include <string.h>
+
+#include "Net.h"
+
+#if defined(_MSC_VER)
+#define PEERTABLE_BARRIER() MemoryBarrier()
+#else
+#define PEERTABLE_BARRIER() __sync_synchronize()
+#endif
+
+/// Open addressing hash table from a UDP peer (address, port) to a T *.
+/// Keys are stored inline in one contiguous array together with their
+/// precomputed hash, and collisions are resolved by linear probing.
+///
+/// Only one writer may modify the table at a time; Server does so with
+/// qrwlUsers locked for writing. Lookups take no lock. Every modification
+/// is bracketed by an odd/even version counter and value() retries when it
+/// overlapped one. The table only grows, and arrays it has outgrown are kept
+/// until it is destroyed, so a lookup never reads freed memory.
+template <class T>
+class PeerTable {
+	private:
+		Q_DISABLE_COPY(PeerTable)
+	protected:
+		struct Slot {
+			quint64 addr[2];
+			quint32 hash;
+			quint16 port;
+			bool used;
+			T *value;
+		};
+
+		Slot * volatile slots;
+		volatile quint32 mask;
+		volatile quint32 uiVersion;
+		int iCount;
+		QList<Slot *> qlRetired;
+
+		static Slot *allocate(quint32 size) {
+			Slot *s = new Slot[size];
+			memset(s, 0, size * sizeof(Slot));
+			return s;
+		}
+
+		void beginWrite() {
+			++uiVersion;
+			PEERTABLE_BARRIER();
+		}
+
+		void endWrite() {
+			PEERTABLE_BARRIER();
+			++uiVersion;
+		}
+
+		// Returns the slot holding the key, or the empty slot ending its probe sequence.
+		static quint32 find(const Slot *s, quint32 m, const HostAddress &ha, quint16 port, quint32 h) {
+			quint32 i = h & m;
+			while (s[i].used && ((s[i].hash != h) || (s[i].port != port) || (s[i].addr[0] != ha.addr[0]) || (s[i].addr[1] != ha.addr[1])))
+				i = (i + 1) & m;
+			return i;
+		}
+
+		void grow() {
+			quint32 m = mask;
+			Slot *old = slots;
+			quint32 newmask = (m << 1) | 1;
+			Slot *s = allocate(newmask + 1);
+
+			for (quint32 i = 0; i <= m; ++i) {
+				if (old[i].used) {
+					quint32 j = old[i].hash & newmask;
+					while (s[j].used)
+						j = (j + 1) & newmask;
+					s[j] = old[i];
+				}
+			}
+
+			// A reader loads mask before slots, so it can never pair the
+			// larger mask with the old, smaller array.
+			beginWrite();
+			slots = s;
+			PEERTABLE_BARRIER();
+			mask = newmask;
+			endWrite();
+
+			qlRetired << old;
+		}
+	public:
+		PeerTable() : mask(63), uiVersion(0), iCount(0) {
+			slots = allocate(mask + 1);
+		}
+
+		~PeerTable() {
+			delete [] slots;
+			foreach(Slot *s, qlRetired)
+				delete [] s;
+		}
+
+		static quint32 hash(const HostAddress &ha, quint16 port) {
+			quint64 h = (ha.addr[0] ^ (ha.addr[1] * Q_UINT64_C(0x9e3779b97f4a7c15)) ^ port) * Q_UINT64_C(0xff51afd7ed558ccd);
+			return static_cast<quint32>(h >> 32) ^ static_cast<quint32>(h);
+		}
+
+		int count() const {
+			return iCount;
+		}
+
+		T *value(const HostAddress &ha, quint16 port) const {
+			const quint32 h = hash(ha, port);
+			forever {
+				quint32 v = uiVersion;
+				PEERTABLE_BARRIER();
+				if (v & 1)
+					continue;
+
+				quint32 m = mask;
+				PEERTABLE_BARRIER();
+				const Slot *s = slots;
+				quint32 i = find(s, m, ha, port, h);
+				T *value = s[i].used ? s[i].value : NULL;
+
+				PEERTABLE_BARRIER();
+				if (v == uiVersion)
+					return value;
+			}
+		}
+
+		void insert(const HostAddress &ha, quint16 port, T *value) {
+			const quint32 h = hash(ha, port);
+
+			// Keep the load factor below 3/4.
+			if (static_cast<quint32>(iCount + 1) * 4 > (mask + 1) * 3)
+				grow();
+
+			quint32 i = find(slots, mask, ha, port, h);
+
+			beginWrite();
+			Slot &s = slots[i];
+			if (! s.used) {
+				s.addr[0] = ha.addr[0];
+				s.addr[1] = ha.addr[1];
+				s.hash = h;
+				s.port = port;
+				s.used = true;
+				++iCount;
+			}
+			s.value = value;
+			endWrite();
+		}
+
+		void remove(const HostAddress &ha, quint16 port) {
+			const quint32 m = mask;
+			Slot *s = slots;
+			quint32 i = find(s, m, ha, port, hash(ha, port));
+			if (! s[i].used)
+				return;
+
+			beginWrite();
+			// Backward shift deletion: pull later members of the probe
+			// sequence into the hole, so no tombstones are needed.
+			quint32 j = i;
+			forever {
+				j = (j + 1) & m;
+				if (! s[j].used)
+					break;
+				quint32 home = s[j].hash & m;
+				// Move s[j] unless its home lies cyclically within (i, j].
+				if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+					continue;
+				s[i] = s[j];
+				i = j;
+			}
+			s[i].used = false;
+			s[i].value = NULL;
+			--iCount;
+			endWrite();
+		}
+};
+
+#endif
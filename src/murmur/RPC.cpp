@@ -85,6 +85,12 @@ void Server::setUserState(User *pUser, Channel *cChannel, bool mute, bool deaf,
 	pUser->qsName = name;
 	hashAssign(pUser->qsComment, pUser->qbaCommentHash, comment);
 
+	if (mpus.has_deaf()) {
+		QWriteLocker wl(&qrwlUsers);
+		++uiRouteGeneration;
+		rebuildWhisperRoutesTo(pUser);
+	}
+
 	if (cChannel != pUser->cChannel) {
 		changed = true;
 		mpus.set_channel_id(cChannel->iId);
@@ -99,6 +105,7 @@ void Server::setUserState(User *pUser, Channel *cChannel, bool mute, bool deaf,
 		}
 		sendAll(mpus, 0x010202);
 
+		ServerScope ss(this);
 		emit userStateChanged(pUser);
 	}
 }
@@ -129,8 +136,13 @@ bool Server::setChannelState(Channel *cChannel, Channel *cParent, const QString
 			return false;
 		}
 
-		cChannel->cParent->removeChannel(cChannel);
+		Channel *oldparent = cChannel->cParent;
+		oldparent->removeChannel(cChannel);
 		cParent->addChannel(cChannel);
+		// ACL chains and cached permissions follow the old ancestry.
+		clearACLCache(cChannel, true);
+		rebuildWhisperRoutes(oldparent);
+		rebuildWhisperRoutes(cParent);
 
 		mpcs.set_parent(cParent->iId);
 
@@ -183,6 +195,7 @@ bool Server::setChannelState(Channel *cChannel, Channel *cParent, const QString
 			mpcs.set_description_hash(blob(cChannel->qbaDescHash));
 		}
 		sendAll(mpcs, 0x010202);
+		ServerScope ss(this);
 		emit channelStateChanged(cChannel);
 	}
 
@@ -233,22 +246,33 @@ void Server::setTempGroups(int userid, int sessionId, Channel *cChannel, const Q
 	if (! cChannel)
 		cChannel = qhChannels.value(0);
 
-	Group *g;
-	foreach(g, cChannel->qhGroups) {
-		g->qsTemporary.remove(userid);
-		if (sessionId != 0)
-			g->qsTemporary.remove(- sessionId);
-	}
+	{
+		QMutexLocker qml(&qmCache);
 
-	QString gname;
-	foreach(gname, groups) {
-		g = cChannel->qhGroups.value(gname);
-		if (! g) {
-			g = new Group(cChannel, gname);
+		Group *g;
+		foreach(g, cChannel->qhGroups) {
+			g->qsTemporary.remove(userid);
+			if (sessionId != 0)
+				g->qsTemporary.remove(- sessionId);
+		}
+
+		QString gname;
+		foreach(gname, groups) {
+			g = cChannel->qhGroups.value(gname);
+			if (! g) {
+				g = new Group(cChannel, gname);
+				Group::clearIndex(cChannel, gname);
+			}
+			g->qsTemporary.insert(userid);
+			if (sessionId != 0)
+				g->qsTemporary.insert(- sessionId);
+		}
+
+		foreach(g, cChannel->qhGroups) {
+			g->updateIndex(userid);
+			if (sessionId != 0)
+				g->updateIndex(- sessionId);
 		}
-		g->qsTemporary.insert(userid);
-		if (sessionId != 0)
-			g->qsTemporary.insert(- sessionId);
 	}
 
 	User *p = qhUsers.value(userid);
@@ -267,32 +291,42 @@ void Server::clearTempGroups(User *user, Channel *cChannel, bool recurse) {
 
 	qlChans.append(cChannel);
 
+	QMutexLocker qml(&qmCache);
+
 	while (!qlChans.isEmpty()) {
 		Channel *chan = qlChans.takeLast();
 		Group *g;
 		foreach(g, chan->qhGroups) {
 			g->qsTemporary.remove(user->iId);
 			g->qsTemporary.remove(- static_cast<int>(user->uiSession));
+			g->updateIndex(user->iId);
+			g->updateIndex(- static_cast<int>(user->uiSession));
 		}
 
 		if (recurse)
 			qlChans << chan->qlChannels;
 	}
 
+	qml.unlock();
+
 	clearACLCache(user);
 }
 
+// Authenticators and listeners may live on another thread than a server
+// with a control thread of its own. They are still called directly, as
+// the authenticator returns its results through reference arguments and
+// listeners get pointers to live users and channels.
 void Server::connectAuthenticator(QObject *obj) {
-	connect(this, SIGNAL(registerUserSig(int &, const QMap<int, QString> &)), obj, SLOT(registerUserSlot(int &, const QMap<int, QString> &)));
-	connect(this, SIGNAL(unregisterUserSig(int &, int)), obj, SLOT(unregisterUserSlot(int &, int)));
-	connect(this, SIGNAL(getRegisteredUsersSig(const QString &, QMap<int, QString> &)), obj, SLOT(getRegisteredUsersSlot(const QString &, QMap<int, QString> &)));
-	connect(this, SIGNAL(getRegistrationSig(int &, int, QMap<int, QString> &)), obj, SLOT(getRegistrationSlot(int &, int, QMap<int, QString> &)));
-	connect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)));
-	connect(this, SIGNAL(setInfoSig(int &, int, const QMap<int, QString> &)), obj, SLOT(setInfoSlot(int &, int, const QMap<int, QString> &)));
-	connect(this, SIGNAL(setTextureSig(int &, int, const QByteArray &)), obj, SLOT(setTextureSlot(int &, int, const QByteArray &)));
-	connect(this, SIGNAL(idToNameSig(QString &, int)), obj, SLOT(idToNameSlot(QString &, int)));
-	connect(this, SIGNAL(nameToIdSig(int &, const QString &)), obj, SLOT(nameToIdSlot(int &, const QString &)));
-	connect(this, SIGNAL(idToTextureSig(QByteArray &, int)), obj, SLOT(idToTextureSlot(QByteArray &, int)));
+	connect(this, SIGNAL(registerUserSig(int &, const QMap<int, QString> &)), obj, SLOT(registerUserSlot(int &, const QMap<int, QString> &)), Qt::DirectConnection);
+	connect(this, SIGNAL(unregisterUserSig(int &, int)), obj, SLOT(unregisterUserSlot(int &, int)), Qt::DirectConnection);
+	connect(this, SIGNAL(getRegisteredUsersSig(const QString &, QMap<int, QString> &)), obj, SLOT(getRegisteredUsersSlot(const QString &, QMap<int, QString> &)), Qt::DirectConnection);
+	connect(this, SIGNAL(getRegistrationSig(int &, int, QMap<int, QString> &)), obj, SLOT(getRegistrationSlot(int &, int, QMap<int, QString> &)), Qt::DirectConnection);
+	connect(this, SIGNAL(authenticateSig(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), obj, SLOT(authenticateSlot(int &, QString &, int, const QList<QSslCertificate> &, const QString &, bool, const QString &)), Qt::DirectConnection);
+	connect(this, SIGNAL(setInfoSig(int &, int, const QMap<int, QString> &)), obj, SLOT(setInfoSlot(int &, int, const QMap<int, QString> &)), Qt::DirectConnection);
+	connect(this, SIGNAL(setTextureSig(int &, int, const QByteArray &)), obj, SLOT(setTextureSlot(int &, int, const QByteArray &)), Qt::DirectConnection);
+	connect(this, SIGNAL(idToNameSig(QString &, int)), obj, SLOT(idToNameSlot(QString &, int)), Qt::DirectConnection);
+	connect(this, SIGNAL(nameToIdSig(int &, const QString &)), obj, SLOT(nameToIdSlot(int &, const QString &)), Qt::DirectConnection);
+	connect(this, SIGNAL(idToTextureSig(QByteArray &, int)), obj, SLOT(idToTextureSlot(QByteArray &, int)), Qt::DirectConnection);
 }
 
 void Server::disconnectAuthenticator(QObject *obj) {
@@ -309,13 +343,13 @@ void Server::disconnectAuthenticator(QObject *obj) {
 }
 
 void Server::connectListener(QObject *obj) {
-	connect(this, SIGNAL(userStateChanged(const User *)), obj, SLOT(userStateChanged(const User *)));
-	connect(this, SIGNAL(userTextMessage(const User *, const TextMessage &)), obj, SLOT(userTextMessage(const User *, const TextMessage &)));
-	connect(this, SIGNAL(userConnected(const User *)), obj, SLOT(userConnected(const User *)));
-	connect(this, SIGNAL(userDisconnected(const User *)), obj, SLOT(userDisconnected(const User *)));
-	connect(this, SIGNAL(channelStateChanged(const Channel *)), obj, SLOT(channelStateChanged(const Channel *)));
-	connect(this, SIGNAL(channelCreated(const Channel *)), obj, SLOT(channelCreated(const Channel *)));
-	connect(this, SIGNAL(channelRemoved(const Channel *)), obj, SLOT(channelRemoved(const Channel *)));
+	connect(this, SIGNAL(userStateChanged(const User *)), obj, SLOT(userStateChanged(const User *)), Qt::DirectConnection);
+	connect(this, SIGNAL(userTextMessage(const User *, const TextMessage &)), obj, SLOT(userTextMessage(const User *, const TextMessage &)), Qt::DirectConnection);
+	connect(this, SIGNAL(userConnected(const User *)), obj, SLOT(userConnected(const User *)), Qt::DirectConnection);
+	connect(this, SIGNAL(userDisconnected(const User *)), obj, SLOT(userDisconnected(const User *)), Qt::DirectConnection);
+	connect(this, SIGNAL(channelStateChanged(const Channel *)), obj, SLOT(channelStateChanged(const Channel *)), Qt::DirectConnection);
+	connect(this, SIGNAL(channelCreated(const Channel *)), obj, SLOT(channelCreated(const Channel *)), Qt::DirectConnection);
+	connect(this, SIGNAL(channelRemoved(const Channel *)), obj, SLOT(channelRemoved(const Channel *)), Qt::DirectConnection);
 }
 
 void Server::disconnectListener(QObject *obj) {
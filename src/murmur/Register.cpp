@@ -104,7 +104,7 @@ void Server::update() {
 
 	tag=doc.createElement(QLatin1String("channels"));
 	root.appendChild(tag);
-	t=doc.createTextNode(QString::number(qhChannels.count()));
+	t=doc.createTextNode(QString::number(bHibernating ? iHibernatedChannels : qhChannels.count()));
 	tag.appendChild(t);
 
 	if (!qsRegLocation.isEmpty()) {
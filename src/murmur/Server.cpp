@@ -34,6 +34,7 @@
 #include "Server.h"
 
 #include "ACL.h"
+#include "AllocCounter.h"
 #include "Connection.h"
 #include "Group.h"
 #include "User.h"
@@ -44,6 +45,14 @@
 #include "ServerDB.h"
 #include "ServerUser.h"
 
+#ifdef USE_TLS_RESUMPTION
+#include "TlsSession.h"
+#endif
+
+#ifdef Q_OS_LINUX
+#include "UdpPool.h"
+#endif
+
 #ifdef USE_BONJOUR
 #include "BonjourServer.h"
 #include "BonjourServiceRegister.h"
@@ -55,6 +64,182 @@
 
 #define UDP_PACKET_SIZE 1024
 
+// Slots leave room for the largest cipher header on forwarded packets and
+// are padded to keep every slot 8 byte aligned.
+#define UDP_SLOT_SIZE (UDP_PACKET_SIZE + 16)
+#define UDP_MAX_BATCH 64
+
+// Voice packets waiting for TCP-only users, and how many of them the main
+// thread writes out before it lets other events in.
+#define TCP_VOICE_QUEUE 1024
+#define TCP_VOICE_DRAIN 256
+
+// How many IV bytes before the hinted one an unknown peer may start at,
+// and how many other users we trial decrypt for it beyond that.
+#define UDP_HINT_WINDOW 8
+#define UDP_TRIAL_LIMIT 8
+
+#ifdef Q_OS_LINUX
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#define UDP_CONTROL_SIZE CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))
+
+/// Attach the source address control message to a datagram headed for "to", so
+/// the reply leaves from the address the client connected to over TCP.
+/// msg->msg_control must point to at least UDP_CONTROL_SIZE bytes.
+/// Returns false if the datagram can't be sent from that address.
+static bool setPktInfo(struct msghdr *msg, const struct sockaddr_storage &to, const struct sockaddr_storage &local) {
+	memset(msg->msg_control, 0, UDP_CONTROL_SIZE);
+	msg->msg_controllen = CMSG_SPACE((to.ss_family == AF_INET6) ? sizeof(struct in6_pktinfo) : sizeof(struct in_pktinfo));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	HostAddress tcpha(local);
+	if (to.ss_family == AF_INET6) {
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+		struct in6_pktinfo *pktinfo = reinterpret_cast<struct in6_pktinfo *>(CMSG_DATA(cmsg));
+		memset(pktinfo, 0, sizeof(*pktinfo));
+		memcpy(&pktinfo->ipi6_addr.s6_addr[0], &tcpha.qip6.c[0], sizeof(pktinfo->ipi6_addr.s6_addr));
+	} else {
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		struct in_pktinfo *pktinfo = reinterpret_cast<struct in_pktinfo *>(CMSG_DATA(cmsg));
+		memset(pktinfo, 0, sizeof(*pktinfo));
+		if (tcpha.isV6())
+			return false;
+		pktinfo->ipi_spec_dst.s_addr = tcpha.hash[3];
+	}
+	return true;
+}
+
+/// Collects the encrypted datagrams of outgoing voice frames, so they can be
+/// handed to the kernel with one sendmmsg() per socket instead of one
+/// sendmsg() per recipient. Every queued datagram carries its own copy of the
+/// destination, so a batch stays valid if the user goes away before the flush.
+class UdpFanout {
+	private:
+		Q_DISABLE_COPY(UdpFanout)
+	protected:
+		Server *s;
+		int iCount;
+		char rawslots[UDP_MAX_BATCH * UDP_SLOT_SIZE + 8];
+		char *slots;
+		struct sockaddr_storage to[UDP_MAX_BATCH];
+		struct mmsghdr mmsg[UDP_MAX_BATCH];
+		struct iovec iov[UDP_MAX_BATCH];
+		u_char controldata[UDP_MAX_BATCH * UDP_CONTROL_SIZE];
+		int sock[UDP_MAX_BATCH];
+	public:
+		UdpFanout(Server *srv);
+		~UdpFanout();
+		char *reserve();
+		void queue(const ServerUser *u, int len);
+		void flush();
+};
+
+UdpFanout::UdpFanout(Server *srv) : s(srv), iCount(0) {
+	// Same layout as the receive slots in Server::udpReceive().
+	slots = reinterpret_cast<char *>(((reinterpret_cast<quintptr>(rawslots) + 7) & ~static_cast<quintptr>(7)) + 4);
+}
+
+UdpFanout::~UdpFanout() {
+	flush();
+}
+
+/// Returns the slot the next datagram should be encrypted into, flushing the
+/// batch first if it is full.
+char *UdpFanout::reserve() {
+	if (iCount == UDP_MAX_BATCH)
+		flush();
+	return slots + iCount * UDP_SLOT_SIZE;
+}
+
+/// Queue the len bytes just encrypted into the reserved slot for u.
+/// Called with u->qmCrypt held, which guards the destination.
+void UdpFanout::queue(const ServerUser *u, int len) {
+	struct msghdr &msg = mmsg[iCount].msg_hdr;
+
+	memcpy(&to[iCount], &u->saiUdpAddress, sizeof(to[iCount]));
+
+	iov[iCount].iov_base = slots + iCount * UDP_SLOT_SIZE;
+	iov[iCount].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = reinterpret_cast<struct sockaddr *>(&to[iCount]);
+	msg.msg_namelen = (to[iCount].ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov[iCount];
+	msg.msg_iovlen = 1;
+	msg.msg_control = controldata + iCount * UDP_CONTROL_SIZE;
+
+	if (! setPktInfo(&msg, to[iCount], u->saiTcpLocalAddress))
+		return;
+
+	sock[iCount] = u->sUdpSocket;
+	++iCount;
+}
+
+void UdpFanout::flush() {
+	static const char *buckets[] = { "udp.sendbatch.1", "udp.sendbatch.2-3", "udp.sendbatch.4-7", "udp.sendbatch.8-15", "udp.sendbatch.16-31", "udp.sendbatch.32-64" };
+	qint64 histogram[6] = { 0, 0, 0, 0, 0, 0 };
+	qint64 calls = 0;
+	qint64 datagrams = 0;
+	qint64 errors = 0;
+
+	if (iCount == 0)
+		return;
+
+	// Group the datagrams by socket; a server has one socket per bind address.
+	int i = 0;
+	while (i < iCount) {
+		int n = i + 1;
+		for (int j = n; j < iCount; ++j) {
+			if (sock[j] == sock[i]) {
+				qSwap(mmsg[n], mmsg[j]);
+				qSwap(sock[n], sock[j]);
+				++n;
+			}
+		}
+
+		struct mmsghdr *msgs = mmsg + i;
+		int left = n - i;
+		while (left > 0) {
+			int sent = ::sendmmsg(sock[i], msgs, left, 0);
+			++calls;
+			if (sent <= 0) {
+				if (errno == EINTR)
+					continue;
+				// Drop the datagram that failed, as a failed sendmsg() would.
+				++errors;
+				sent = 1;
+			} else {
+				int b = 0;
+				while ((b < 5) && (sent >> (b + 1)))
+					++b;
+				++histogram[b];
+				datagrams += sent;
+			}
+			msgs += sent;
+			left -= sent;
+		}
+		i = n;
+	}
+	iCount = 0;
+
+	QMutexLocker qml(&s->qmStatistics);
+	s->qhStatistics[QLatin1String("udp.sendmmsg.calls")] += calls;
+	s->qhStatistics[QLatin1String("udp.sendmmsg.datagrams")] += datagrams;
+	if (errors)
+		s->qhStatistics[QLatin1String("udp.sendmmsg.errors")] += errors;
+	for (int b = 0; b < 6; ++b)
+		if (histogram[b])
+			s->qhStatistics[QLatin1String(buckets[b])] += histogram[b];
+}
+#endif
+
 LogEmitter::LogEmitter(QObject *p) : QObject(p) {
 };
 
@@ -70,9 +255,55 @@ void ExecEvent::execute() {
 	func();
 }
 
+static QThreadStorage<Server **> qtsCurrentServer;
+
+ServerScope::ServerScope(Server *s) {
+	if (! qtsCurrentServer.hasLocalData())
+		qtsCurrentServer.setLocalData(new Server *(NULL));
+	Server **cur = qtsCurrentServer.localData();
+	sPrevious = *cur;
+	*cur = s;
+}
+
+ServerScope::~ServerScope() {
+	*qtsCurrentServer.localData() = sPrevious;
+}
+
+Server *ServerScope::current() {
+	if (! qtsCurrentServer.hasLocalData())
+		return NULL;
+	return *qtsCurrentServer.localData();
+}
+
 SslServer::SslServer(QObject *p) : QTcpServer(p) {
 }
 
+UdpWorker::UdpWorker(Server *srv, int worker) : QThread(), s(srv), iWorker(worker) {
+}
+
+void UdpWorker::run() {
+	s->udpLoop(iWorker);
+}
+
+/// One share of a voice frame's recipients, handed to a FanoutWorker.
+/// Lives on the stack of the voice thread, which waits for *piPending to
+/// drop to zero before it returns and leaves its voice epoch.
+struct FanoutSlice {
+	const VoiceRecipient *vr;
+	const VoiceRecipient *end;
+	const char *buffer;
+	int len;
+	unsigned int poslen;
+	int *piPending;
+};
+
+FanoutWorker::FanoutWorker(Server *srv) : QThread(), s(srv) {
+}
+
+void FanoutWorker::run() {
+	s->fanoutLoop();
+}
+
 void SslServer::incomingConnection(int v) {
 	QSslSocket *s = new QSslSocket(this);
 	s->setSocketDescriptor(v);
@@ -85,9 +316,155 @@ QSslSocket *SslServer::nextPendingSSLConnection() {
 	return qlSockets.takeFirst();
 }
 
+HandshakeWorker::HandshakeWorker(QObject *owner, int server, int timeout, bool threaded) : QObject(), qtThread(NULL), qoOwner(owner), iServerNum(server), iTimeout(timeout) {
+	static bool bDeclared = false;
+	if (! bDeclared) {
+		bDeclared = true;
+		qRegisterMetaType<QSslSocket *>("QSslSocket *");
+	}
+
+	qtExpire = new QTimer(this);
+	connect(qtExpire, SIGNAL(timeout()), this, SLOT(expire()));
+
+	if (threaded) {
+		qtThread = new QThread();
+		moveToThread(qtThread);
+		qtThread->start();
+	} else {
+		// Follow the server to its control thread.
+		setParent(owner);
+	}
+}
+
+HandshakeWorker::~HandshakeWorker() {
+	if (qtThread) {
+		QMetaObject::invokeMethod(this, "shutdown", Qt::BlockingQueuedConnection);
+		qtThread->quit();
+		qtThread->wait();
+		delete qtThread;
+	} else {
+		shutdown();
+	}
+}
+
+/// Take over sock, which must not have a parent. Called on the control thread.
+void HandshakeWorker::start(QSslSocket *sock) {
+	sock->moveToThread(thread());
+	QMetaObject::invokeMethod(this, "handshake", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock));
+}
+
+void HandshakeWorker::handshake(QSslSocket *sock) {
+	qhPending.insert(sock, Pending());
+
+	connect(sock, SIGNAL(encrypted()), this, SLOT(encrypted()));
+	connect(sock, SIGNAL(sslErrors(const QList<QSslError> &)), this, SLOT(sslErrors(const QList<QSslError> &)));
+	connect(sock, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError()));
+	connect(sock, SIGNAL(disconnected()), this, SLOT(socketError()));
+
+	if (! qtExpire->isActive())
+		qtExpire->start(1000);
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
+	sock->setProtocol(QSsl::TlsV1_0);
+#else
+	sock->setProtocol(QSsl::TlsV1);
+#endif
+
+#ifdef USE_TLS_RESUMPTION
+	TlsSessionCache::instance()->attach(sock, iServerNum);
+#endif
+
+	sock->startServerEncryption();
+}
+
+/// Mark the handshake of sock as failed and close it. The socket is only
+/// handed back once control has returned to the event loop, as we may be
+/// inside one of its signals.
+void HandshakeWorker::fail(QSslSocket *sock, const QString &reason) {
+	QHash<QSslSocket *, Pending>::iterator i = qhPending.find(sock);
+	if ((i == qhPending.end()) || (i->bDone && ! i->bOk))
+		return;
+
+	bool queued = i->bDone;
+	i->bDone = true;
+	i->bOk = false;
+	i->qsReason = reason;
+
+	if (! queued)
+		QMetaObject::invokeMethod(this, "release", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock));
+	sock->abort();
+}
+
+void HandshakeWorker::encrypted() {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	QHash<QSslSocket *, Pending>::iterator i = qhPending.find(sock);
+	if ((i == qhPending.end()) || i->bDone)
+		return;
+
+	i->bDone = true;
+	i->bOk = true;
+	QMetaObject::invokeMethod(this, "release", Qt::QueuedConnection, Q_ARG(QSslSocket *, sock));
+}
+
+void HandshakeWorker::sslErrors(const QList<QSslError> &errors) {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	QHash<QSslSocket *, Pending>::iterator i = qhPending.find(sock);
+	if (i == qhPending.end())
+		return;
+
+	const QStringList fatal = Server::fatalSslErrors(errors, i->bVerified);
+	if (fatal.isEmpty())
+		sock->ignoreSslErrors();
+	else
+		fail(sock, QString::fromLatin1("SSL Error: %1").arg(fatal.join(QLatin1String(", "))));
+}
+
+void HandshakeWorker::socketError() {
+	QSslSocket *sock = qobject_cast<QSslSocket *>(sender());
+	fail(sock, sock->errorString());
+}
+
+void HandshakeWorker::expire() {
+	QList<QSslSocket *> qlExpired;
+	for (QHash<QSslSocket *, Pending>::const_iterator i = qhPending.constBegin(); i != qhPending.constEnd(); ++i)
+		if (! i->bDone && (i->tStarted.elapsed() > static_cast<quint64>(iTimeout) * 1000000ULL))
+			qlExpired << i.key();
+
+	foreach(QSslSocket *sock, qlExpired)
+		fail(sock, QLatin1String("Handshake timed out"));
+}
+
+void HandshakeWorker::release(QSslSocket *sock) {
+	if (! qhPending.contains(sock))
+		return;
+
+	const Pending p = qhPending.take(sock);
+	if (qhPending.isEmpty())
+		qtExpire->stop();
+
+	disconnect(sock, NULL, this, NULL);
+	sock->moveToThread(qoOwner->thread());
+	emit handshakeDone(sock, p.bOk, p.bVerified, p.qsReason);
+}
+
+/// Drop every socket still in our hands. Runs on our own thread, just
+/// before it is stopped.
+void HandshakeWorker::shutdown() {
+	qtExpire->stop();
+	foreach(QSslSocket *sock, qhPending.keys()) {
+		disconnect(sock, NULL, this, NULL);
+		sock->abort();
+		delete sock;
+	}
+	qhPending.clear();
+}
+
 Server::Server(int snum, QObject *p) : QThread(p) {
 	bValid = true;
 	iServerNum = snum;
+	uiRouteGeneration = 0;
+	bFanoutStop = false;
+	bUdpPooled = false;
 #ifdef USE_BONJOUR
 	bsRegistration = NULL;
 #endif
@@ -98,6 +475,19 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = NULL;
 #endif
 	qtTimeout = new QTimer(this);
+	// Members are no children, but qtTick has to follow us to a control thread.
+	qtTick.setParent(this);
+	tvqTcp = new TcpVoiceQueue(TCP_VOICE_QUEUE, UDP_PACKET_SIZE);
+	qtReclaim = new QTimer(this);
+	qtReclaim->setSingleShot(true);
+	bHibernating = false;
+	iHibernatedChannels = 0;
+	qtHibernate = new QTimer(this);
+	qtHibernate->setSingleShot(true);
+	connect(qtHibernate, SIGNAL(timeout()), this, SLOT(hibernate()));
+	for (int i=0;i<VOICE_LOCKWAIT_BUCKETS;++i)
+		uiLockWait[i] = 0;
+	uiControlMessages = 0;
 
 	iCodecAlpha = iCodecBeta = 0;
 	bPreferAlpha = false;
@@ -108,6 +498,17 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	readParams();
 	initialize();
 
+#ifdef USE_TLS_RESUMPTION
+	// The handshake workers share it, so create it here.
+	TlsSessionCache::instance();
+#endif
+	iNextHandshakeWorker = 0;
+	for (int i=0;i<qMax(iHandshakeThreads, 1);++i) {
+		HandshakeWorker *hw = new HandshakeWorker(this, iServerNum, iTimeout, iHandshakeThreads > 0);
+		connect(hw, SIGNAL(handshakeDone(QSslSocket *, bool, bool, const QString &)), this, SLOT(handshakeDone(QSslSocket *, bool, bool, const QString &)));
+		qlHandshakeWorkers << hw;
+	}
+
 	foreach(const QHostAddress &qha, qlBind) {
 		SslServer *ss = new SslServer(this);
 
@@ -136,61 +537,69 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 #endif
 		memset(&addr, 0, sizeof(addr));
 		getsockname(tcpsock, reinterpret_cast<struct sockaddr *>(&addr), &len);
+		for (int k=0;k<iUdpThreads;++k) {
 #ifdef Q_OS_UNIX
-		int sock = ::socket(addr.ss_family, SOCK_DGRAM, 0);
+			int sock = ::socket(addr.ss_family, SOCK_DGRAM, 0);
 #ifdef Q_OS_LINUX
-		int sockopt = 1;
-		if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &sockopt, sizeof(sockopt)))
-			log(QString("Failed to set IP_PKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
-		sockopt = 1;
-		if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt)))
-			log(QString("Failed to set IPV6_RECVPKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			int sockopt = 1;
+			if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set IP_PKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			sockopt = 1;
+			if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &sockopt, sizeof(sockopt)))
+				log(QString("Failed to set IPV6_RECVPKTINFO for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			if (iUdpThreads > 1) {
+				// Let the kernel spread incoming datagrams over one socket per voice thread.
+				sockopt = 1;
+				if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)))
+					log(QString("Failed to set SO_REUSEPORT for %1").arg(addressToString(ss->serverAddress(), usPort)));
+			}
 #endif
 #else
 #ifndef SIO_UDP_CONNRESET
 #define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
 #endif
-		SOCKET sock = ::WSASocket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
-		DWORD dwBytesReturned = 0;
-		BOOL bNewBehaviour = FALSE;
-		if (WSAIoctl(sock, SIO_UDP_CONNRESET, &bNewBehaviour, sizeof(bNewBehaviour), NULL, 0, &dwBytesReturned, NULL, NULL) == SOCKET_ERROR) {
-			log(QString("Failed to set SIO_UDP_CONNRESET: %1").arg(WSAGetLastError()));
-		}
+			SOCKET sock = ::WSASocket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+			DWORD dwBytesReturned = 0;
+			BOOL bNewBehaviour = FALSE;
+			if (WSAIoctl(sock, SIO_UDP_CONNRESET, &bNewBehaviour, sizeof(bNewBehaviour), NULL, 0, &dwBytesReturned, NULL, NULL) == SOCKET_ERROR) {
+				log(QString("Failed to set SIO_UDP_CONNRESET: %1").arg(WSAGetLastError()));
+			}
 #endif
-		if (sock == INVALID_SOCKET) {
-			log("Failed to create UDP Socket");
-			bValid = false;
-			return;
-		} else {
-			if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR) {
-				log(QString("Failed to bind UDP Socket to %1").arg(addressToString(ss->serverAddress(), usPort)));
+			if (sock == INVALID_SOCKET) {
+				log("Failed to create UDP Socket");
+				bValid = false;
+				return;
 			} else {
+				if (::bind(sock, reinterpret_cast<sockaddr *>(&addr), len) == SOCKET_ERROR) {
+					log(QString("Failed to bind UDP Socket to %1").arg(addressToString(ss->serverAddress(), usPort)));
+				} else {
 #ifdef Q_OS_UNIX
-				int val = 0xe0;
-				if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val))) {
-					val = 0x80;
-					if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val)))
-						log("Server: Failed to set TOS for UDP Socket");
-				}
+					int val = 0xe0;
+					if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val))) {
+						val = 0x80;
+						if (setsockopt(sock, IPPROTO_IP, IP_TOS, &val, sizeof(val)))
+							log("Server: Failed to set TOS for UDP Socket");
+					}
 #if defined(SO_PRIORITY)
-				socklen_t optlen = sizeof(val);
-				if (getsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, &optlen) == 0) {
-					if (val == 0) {
-						val = 6;
-						setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+					socklen_t optlen = sizeof(val);
+					if (getsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, &optlen) == 0) {
+						if (val == 0) {
+							val = 6;
+							setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+						}
 					}
-				}
 #endif
 #endif
+				}
+				QSocketNotifier *qsn = new QSocketNotifier(sock, QSocketNotifier::Read, this);
+				connect(qsn, SIGNAL(activated(int)), this, SLOT(udpActivated(int)));
+				qlUdpSocket << sock;
+				qlUdpNotifier << qsn;
 			}
-			QSocketNotifier *qsn = new QSocketNotifier(sock, QSocketNotifier::Read, this);
-			connect(qsn, SIGNAL(activated(int)), this, SLOT(udpActivated(int)));
-			qlUdpSocket << sock;
-			qlUdpNotifier << qsn;
 		}
 	}
 
-	bValid = bValid && (qlServer.count() == qlBind.count()) && (qlUdpSocket.count() == qlBind.count());
+	bValid = bValid && (qlServer.count() == qlBind.count()) && (qlUdpSocket.count() == qlBind.count() * iUdpThreads);
 	if (! bValid)
 		return;
 
@@ -204,13 +613,14 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 	hNotify = CreateEvent(NULL, FALSE, FALSE, NULL);
 #endif
 
-	connect(this, SIGNAL(tcpTransmit(QByteArray, unsigned int)), this, SLOT(tcpTransmitData(QByteArray, unsigned int)), Qt::QueuedConnection);
+	connect(this, SIGNAL(tcpVoiceReady()), this, SLOT(tcpDrain()), Qt::QueuedConnection);
 	connect(this, SIGNAL(reqSync(unsigned int)), this, SLOT(doSync(unsigned int)));
 
 	for (int i=1;i<iMaxUsers*2;++i)
 		qqIds.enqueue(i);
 
 	connect(qtTimeout, SIGNAL(timeout()), this, SLOT(checkTimeout()));
+	connect(qtReclaim, SIGNAL(timeout()), this, SLOT(reclaimUsers()));
 
 	getBans();
 	readChannels();
@@ -230,17 +640,40 @@ Server::Server(int snum, QObject *p) : QThread(p) {
 #endif
 		initRegister();
 
+		scheduleHibernate();
 	}
 }
 
 void Server::startThread() {
-	if (! isRunning()) {
-		log("Starting voice thread");
+	qtHibernate->stop();
+
+	if (! isRunning() && ! bUdpPooled) {
 		bRunning = true;
 
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(false);
-		start(QThread::HighestPriority);
+#ifdef Q_OS_LINUX
+		bUdpPooled = (meta->upUdpPool != NULL);
+#endif
+		if (bUdpPooled) {
+#ifdef Q_OS_LINUX
+			log("Handing voice to the UDP pool");
+			meta->upUdpPool->add(this, qlUdpSocket);
+#endif
+		} else {
+			log("Starting voice thread");
+			start(QThread::HighestPriority);
+			for (int i=1;i<iUdpThreads;++i) {
+				UdpWorker *uw = new UdpWorker(this, i);
+				uw->start(QThread::HighestPriority);
+				qlUdpWorkers << uw;
+			}
+		}
+		for (int i=0;i<iFanoutThreads;++i) {
+			FanoutWorker *fw = new FanoutWorker(this);
+			fw->start(QThread::HighestPriority);
+			qlFanoutWorkers << fw;
+		}
 #ifdef Q_OS_LINUX
 		// QThread::HighestPriority == Same as everything else...
 		int policy;
@@ -260,22 +693,124 @@ void Server::startThread() {
 
 void Server::stopThread() {
 	bRunning = false;
-	if (isRunning()) {
-		log("Ending voice thread");
-
+	if (isRunning() || bUdpPooled) {
 #ifdef Q_OS_UNIX
 		unsigned char val = 0;
-		if (::write(aiNotify[1], &val, 1) != 1)
-			log("Failed to signal voice thread");
+#endif
+		if (bUdpPooled) {
+#ifdef Q_OS_LINUX
+			log("Taking voice back from the UDP pool");
+			meta->upUdpPool->remove(this);
+#endif
+			bUdpPooled = false;
+		} else {
+			log("Ending voice thread");
+
+#ifdef Q_OS_UNIX
+			if (::write(aiNotify[1], &val, 1) != 1)
+				log("Failed to signal voice thread");
 #else
-		SetEvent(hNotify);
+			SetEvent(hNotify);
+#endif
+			wait();
+
+			foreach(UdpWorker *uw, qlUdpWorkers) {
+				uw->wait();
+				delete uw;
+			}
+			qlUdpWorkers.clear();
+		}
+
+		// No voice thread is left to queue slices, so the helpers only
+		// have to be woken up.
+		{
+			QMutexLocker qml(&qmFanout);
+			bFanoutStop = true;
+			qwcFanoutWork.wakeAll();
+		}
+		foreach(FanoutWorker *fw, qlFanoutWorkers) {
+			fw->wait();
+			delete fw;
+		}
+		qlFanoutWorkers.clear();
+		bFanoutStop = false;
+
+#ifdef Q_OS_UNIX
+		// Every voice thread polls the notify socket, so it is only drained
+		// once all of them are gone.
+		while (::recv(aiNotify[0], &val, 1, MSG_DONTWAIT) == 1) {};
 #endif
-		wait();
 
 		foreach(QSocketNotifier *qsn, qlUdpNotifier)
 			qsn->setEnabled(true);
 	}
 	qtTimeout->stop();
+
+	// With the voice threads gone, nothing retired can still be in use.
+	reclaimUsers();
+
+	if (qhUsers.isEmpty())
+		scheduleHibernate();
+}
+
+void Server::scheduleHibernate() {
+	if (iHibernateAfter > 0)
+		qtHibernate->start(iHibernateAfter * 1000);
+	else
+		qtHibernate->stop();
+}
+
+/// Drop the channel tree, with its ACLs and groups, of a server nobody is
+/// on. wake() reads them back. Bans stay, so that connections can be
+/// refused without waking up.
+void Server::hibernate() {
+	if (bHibernating || (iHibernateAfter <= 0) || ! qhUsers.isEmpty())
+		return;
+
+	// Try again once the handshakes in progress are done with.
+	if (! qhHandshakeAddress.isEmpty()) {
+		scheduleHibernate();
+		return;
+	}
+
+	iHibernatedChannels = qhChannels.count();
+
+	clearACLCache();
+	clearJoinChannels();
+	delete qhChannels.value(0);
+	qhChannels.clear();
+
+	bHibernating = true;
+	log("Hibernating");
+
+	QMutexLocker qml(&qmStatistics);
+	++qhStatistics[QLatin1String("hibernate.count")];
+}
+
+void Server::wake() {
+	if (! bHibernating)
+		return;
+
+	Timer t;
+
+	readChannels();
+	readLinks();
+
+	bHibernating = false;
+
+	// Nobody may end up connecting, e.g. after an RPC call.
+	if (qhUsers.isEmpty())
+		scheduleHibernate();
+
+	const quint64 usec = t.elapsed();
+	log(QString("Woke up in %1 ms").arg(usec / 1000ULL));
+
+	QMutexLocker qml(&qmStatistics);
+	++qhStatistics[QLatin1String("hibernate.wakeups")];
+	qhStatistics[QLatin1String("hibernate.coldstart.last.usec")] = static_cast<qint64>(usec);
+	qhStatistics[QLatin1String("hibernate.coldstart.total.usec")] += static_cast<qint64>(usec);
+	qint64 &worst = qhStatistics[QLatin1String("hibernate.coldstart.max.usec")];
+	worst = qMax(worst, static_cast<qint64>(usec));
 }
 
 Server::~Server() {
@@ -283,6 +818,10 @@ Server::~Server() {
 	removeBonjour();
 #endif
 
+	foreach(HandshakeWorker *hw, qlHandshakeWorkers)
+		delete hw;
+	qlHandshakeWorkers.clear();
+
 	stopThread();
 
 	foreach(QSocketNotifier *qsn, qlUdpNotifier)
@@ -304,6 +843,12 @@ Server::~Server() {
 #endif
 	clearACLCache();
 
+	delete tvqTcp;
+
+	foreach(const QList< ::google::protobuf::Message *> &l, qhMessagePool)
+		foreach(::google::protobuf::Message *msg, l)
+			delete msg;
+
 	log("Stopped");
 }
 
@@ -336,6 +881,14 @@ void Server::readParams() {
 	qvSuggestPushToTalk = Meta::mp.qvSuggestPushToTalk;
 	iOpusThreshold = Meta::mp.iOpusThreshold;
 	iChannelNestingLimit = Meta::mp.iChannelNestingLimit;
+	iUdpBatchSize = Meta::mp.iUdpBatchSize;
+	iUdpThreads = Meta::mp.iUdpThreads;
+	iFanoutThreads = Meta::mp.iFanoutThreads;
+	iFanoutThreshold = Meta::mp.iFanoutThreshold;
+	iTlsCoalesce = Meta::mp.iTlsCoalesce;
+	iHandshakeThreads = Meta::mp.iHandshakeThreads;
+	iHandshakesPerIp = Meta::mp.iHandshakesPerIp;
+	iHibernateAfter = Meta::mp.iHibernateAfter;
 
 	QString qsHost = getConf("host", QString()).toString();
 	if (! qsHost.isEmpty()) {
@@ -402,6 +955,21 @@ void Server::readParams() {
 
 	iChannelNestingLimit = getConf("channelnestinglimit", iChannelNestingLimit).toInt();
 
+	iUdpBatchSize = getConf("udpbatchsize", iUdpBatchSize).toInt();
+	iUdpThreads = getConf("udpthreads", iUdpThreads).toInt();
+#ifdef Q_OS_LINUX
+	iUdpThreads = qBound(1, iUdpThreads, 64);
+#else
+	// Spreading datagrams over several sockets needs SO_REUSEPORT as Linux implements it.
+	iUdpThreads = 1;
+#endif
+	iFanoutThreads = qBound(0, getConf("fanoutthreads", iFanoutThreads).toInt(), 64);
+	iFanoutThreshold = qMax(1, getConf("fanoutthreshold", iFanoutThreshold).toInt());
+	iTlsCoalesce = getConf("tlscoalesce", iTlsCoalesce).toInt();
+	iHandshakeThreads = qBound(0, getConf("handshakethreads", iHandshakeThreads).toInt(), 64);
+	iHandshakesPerIp = getConf("handshakesperip", iHandshakesPerIp).toInt();
+	iHibernateAfter = getConf("hibernateafter", iHibernateAfter).toInt();
+
 	qrUserName=QRegExp(getConf("username", qrUserName.pattern()).toString());
 	qrChannelName=QRegExp(getConf("channelname", qrChannelName.pattern()).toString());
 }
@@ -475,6 +1043,7 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		QString text = !v.isNull() ? v : Meta::mp.qsRegName;
 		if (text != qsRegName) {
 			qsRegName = text;
+			clearJoinChannels();
 			if (! qsRegName.isEmpty()) {
 				MumbleProto::ChannelState mpcs;
 				mpcs.set_channel_id(0);
@@ -516,6 +1085,21 @@ void Server::setLiveConf(const QString &key, const QString &value) {
 		iOpusThreshold = (i >= 0 && !v.isNull()) ? qBound(0, i, 100) : Meta::mp.iOpusThreshold;
 	else if (key =="channelnestinglimit")
 		iChannelNestingLimit = (i >= 0 && !v.isNull()) ? i : Meta::mp.iChannelNestingLimit;
+	else if (key == "udpbatchsize")
+		iUdpBatchSize = (i > 0) ? i : Meta::mp.iUdpBatchSize;
+	else if (key == "fanoutthreshold")
+		iFanoutThreshold = (i > 0) ? i : Meta::mp.iFanoutThreshold;
+	else if (key == "tlscoalesce") {
+		iTlsCoalesce = ! v.isNull() ? i : Meta::mp.iTlsCoalesce;
+		foreach(ServerUser *u, qhUsers)
+			u->setCoalesce(iTlsCoalesce);
+	} else if (key == "handshakesperip")
+		iHandshakesPerIp = ! v.isNull() ? i : Meta::mp.iHandshakesPerIp;
+	else if (key == "hibernateafter") {
+		iHibernateAfter = ! v.isNull() ? i : Meta::mp.iHibernateAfter;
+		if (qhUsers.isEmpty())
+			scheduleHibernate();
+	}
 }
 
 #ifdef USE_BONJOUR
@@ -542,6 +1126,13 @@ void Server::customEvent(QEvent *evt) {
 		static_cast<ExecEvent *>(evt)->execute();
 }
 
+/// Move back to the main thread. Invoked by Meta on our control thread,
+/// before it stops us. RPC calls still queued for us are run first.
+void Server::releaseThread() {
+	QCoreApplication::sendPostedEvents(this, EXEC_QEVENT);
+	moveToThread(QCoreApplication::instance()->thread());
+}
+
 void Server::udpActivated(int socket) {
 	qint32 len;
 	char encrypt[UDP_PACKET_SIZE];
@@ -597,24 +1188,25 @@ void Server::udpActivated(int socket) {
 }
 
 void Server::run() {
-	qint32 len;
-#if defined(__LP64__)
-	char encbuff[UDP_PACKET_SIZE+8];
-	char *encrypt = encbuff + 4;
+	udpLoop(0);
+}
+
+void Server::udpLoop(int worker) {
+#ifdef Q_OS_UNIX
+	QList<int> sockets;
 #else
-	char encrypt[UDP_PACKET_SIZE];
+	QList<SOCKET> sockets;
 #endif
-	char buffer[UDP_PACKET_SIZE];
+	for (int i=worker;i<qlUdpSocket.count();i+=iUdpThreads)
+		sockets << qlUdpSocket.at(i);
 
-	sockaddr_storage from;
-	int nfds = qlUdpSocket.count();
+	int nfds = sockets.count();
 
 #ifdef Q_OS_UNIX
-	socklen_t fromlen;
 	STACKVAR(struct pollfd, fds, nfds+1);
 
 	for (int i=0;i<nfds;++i) {
-		fds[i].fd = qlUdpSocket.at(i);
+		fds[i].fd = sockets.at(i);
 		fds[i].events = POLLIN;
 		fds[i].revents = 0;
 	}
@@ -623,11 +1215,10 @@ void Server::run() {
 	fds[nfds].events = POLLIN;
 	fds[nfds].revents = 0;
 #else
-	int fromlen;
 	STACKVAR(SOCKET, fds, nfds);
 	STACKVAR(HANDLE, events, nfds+1);
 	for (int i=0;i<nfds;++i) {
-		fds[i] = qlUdpSocket.at(i);
+		fds[i] = sockets.at(i);
 		events[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
 		::WSAEventSelect(fds[i], events[i], FD_READ);
 	}
@@ -648,9 +1239,7 @@ void Server::run() {
 		}
 
 		if (fds[nfds - 1].revents) {
-			// Drain pipe
-			unsigned char val;
-			while (::recv(aiNotify[0], &val, 1, MSG_DONTWAIT) == 1) {};
+			// Left for stopThread() to drain, so the other voice threads see it too.
 			break;
 		}
 
@@ -662,154 +1251,292 @@ void Server::run() {
 					break;
 				}
 
-				int sock = fds[i].fd;
+				udpReceive(fds[i].fd, worker);
+				fds[i].revents = 0;
+			}
+		}
 #else
-		{
-			{
-				DWORD ret = WaitForMultipleObjects(nfds, events, FALSE, INFINITE);
-				if (ret == (WAIT_OBJECT_0 + nfds - 1)) {
-					break;
-				}
-				if (ret == WAIT_FAILED) {
-					qCritical("UDP wait failed");
-					bRunning = false;
-					break;
-				}
-				SOCKET sock = fds[ret - WAIT_OBJECT_0];
+		DWORD ret = WaitForMultipleObjects(nfds, events, FALSE, INFINITE);
+		if (ret == (WAIT_OBJECT_0 + nfds - 1)) {
+			break;
+		}
+		if (ret == WAIT_FAILED) {
+			qCritical("UDP wait failed");
+			bRunning = false;
+			break;
+		}
+		udpReceive(fds[ret - WAIT_OBJECT_0], worker);
 #endif
-
-				fromlen = sizeof(from);
+	}
 #ifdef Q_OS_WIN
-				len=::recvfrom(sock, encrypt, UDP_PACKET_SIZE, 0, reinterpret_cast<struct sockaddr *>(&from), &fromlen);
-#else
-#ifdef Q_OS_LINUX
-				struct msghdr msg;
-				struct iovec iov[1];
-
-				iov[0].iov_base = encrypt;
-				iov[0].iov_len = UDP_PACKET_SIZE;
-
-				u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
-
-				memset(&msg, 0, sizeof(msg));
-				msg.msg_name = reinterpret_cast<struct sockaddr *>(&from);
-				msg.msg_namelen = sizeof(from);
-				msg.msg_iov = iov;
-				msg.msg_iovlen = 1;
-				msg.msg_control = controldata;
-				msg.msg_controllen = sizeof(controldata);
+	for (int i=0;i<nfds-1;++i) {
+		::WSAEventSelect(fds[i], NULL, 0);
+		CloseHandle(events[i]);
+	}
+#endif
+}
 
-				len=static_cast<quint32>(::recvmsg(sock, &msg, MSG_TRUNC));
+/// Reads what is waiting on sock and handles it. worker is the voice epoch
+/// reader of the calling thread, either one of our voice threads or one of
+/// the shared UdpPool.
+#ifdef Q_OS_UNIX
+void Server::udpReceive(int sock, int worker) {
+	socklen_t fromlen;
 #else
-				len=static_cast<qint32>(::recvfrom(sock, encrypt, UDP_PACKET_SIZE, MSG_TRUNC, reinterpret_cast<struct sockaddr *>(&from), &fromlen));
-#endif
+void Server::udpReceive(SOCKET sock, int worker) {
+	int fromlen;
 #endif
-				if (len == 0) {
-					break;
-				} else if (len == SOCKET_ERROR) {
-					break;
-				} else if (len < 5) {
-					// 4 bytes crypt header + type + session
-					continue;
-				} else if (len > UDP_PACKET_SIZE) {
-					continue;
-				}
+	qint32 len;
+	char buffer[UDP_PACKET_SIZE];
 
-				QReadLocker rl(&qrwlUsers);
+#ifdef Q_OS_LINUX
+	const int batch = qBound(1, iUdpBatchSize, UDP_MAX_BATCH);
+#else
+	const int batch = 1;
+#endif
 
-				quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
+	// Every datagram of a batch gets its own slot. The payload starts 4 bytes
+	// into an 8 byte aligned slot, so the OCB blocks following the crypt header
+	// are aligned.
+	STACKVAR(char, rxbuff, batch * UDP_SLOT_SIZE + 8);
+	char *slots = reinterpret_cast<char *>(((reinterpret_cast<quintptr>(rxbuff) + 7) & ~static_cast<quintptr>(7)) + 4);
 
-				if ((len == 12) && (*ping == 0) && bAllowPing) {
-					ping[0] = uiVersionBlob;
-					// 1 and 2 will be the timestamp, which we return unmodified.
-					ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
-					ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
-					ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+	STACKVAR(sockaddr_storage, from, batch);
 
 #ifdef Q_OS_LINUX
-					iov[0].iov_len = 6 * sizeof(quint32);
-					::sendmsg(sock, &msg, 0);
+	STACKVAR(struct mmsghdr, mmsg, batch);
+	STACKVAR(struct iovec, iov, batch);
+	STACKVAR(u_char, controldata, batch * UDP_CONTROL_SIZE);
+
+	// Outgoing voice is batched along with incoming; a batch size of 1 keeps
+	// the old behaviour of one system call per datagram in both directions.
+	UdpFanout fanout(this);
+	UdpFanout *pfanout = (batch > 1) ? &fanout : NULL;
 #else
-					::sendto(sock, encrypt, 6 * sizeof(quint32), 0, reinterpret_cast<struct sockaddr *>(&from), fromlen);
+	UdpFanout *pfanout = NULL;
 #endif
-					continue;
-				}
-
 
-				quint16 port = (from.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from)->sin_port);
-				const HostAddress &ha = HostAddress(from);
+	int count = 1;
 
-				const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(ha, port);
+	fromlen = sizeof(from[0]);
+#ifdef Q_OS_WIN
+	len=::recvfrom(sock, slots, UDP_PACKET_SIZE, 0, reinterpret_cast<struct sockaddr *>(&from[0]), &fromlen);
+#else
+#ifdef Q_OS_LINUX
+	for (int j=0;j<batch;++j) {
+		iov[j].iov_base = slots + j * UDP_SLOT_SIZE;
+		iov[j].iov_len = UDP_PACKET_SIZE;
+
+		memset(&mmsg[j], 0, sizeof(mmsg[j]));
+		mmsg[j].msg_hdr.msg_name = reinterpret_cast<struct sockaddr *>(&from[j]);
+		mmsg[j].msg_hdr.msg_namelen = sizeof(from[j]);
+		mmsg[j].msg_hdr.msg_iov = &iov[j];
+		mmsg[j].msg_hdr.msg_iovlen = 1;
+		mmsg[j].msg_hdr.msg_control = controldata + j * UDP_CONTROL_SIZE;
+		mmsg[j].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+	}
 
-				ServerUser *u = qhPeerUsers.value(key);
-				if (u) {
-					if (! checkDecrypt(u, encrypt, buffer, len)) {
-						continue;
-					}
-				} else {
-					// Unknown peer
-					foreach(ServerUser *usr, qhHostUsers.value(ha)) {
-						if (usr->csCrypt.isValid() && checkDecrypt(usr, encrypt, buffer, len)) {
-							// Every time we relock, reverify users' existance.
-							// The main thread might delete the user while the lock isn't held.
-							unsigned int uiSession = usr->uiSession;
-							rl.unlock();
-							qrwlUsers.lockForWrite();
-							if (qhUsers.contains(uiSession)) {
-								u = usr;
-								u->sUdpSocket = sock;
-								memcpy(& u->saiUdpAddress, &from, sizeof(from));
-								qhHostUsers[from].remove(u);
-								qhPeerUsers.insert(key, u);
-								qrwlUsers.unlock();
-								rl.relock();
-								if (! qhUsers.contains(uiSession))
-									u = NULL;
-							}
-							break;
-						}
+	if (batch > 1) {
+		count = ::recvmmsg(sock, mmsg, batch, MSG_TRUNC | MSG_DONTWAIT, NULL);
+		len = (count > 0) ? static_cast<qint32>(mmsg[0].msg_len) : count;
+	} else {
+		len = static_cast<qint32>(::recvmsg(sock, &mmsg[0].msg_hdr, MSG_TRUNC));
+		mmsg[0].msg_len = len;
+	}
+#else
+	len=static_cast<qint32>(::recvfrom(sock, slots, UDP_PACKET_SIZE, MSG_TRUNC, reinterpret_cast<struct sockaddr *>(&from[0]), &fromlen));
+#endif
+#endif
+	// Empty datagrams are skipped below; returning here would drop the rest
+	// of the batch.
+	if ((count <= 0) || (len == SOCKET_ERROR)) {
+		return;
+	}
+
+	// Known peers are handled without qrwlUsers. Any user reached
+	// from here stays allocated until we leave the epoch again.
+	veVoice.enter(worker);
+
+	for (int j=0;j<count;++j) {
+		char *encrypt = slots + j * UDP_SLOT_SIZE;
+#ifdef Q_OS_LINUX
+		len = static_cast<qint32>(mmsg[j].msg_len);
+		struct msghdr &msg = mmsg[j].msg_hdr;
+#endif
+
+		if (len < 5) {
+			// 4 bytes crypt header + type + session
+			continue;
+		} else if (len > UDP_PACKET_SIZE) {
+			continue;
+		}
+
+		quint32 *ping = reinterpret_cast<quint32 *>(encrypt);
+
+		if ((len == 12) && (*ping == 0) && bAllowPing) {
+			ping[0] = uiVersionBlob;
+			// 1 and 2 will be the timestamp, which we return unmodified.
+			lockUsersForVoice();
+			ping[3] = qToBigEndian(static_cast<quint32>(qhUsers.count()));
+			qrwlUsers.unlock();
+			ping[4] = qToBigEndian(static_cast<quint32>(iMaxUsers));
+			ping[5] = qToBigEndian(static_cast<quint32>(iMaxBandwidth));
+
+#ifdef Q_OS_LINUX
+			iov[j].iov_len = 6 * sizeof(quint32);
+			::sendmsg(sock, &msg, 0);
+#else
+			::sendto(sock, encrypt, 6 * sizeof(quint32), 0, reinterpret_cast<struct sockaddr *>(&from[j]), fromlen);
+#endif
+			continue;
+		}
+
+
+		quint16 port = (from[j].ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&from[j])->sin6_port) : (reinterpret_cast<sockaddr_in *>(&from[j])->sin_port);
+		const HostAddress &ha = HostAddress(from[j]);
+
+		// The lookup itself takes no lock; the epoch keeps u alive.
+		ServerUser *u = ptPeerUsers.value(ha, port);
+		if (u) {
+			if (! checkDecrypt(u, encrypt, buffer, len)) {
+				continue;
+			}
+		} else {
+			// Unknown peer. Until it is heard from over UDP, a user's next
+			// IV byte follows the client nonce it got in CryptSetup, so only
+			// users hinted at this byte (or a few before it, for lost packets)
+			// are worth a decryption attempt.
+			lockUsersForVoice();
+			ServerUser *usr = NULL;
+			unsigned char ivbyte = static_cast<unsigned char>(encrypt[0]);
+			for (int d=0;(d < UDP_HINT_WINDOW) && ! usr;++d) {
+				foreach(ServerUser *candidate, qhHintUsers.value(QPair<HostAddress, unsigned char>(ha, static_cast<unsigned char>(ivbyte - d)))) {
+					if (checkDecrypt(candidate, encrypt, buffer, len)) {
+						usr = candidate;
+						break;
 					}
-					if (! u) {
+				}
+			}
+			bool hinted = (usr != NULL);
+
+			// Legacy fallback for users whose nonce has drifted. Bounded, so a
+			// stray packet can't make us try every user behind a shared address.
+			// Each packet starts at a different candidate, so everyone behind
+			// the address gets tried eventually.
+			if (! usr) {
+				const QSet<ServerUser *> candidates = qhHostUsers.value(ha);
+				const int n = candidates.count();
+				int tries = 0;
+				QSet<ServerUser *>::const_iterator it = candidates.constBegin();
+				if (n > UDP_TRIAL_LIMIT) {
+					const int start = static_cast<int>(static_cast<unsigned int>(qaiTrialCursor.fetchAndAddRelaxed(1)) % static_cast<unsigned int>(n));
+					for (int k=0;k<start;++k)
+						++it;
+				}
+				for (int k=0;k<n;++k, ++it) {
+					if (it == candidates.constEnd())
+						it = candidates.constBegin();
+					ServerUser *candidate = *it;
+					if (candidate->bUdpHint && (static_cast<unsigned char>(ivbyte - candidate->ucUdpHint) < UDP_HINT_WINDOW))
 						continue;
+					if (++tries > UDP_TRIAL_LIMIT)
+						break;
+					if (candidate->csCrypt.isValid() && checkDecrypt(candidate, encrypt, buffer, len)) {
+						usr = candidate;
+						break;
 					}
 				}
-				len -= 4;
-
-				MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
-
-				switch (msgType) {
-					case MessageHandler::UDPVoiceSpeex:
-					case MessageHandler::UDPVoiceCELTAlpha:
-					case MessageHandler::UDPVoiceCELTBeta:
-						if (bOpus)
-							break;
-					case MessageHandler::UDPVoiceOpus: {
-							u->bUdp = true;
-							processMsg(u, buffer, len);
-							break;
-						}
-					case MessageHandler::UDPPing: {
-							QByteArray qba;
-							sendMessage(u, buffer, len, qba, true);
-						}
+			}
+
+			if (! usr) {
+				qrwlUsers.unlock();
+				continue;
+			}
+
+			// Reverify the user after relocking; it may have left in between,
+			// though the epoch keeps the object itself around.
+			unsigned int uiSession = usr->uiSession;
+			qrwlUsers.unlock();
+			qrwlUsers.lockForWrite();
+			if (qhUsers.contains(uiSession)) {
+				u = usr;
+				{
+					QMutexLocker qml(&u->qmCrypt);
+					u->sUdpSocket = sock;
+					memcpy(& u->saiUdpAddress, &from[j], sizeof(from[j]));
 				}
-#ifdef Q_OS_UNIX
-				fds[i].revents = 0;
-#endif
+				qhHostUsers[from[j]].remove(u);
+				clearUdpHint(u);
+				ptPeerUsers.insert(ha, port, u);
 			}
+			qrwlUsers.unlock();
+
+			if (! u)
+				continue;
+
+			QMutexLocker qml(&qmStatistics);
+			++qhStatistics[hinted ? QLatin1String("udp.associate.hint") : QLatin1String("udp.associate.trial")];
+		}
+		len -= u->csCrypt.overhead();
+
+		MessageHandler::UDPMessageType msgType = static_cast<MessageHandler::UDPMessageType>((buffer[0] >> 5) & 0x7);
+
+		switch (msgType) {
+			case MessageHandler::UDPVoiceSpeex:
+			case MessageHandler::UDPVoiceCELTAlpha:
+			case MessageHandler::UDPVoiceCELTBeta:
+				if (bOpus)
+					break;
+			case MessageHandler::UDPVoiceOpus: {
+					u->bUdp = true;
+					processMsg(u, buffer, len, pfanout);
+					break;
+				}
+			case MessageHandler::UDPPing:
+				sendMessage(u, buffer, len, true);
+				break;
 		}
 	}
-#ifdef Q_OS_WIN
-	for (int i=0;i<nfds-1;++i) {
-		::WSAEventSelect(fds[i], NULL, 0);
-		CloseHandle(events[i]);
-	}
+	veVoice.leave(worker);
+#ifdef Q_OS_LINUX
+	// Everything queued carries its own destination.
+	if (pfanout)
+		pfanout->flush();
 #endif
 }
 
+/// Index u by the first IV byte we expect on UDP, derived from the client
+/// nonce of its CryptSetup. Must be called with qrwlUsers locked for writing.
+void Server::setUdpHint(ServerUser *u) {
+	clearUdpHint(u);
+
+	if (! qhHostUsers.value(u->haAddress).contains(u))
+		return;
+
+	u->ucUdpHint = static_cast<unsigned char>(u->csCrypt.decrypt_iv[0] + 1);
+	u->bUdpHint = true;
+	qhHintUsers[QPair<HostAddress, unsigned char>(u->haAddress, u->ucUdpHint)].insert(u);
+}
+
+/// Must be called with qrwlUsers locked for writing.
+void Server::clearUdpHint(ServerUser *u) {
+	if (! u->bUdpHint)
+		return;
+
+	const QPair<HostAddress, unsigned char> key(u->haAddress, u->ucUdpHint);
+	QSet<ServerUser *> &users = qhHintUsers[key];
+	users.remove(u);
+	if (users.isEmpty())
+		qhHintUsers.remove(key);
+	u->bUdpHint = false;
+}
+
 bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsigned int len) {
-	if (u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt), reinterpret_cast<unsigned char *>(plain), len))
-		return true;
+	{
+		QMutexLocker qml(&u->qmCrypt);
+		if (u->csCrypt.isValid() && u->csCrypt.decrypt(reinterpret_cast<const unsigned char *>(encrypt), reinterpret_cast<unsigned char *>(plain), len))
+			return true;
+	}
 
 	if (u->csCrypt.tLastGood.elapsed() > 5000000ULL) {
 		if (u->csCrypt.tLastRequest.elapsed() > 5000000ULL) {
@@ -820,62 +1547,64 @@ bool Server::checkDecrypt(ServerUser *u, const char *encrypt, char *plain, unsig
 	return false;
 }
 
-void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force) {
+void Server::sendMessage(ServerUser *u, const char *data, int len, bool force, UdpFanout *fanout) {
 	if ((u->bUdp || force) && (u->sUdpSocket != INVALID_SOCKET) && u->csCrypt.isValid()) {
+#ifdef Q_OS_LINUX
+		if (fanout) {
+			char *buffer = fanout->reserve();
+			// The destination is written under qmCrypt, so it is copied along.
+			QMutexLocker qml(&u->qmCrypt);
+			u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer), len);
+			fanout->queue(u, len + u->csCrypt.overhead());
+			return;
+		}
+#endif
+		const unsigned int crypted_len = len + u->csCrypt.overhead();
 #if defined(__LP64__)
-		STACKVAR(char, ebuffer, len+4+16);
+		STACKVAR(char, ebuffer, crypted_len+16);
 		char *buffer = reinterpret_cast<char *>(((reinterpret_cast<quint64>(ebuffer) + 8) & ~7) + 4);
 #else
-		STACKVAR(char, buffer, len+4);
+		STACKVAR(char, buffer, crypted_len);
 #endif
-		u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer), len);
+		struct sockaddr_storage to;
+#ifdef Q_OS_UNIX
+		int sock;
+#else
+		SOCKET sock;
+#endif
+		{
+			QMutexLocker qml(&u->qmCrypt);
+			u->csCrypt.encrypt(reinterpret_cast<const unsigned char *>(data), reinterpret_cast<unsigned char *>(buffer), len);
+			memcpy(&to, &u->saiUdpAddress, sizeof(to));
+			sock = u->sUdpSocket;
+		}
 #ifdef Q_OS_WIN
 		DWORD dwFlow = 0;
 		if (Meta::hQoS)
-			QOSAddSocketToFlow(Meta::hQoS, u->sUdpSocket, reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress), QOSTrafficTypeVoice, QOS_NON_ADAPTIVE_FLOW, &dwFlow);
+			QOSAddSocketToFlow(Meta::hQoS, sock, reinterpret_cast<struct sockaddr *>(&to), QOSTrafficTypeVoice, QOS_NON_ADAPTIVE_FLOW, &dwFlow);
 #endif
 #ifdef Q_OS_LINUX
 		struct msghdr msg;
 		struct iovec iov[1];
 
 		iov[0].iov_base = buffer;
-		iov[0].iov_len = len+4;
+		iov[0].iov_len = crypted_len;
 
-		u_char controldata[CMSG_SPACE(MAX(sizeof(struct in6_pktinfo),sizeof(struct in_pktinfo)))];
-		memset(controldata, 0, sizeof(controldata));
+		u_char controldata[UDP_CONTROL_SIZE];
 
 		memset(&msg, 0, sizeof(msg));
-		msg.msg_name = reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress);
-		msg.msg_namelen = (u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		msg.msg_name = reinterpret_cast<struct sockaddr *>(&to);
+		msg.msg_namelen = (to.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 		msg.msg_iov = iov;
 		msg.msg_iovlen = 1;
 		msg.msg_control = controldata;
-		msg.msg_controllen = CMSG_SPACE((u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct in6_pktinfo) : sizeof(struct in_pktinfo));
-
-		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		HostAddress tcpha(u->saiTcpLocalAddress);
-		if (u->saiUdpAddress.ss_family == AF_INET6) {
-			cmsg->cmsg_level = IPPROTO_IPV6;
-			cmsg->cmsg_type = IPV6_PKTINFO;
-			cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-			struct in6_pktinfo *pktinfo = reinterpret_cast<struct in6_pktinfo *>(CMSG_DATA(cmsg));
-			memset(pktinfo, 0, sizeof(*pktinfo));
-			memcpy(&pktinfo->ipi6_addr.s6_addr[0], &tcpha.qip6.c[0], sizeof(pktinfo->ipi6_addr.s6_addr));
-		} else {
-			cmsg->cmsg_level = IPPROTO_IP;
-			cmsg->cmsg_type = IP_PKTINFO;
-			cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-			struct in_pktinfo *pktinfo = reinterpret_cast<struct in_pktinfo *>(CMSG_DATA(cmsg));
-			memset(pktinfo, 0, sizeof(*pktinfo));
-			if (tcpha.isV6())
-				return;
-			pktinfo->ipi_spec_dst.s_addr = tcpha.hash[3];
-		}
 
+		if (! setPktInfo(&msg, to, u->saiTcpLocalAddress))
+			return;
 
-		::sendmsg(u->sUdpSocket, &msg, 0);
+		::sendmsg(sock, &msg, 0);
 #else
-		::sendto(u->sUdpSocket, buffer, len+4, 0, reinterpret_cast<struct sockaddr *>(& u->saiUdpAddress), (u->saiUdpAddress.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+		::sendto(sock, buffer, crypted_len, 0, reinterpret_cast<struct sockaddr *>(&to), (to.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 #endif
 #ifdef Q_OS_WIN
 		if (Meta::hQoS && dwFlow)
@@ -883,28 +1612,22 @@ void Server::sendMessage(ServerUser *u, const char *data, int len, QByteArray &c
 #else
 #endif
 	} else {
-		if (cache.isEmpty())
-			cache = QByteArray(data, len);
-		emit tcpTransmit(cache,u->uiSession);
+		if (tvqTcp->push(u->uiSession, data, len)) {
+			if (tvqTcp->arm())
+				emit tcpVoiceReady();
+		} else {
+			QMutexLocker qml(&qmStatistics);
+			++qhStatistics[QLatin1String("voice.tcp.dropped")];
+		}
 	}
 }
 
-#define SENDTO \
-		if ((!pDst->bDeaf) && (!pDst->bSelfDeaf) && (pDst != u)) { \
-			if ((poslen > 0) && (pDst->ssContext == u->ssContext)) \
-				sendMessage(pDst, buffer, len, qba); \
-			else \
-				sendMessage(pDst, buffer, len - poslen, qba_npos); \
-		}
-
-void Server::processMsg(ServerUser *u, const char *data, int len) {
+void Server::processMsg(ServerUser *u, const char *data, int len, UdpFanout *fanout) {
 	if (u->sState != ServerUser::Authenticated || u->bMute || u->bSuppress || u->bSelfMute)
 		return;
 
-	User *p;
 	BandwidthRecord *bw = & u->bwr;
 	Channel *c = u->cChannel;
-	QByteArray qba, qba_npos;
 	unsigned int counter;
 	char buffer[UDP_PACKET_SIZE];
 	PacketDataStream pdi(data + 1, len - 1);
@@ -949,114 +1672,368 @@ void Server::processMsg(ServerUser *u, const char *data, int len) {
 
 	if (target == 0x1f) { // Server loopback
 		buffer[0] = static_cast<char>(type | 0);
-		sendMessage(u, buffer, len, qba);
+		sendMessage(u, buffer, len, false, fanout);
 		return;
 	} else if (target == 0) { // Normal speech
 		buffer[0] = static_cast<char>(type | 0);
-		foreach(p, c->qlUsers) {
-			ServerUser *pDst = static_cast<ServerUser *>(p);
-			SENDTO;
-		}
-
-		if (! c->qhLinks.isEmpty()) {
-			QSet<Channel *> chans = c->allLinks();
-			chans.remove(c);
-
-			QMutexLocker qml(&qmCache);
 
-			foreach(Channel *l, chans) {
-				if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
-					foreach(p, l->qlUsers) {
-						ServerUser *pDst = static_cast<ServerUser *>(p);
-						SENDTO;
-					}
-				}
+		QVector<VoiceRecipient> route;
+		bool valid;
+		{
+			QMutexLocker qml(&u->qmRoute);
+			valid = (u->cRouteChannel == c) && (u->uiRouteGeneration == uiRouteGeneration);
+			if (valid)
+				route = u->qvRoute;
+		}
+		if (! valid) {
+			lockUsersForVoice();
+			{
+				QMutexLocker qml(&u->qmRoute);
+				buildVoiceRoute(u);
+				route = u->qvRoute;
 			}
+			qrwlUsers.unlock();
 		}
-	} else if (u->qmTargets.contains(target)) { // Whisper
-		QSet<ServerUser *> channel;
-		QSet<ServerUser *> direct;
 
-		if (u->qmTargetCache.contains(target)) {
-			const ServerUser::TargetCache &cache = u->qmTargetCache.value(target);
-			channel = cache.first;
-			direct = cache.second;
-		} else {
-			const WhisperTarget &wt = u->qmTargets.value(target);
-			if (! wt.qlChannels.isEmpty()) {
-				QMutexLocker qml(&qmCache);
-
-				foreach(const WhisperTarget::Channel &wtc, wt.qlChannels) {
-					Channel *wc = qhChannels.value(wtc.iId);
-					if (wc) {
-						bool link = wtc.bLinks && ! wc->qhLinks.isEmpty();
-						bool dochildren = wtc.bChildren && ! wc->qlChannels.isEmpty();
-						bool group = ! wtc.qsGroup.isEmpty();
-						if (!link && !dochildren && ! group) {
-							// Common case
-							if (ChanACL::hasPermission(u, wc, ChanACL::Whisper, &acCache)) {
-								foreach(p, wc->qlUsers) {
-									channel.insert(static_cast<ServerUser *>(p));
-								}
-							}
-						} else {
-							QSet<Channel *> channels;
-							if (link)
-								channels = wc->allLinks();
-							else
-								channels.insert(wc);
-							if (dochildren)
-								channels.unite(wc->allChildren());
-							const QString &redirect = u->qmWhisperRedirect.value(wtc.qsGroup);
-							const QString &qsg = redirect.isEmpty() ? wtc.qsGroup : redirect;
-							foreach(Channel *tc, channels) {
-								if (ChanACL::hasPermission(u, tc, ChanACL::Whisper, &acCache)) {
-									foreach(p, tc->qlUsers) {
-										ServerUser *su = static_cast<ServerUser *>(p);
-										if (! group || Group::isMember(tc, tc, qsg, su)) {
-											channel.insert(su);
-										}
-									}
-								}
-							}
-						}
-					}
+		const VoiceRecipient *vr = route.constData();
+		const int count = route.count();
+
+		if (! qlFanoutWorkers.isEmpty() && (count >= iFanoutThreshold)) {
+			// Each recipient is in exactly one slice, and we wait for every
+			// slice before the next frame, so a listener's packets are still
+			// encrypted one frame after the other.
+			const int nslices = qlFanoutWorkers.count() + 1;
+			const int per = (count + nslices - 1) / nslices;
+			QVarLengthArray<FanoutSlice, 16> slices(nslices);
+			int pending = 0;
+			{
+				QMutexLocker qml(&qmFanout);
+				for (int i=1;i<nslices;++i) {
+					if (i * per >= count)
+						break;
+					FanoutSlice &fs = slices[i];
+					fs.vr = vr + i * per;
+					fs.end = vr + qMin(count, (i + 1) * per);
+					fs.buffer = buffer;
+					fs.len = len;
+					fs.poslen = poslen;
+					fs.piPending = &pending;
+					qqFanoutSlices.enqueue(&fs);
+					++pending;
 				}
+				qwcFanoutWork.wakeAll();
 			}
 
-			foreach(unsigned int id, wt.qlSessions) {
-				ServerUser *pDst = qhUsers.value(id);
-				if (pDst && ChanACL::hasPermission(u, pDst->cChannel, ChanACL::Whisper, &acCache) && ! channel.contains(pDst))
-					direct.insert(pDst);
-			}
+			sendVoiceRoute(vr, vr + per, buffer, len, poslen, fanout);
 
-			int uiSession = u->uiSession;
-			qrwlUsers.unlock();
-			qrwlUsers.lockForWrite();
+			{
+				QMutexLocker qml(&qmFanout);
+				while (pending > 0)
+					qwcFanoutDone.wait(&qmFanout);
+			}
 
-			if (qhUsers.contains(uiSession))
-				u->qmTargetCache.insert(target, ServerUser::TargetCache(channel, direct));
-			qrwlUsers.unlock();
-			qrwlUsers.lockForRead();
-			if (! qhUsers.contains(uiSession))
-				return;
+			QMutexLocker qml(&qmStatistics);
+			++qhStatistics[QLatin1String("voice.fanout.parallel")];
+		} else {
+			sendVoiceRoute(vr, vr + count, buffer, len, poslen, fanout);
 		}
-		if (! channel.isEmpty()) {
+	} else { // Whisper
+		ServerUser::TargetCache cache;
+		{
+			QMutexLocker qml(&u->qmRoute);
+			cache = u->qmTargetCache.value(target);
+		}
+
+		if (! cache.qvChannel.isEmpty()) {
 			buffer[0] = static_cast<char>(type | 1);
-			foreach(ServerUser *pDst, channel) {
-				SENDTO;
+			sendVoiceRoute(cache.qvChannel.constData(), cache.qvChannel.constData() + cache.qvChannel.count(), buffer, len, poslen, fanout);
+		}
+		if (! cache.qvDirect.isEmpty()) {
+			buffer[0] = static_cast<char>(type | 2);
+			sendVoiceRoute(cache.qvDirect.constData(), cache.qvDirect.constData() + cache.qvDirect.count(), buffer, len, poslen, fanout);
+		}
+	}
+}
+
+/// Encrypt and send one voice frame to the recipients [vr, end).
+void Server::sendVoiceRoute(const VoiceRecipient *vr, const VoiceRecipient *end, const char *buffer, int len, unsigned int poslen, UdpFanout *fanout) {
+	for (; vr != end; ++vr) {
+		if ((poslen > 0) && vr->bPositional)
+			sendMessage(vr->pDst, buffer, len, false, fanout);
+		else
+			sendMessage(vr->pDst, buffer, len - poslen, false, fanout);
+	}
+}
+
+void Server::fanoutLoop() {
+#ifdef Q_OS_LINUX
+	UdpFanout fanout(this);
+	UdpFanout *pfanout = (qBound(1, iUdpBatchSize, UDP_MAX_BATCH) > 1) ? &fanout : NULL;
+#else
+	UdpFanout *pfanout = NULL;
+#endif
+
+	QMutexLocker qml(&qmFanout);
+	forever {
+		while (qqFanoutSlices.isEmpty() && ! bFanoutStop)
+			qwcFanoutWork.wait(&qmFanout);
+		if (qqFanoutSlices.isEmpty())
+			break;
+
+		FanoutSlice *fs = qqFanoutSlices.dequeue();
+		qml.unlock();
+
+		sendVoiceRoute(fs->vr, fs->end, fs->buffer, fs->len, fs->poslen, pfanout);
+#ifdef Q_OS_LINUX
+		if (pfanout)
+			pfanout->flush();
+#endif
+
+		qml.relock();
+		if (--(*fs->piPending) == 0)
+			qwcFanoutDone.wakeAll();
+	}
+}
+
+QHash<QString, qint64> Server::getStatistics() {
+	QMutexLocker qml(&qmStatistics);
+	QHash<QString, qint64> stats = qhStatistics;
+
+	quint64 total = 0;
+	for (int i=0;i<VOICE_LOCKWAIT_BUCKETS;++i)
+		total += uiLockWait[i];
+	stats.insert(QLatin1String("control.messages"), static_cast<qint64>(uiControlMessages));
+	stats.insert(QLatin1String("alloc.count"), static_cast<qint64>(allocationCount()));
+	stats.insert(QLatin1String("handshake.pending"), qhHandshakeAddress.count());
+	stats.insert(QLatin1String("hibernate.active"), bHibernating ? 1 : 0);
+	stats.insert(QLatin1String("voice.lockwait.count"), static_cast<qint64>(total));
+
+	// Upper bound of the bucket holding the 99th percentile.
+	if (total) {
+		quint64 seen = 0;
+		int bucket = 0;
+		for (;bucket<VOICE_LOCKWAIT_BUCKETS - 1;++bucket) {
+			seen += uiLockWait[bucket];
+			if (seen * 100 >= total * 99)
+				break;
+		}
+		stats.insert(QLatin1String("voice.lockwait.p99_us"), static_cast<qint64>(1) << bucket);
+	}
+
+#ifdef USE_TLS_RESUMPTION
+	const qint64 handshakes = stats.value(QLatin1String("tls.handshakes"));
+	if (handshakes)
+		stats.insert(QLatin1String("tls.resumption.percent"), stats.value(QLatin1String("tls.resumed")) * 100 / handshakes);
+	// Keys are shared by all virtual servers, so this one is process wide.
+	stats.insert(QLatin1String("tls.ticketkeys.rotations"), static_cast<qint64>(TlsSessionCache::instance()->rotations()));
+#endif
+	return stats;
+}
+
+static inline void addVoiceRecipient(QVector<VoiceRecipient> &route, const ServerUser *u, ServerUser *pDst) {
+	if (pDst->bDeaf || pDst->bSelfDeaf || (pDst == u))
+		return;
+
+	VoiceRecipient vr;
+	vr.pDst = pDst;
+	vr.bPositional = (pDst->ssContext == u->ssContext);
+	route.append(vr);
+}
+
+/// Recompute the normal speech recipients of u: everyone in its channel, plus
+/// everyone in linked channels u may speak in. Must be called with qrwlUsers
+/// locked for reading and u->qmRoute held.
+void Server::buildVoiceRoute(ServerUser *u) {
+	Channel *c = u->cChannel;
+
+	u->qvRoute.clear();
+	u->cRouteChannel = c;
+	u->uiRouteGeneration = uiRouteGeneration;
+
+	foreach(User *p, c->qlUsers)
+		addVoiceRecipient(u->qvRoute, u, static_cast<ServerUser *>(p));
+
+	if (! c->qhLinks.isEmpty()) {
+		QMutexLocker qml(&qmCache);
+
+		foreach(Channel *l, c->qvAllLinks) {
+			if (l == c)
+				continue;
+			if (ChanACL::hasPermission(u, l, ChanACL::Speak, &acCache)) {
+				foreach(User *p, l->qlUsers)
+					addVoiceRecipient(u->qvRoute, u, static_cast<ServerUser *>(p));
 			}
-			if (! direct.isEmpty()) {
-				qba.clear();
-				qba_npos.clear();
+		}
+	}
+
+	QMutexLocker qml(&qmStatistics);
+	++qhStatistics[QLatin1String("voice.route.rebuilds")];
+}
+
+/// Resolve whisper target "target" of u into its recipients, index it by
+/// what it reached and publish it to the voice threads. Control thread only.
+/// The route is dropped if u is gone or no longer has such a target.
+void Server::buildWhisperRoute(ServerUser *u, int target) {
+	User *p;
+	QSet<ServerUser *> channel;
+	QSet<ServerUser *> direct;
+
+	ServerUser::TargetSource old = u->qmTargetSources.take(target);
+	foreach(Channel *c, old.qsChannels) {
+		bool still = false;
+		foreach(const ServerUser::TargetSource &ts, u->qmTargetSources)
+			still = still || ts.qsChannels.contains(c);
+		if (! still) {
+			QHash<Channel *, QSet<ServerUser *> >::iterator i = qhWhisperChannels.find(c);
+			if (i != qhWhisperChannels.end()) {
+				i.value().remove(u);
+				if (i.value().isEmpty())
+					qhWhisperChannels.erase(i);
 			}
 		}
-		if (! direct.isEmpty()) {
-			buffer[0] = static_cast<char>(type | 2);
-			foreach(ServerUser *pDst, direct) {
-				SENDTO;
+	}
+	foreach(unsigned int id, old.qlSessions) {
+		bool still = false;
+		foreach(const ServerUser::TargetSource &ts, u->qmTargetSources)
+			still = still || ts.qlSessions.contains(id);
+		if (! still) {
+			QHash<unsigned int, QSet<ServerUser *> >::iterator i = qhWhisperSessions.find(id);
+			if (i != qhWhisperSessions.end()) {
+				i.value().remove(u);
+				if (i.value().isEmpty())
+					qhWhisperSessions.erase(i);
+			}
+		}
+	}
+
+	if ((qhUsers.value(u->uiSession) != u) || ! u->qmTargets.contains(target)) {
+		QMutexLocker qml(&u->qmRoute);
+		u->qmTargetCache.remove(target);
+		return;
+	}
+
+	ServerUser::TargetSource ts;
+	const WhisperTarget &wt = u->qmTargets.value(target);
+	{
+		// Voice threads fill acCache too.
+		QMutexLocker qml(&qmCache);
+
+		foreach(const WhisperTarget::Channel &wtc, wt.qlChannels) {
+			Channel *wc = qhChannels.value(wtc.iId);
+			if (wc) {
+				bool link = wtc.bLinks && ! wc->qhLinks.isEmpty();
+				bool dochildren = wtc.bChildren && ! wc->qlChannels.isEmpty();
+				bool group = ! wtc.qsGroup.isEmpty();
+				if (!link && !dochildren && ! group) {
+					// Common case
+					ts.qsChannels.insert(wc);
+					if (ChanACL::hasPermission(u, wc, ChanACL::Whisper, &acCache)) {
+						foreach(p, wc->qlUsers) {
+							channel.insert(static_cast<ServerUser *>(p));
+						}
+					}
+				} else {
+					QSet<Channel *> channels;
+					if (link)
+						channels = wc->allLinks();
+					else
+						channels.insert(wc);
+					if (dochildren)
+						channels.unite(wc->allChildren());
+					ts.qsChannels.unite(channels);
+					const QString &redirect = u->qmWhisperRedirect.value(wtc.qsGroup);
+					const QString &qsg = redirect.isEmpty() ? wtc.qsGroup : redirect;
+					foreach(Channel *tc, channels) {
+						if (ChanACL::hasPermission(u, tc, ChanACL::Whisper, &acCache)) {
+							foreach(p, tc->qlUsers) {
+								ServerUser *su = static_cast<ServerUser *>(p);
+								if (! group || Group::isMember(tc, tc, qsg, su)) {
+									channel.insert(su);
+								}
+							}
+						}
+					}
+				}
 			}
 		}
+
+		ts.qlSessions = wt.qlSessions;
+		foreach(unsigned int id, wt.qlSessions) {
+			ServerUser *pDst = qhUsers.value(id);
+			if (pDst && ChanACL::hasPermission(u, pDst->cChannel, ChanACL::Whisper, &acCache) && ! channel.contains(pDst))
+				direct.insert(pDst);
+		}
+	}
+
+	foreach(Channel *c, ts.qsChannels)
+		qhWhisperChannels[c].insert(u);
+	foreach(unsigned int id, ts.qlSessions)
+		qhWhisperSessions[id].insert(u);
+	u->qmTargetSources.insert(target, ts);
+
+	ServerUser::TargetCache cache;
+	foreach(ServerUser *pDst, channel)
+		addVoiceRecipient(cache.qvChannel, u, pDst);
+	foreach(ServerUser *pDst, direct)
+		addVoiceRecipient(cache.qvDirect, u, pDst);
+
+	{
+		QMutexLocker qml(&u->qmRoute);
+		u->qmTargetCache.insert(target, cache);
+	}
+
+	QMutexLocker qml(&qmStatistics);
+	++qhStatistics[QLatin1String("voice.whisper.rebuilds")];
+}
+
+/// Forget the whisper routes of a user that is going away.
+void Server::dropWhisperRoutes(ServerUser *u) {
+	u->qmTargets.clear();
+	foreach(int target, u->qmTargetSources.keys())
+		buildWhisperRoute(u, target);
+}
+
+void Server::rebuildWhisperRoutes() {
+	foreach(ServerUser *u, qhUsers)
+		rebuildWhisperRoutes(u);
+}
+
+/// Rebuild all whisper routes of u, e.g. after its permissions changed.
+void Server::rebuildWhisperRoutes(ServerUser *u) {
+	QSet<int> targets = u->qmTargetSources.keys().toSet();
+	targets.unite(u->qmTargets.keys().toSet());
+	foreach(int target, targets)
+		buildWhisperRoute(u, target);
+}
+
+/// Rebuild the whisper routes that reach c, after its users, or what they
+/// may hear there, changed.
+void Server::rebuildWhisperRoutes(Channel *c) {
+	foreach(ServerUser *u, qhWhisperChannels.value(c)) {
+		QMap<int, ServerUser::TargetSource>::const_iterator i;
+		QList<int> targets;
+		for (i = u->qmTargetSources.constBegin(); i != u->qmTargetSources.constEnd(); ++i)
+			if (i.value().qsChannels.contains(c))
+				targets << i.key();
+		foreach(int target, targets)
+			buildWhisperRoute(u, target);
+	}
+}
+
+/// Rebuild the whisper routes that may contain p, after p moved, left or
+/// changed how it receives voice.
+void Server::rebuildWhisperRoutesTo(ServerUser *p) {
+	if (p->cChannel)
+		rebuildWhisperRoutes(p->cChannel);
+
+	foreach(ServerUser *u, qhWhisperSessions.value(p->uiSession)) {
+		QMap<int, ServerUser::TargetSource>::const_iterator i;
+		QList<int> targets;
+		for (i = u->qmTargetSources.constBegin(); i != u->qmTargetSources.constEnd(); ++i)
+			if (i.value().qlSessions.contains(p->uiSession))
+				targets << i.key();
+		foreach(int target, targets)
+			buildWhisperRoute(u, target);
 	}
 }
 
@@ -1112,52 +2089,109 @@ void Server::newClient() {
 			}
 		}
 
+		if ((iHandshakesPerIp > 0) && (qhHandshakes.value(ha) >= iHandshakesPerIp)) {
+			// Not logged, a flood would turn into a log write per connection.
+			{
+				QMutexLocker qml(&qmStatistics);
+				++qhStatistics[QLatin1String("handshake.rejected")];
+			}
+			sock->abort();
+			sock->deleteLater();
+			continue;
+		}
+
+		// Channels are needed once the handshake is done.
+		wake();
+
 		sock->setPrivateKey(qskKey);
 		sock->setLocalCertificate(qscCert);
 		sock->addCaCertificate(qscCert);
 		sock->addCaCertificates(qlCA);
 
-		if (qqIds.isEmpty()) {
-			log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
-			sock->disconnectFromHost();
-			sock->deleteLater();
-			return;
-		}
+		++qhHandshakes[ha];
+		qhHandshakeAddress.insert(sock, ha);
 
-		ServerUser *u = new ServerUser(this, sock);
-		u->uiSession = qqIds.dequeue();
-		u->haAddress = ha;
-		HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
+		sock->setParent(NULL);
+		qlHandshakeWorkers.at(iNextHandshakeWorker)->start(sock);
+		iNextHandshakeWorker = (iNextHandshakeWorker + 1) % qlHandshakeWorkers.count();
+	}
+}
 
-		{
-			QWriteLocker wl(&qrwlUsers);
-			qhUsers.insert(u->uiSession, u);
-			qhHostUsers[ha].insert(u);
-		}
+void Server::handshakeDone(QSslSocket *sock, bool ok, bool verified, const QString &reason) {
+	const HostAddress ha = qhHandshakeAddress.take(sock);
+	if (--qhHandshakes[ha] <= 0)
+		qhHandshakes.remove(ha);
 
-		connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
-		connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
-		connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
-		connect(u, SIGNAL(encrypted()), this, SLOT(encrypted()));
+	QString why = reason;
+	if (ok && (sock->state() != QAbstractSocket::ConnectedState)) {
+		ok = false;
+		why = sock->errorString();
+	}
 
-		log(u, QString("New connection: %1").arg(addressToString(sock->peerAddress(), sock->peerPort())));
+	{
+		QMutexLocker qml(&qmStatistics);
+		++qhStatistics[ok ? QLatin1String("handshake.completed") : QLatin1String("handshake.failed")];
+	}
 
-		u->setToS();
+	if (! ok) {
+		log(QString("Handshake with %1 failed: %2").arg(ha.toString(), why));
+		sock->deleteLater();
+		if (qhUsers.isEmpty())
+			scheduleHibernate();
+		return;
+	}
 
-#if QT_VERSION >= QT_VERSION_CHECK(5, 0, 0)
-		sock->setProtocol(QSsl::TlsV1_0);
-#else
-		sock->setProtocol(QSsl::TlsV1);
-#endif
-		sock->startServerEncryption();
+	if (qqIds.isEmpty()) {
+		log(QString("Session ID pool (%1) empty, rejecting connection").arg(iMaxUsers));
+		sock->disconnectFromHost();
+		sock->deleteLater();
+		if (qhUsers.isEmpty())
+			scheduleHibernate();
+		return;
 	}
+
+	ServerUser *u = new ServerUser(this, sock);
+	u->uiSession = qqIds.dequeue();
+	u->haAddress = ha;
+	u->bVerified = verified;
+	HostAddress(sock->localAddress()).toSockaddr(& u->saiTcpLocalAddress);
+
+	{
+		QWriteLocker wl(&qrwlUsers);
+		qhUsers.insert(u->uiSession, u);
+		qhHostUsers[ha].insert(u);
+	}
+
+	connect(u, SIGNAL(connectionClosed(QAbstractSocket::SocketError, const QString &)), this, SLOT(connectionClosed(QAbstractSocket::SocketError, const QString &)));
+	connect(u, SIGNAL(message(unsigned int, const QByteArray &)), this, SLOT(message(unsigned int, const QByteArray &)));
+	connect(u, SIGNAL(handleSslErrors(const QList<QSslError> &)), this, SLOT(sslError(const QList<QSslError> &)));
+
+	log(u, QString("New connection: %1").arg(addressToString(sock->peerAddress(), sock->peerPort())));
+
+	u->setToS();
+	u->setCoalesce(iTlsCoalesce);
+
+	encrypted(u);
+
+	// Whatever the client sent right after the handshake was announced
+	// on the handshake thread, where nobody listened.
+	if (sock->bytesAvailable())
+		QMetaObject::invokeMethod(u, "socketRead", Qt::QueuedConnection);
 }
 
-void Server::encrypted() {
-	ServerUser *uSource = qobject_cast<ServerUser *>(sender());
+void Server::encrypted(ServerUser *uSource) {
 	int major, minor, patch;
 	QString release;
 
+#ifdef USE_TLS_RESUMPTION
+	{
+		QMutexLocker qml(&qmStatistics);
+		++qhStatistics[QLatin1String("tls.handshakes")];
+		if (uSource->isTlsResumed())
+			++qhStatistics[QLatin1String("tls.resumed")];
+	}
+#endif
+
 	Meta::getVersion(major, minor, patch, release);
 
 	MumbleProto::Version mpv;
@@ -1208,12 +2242,11 @@ void Server::encrypted() {
 	}
 }
 
-void Server::sslError(const QList<QSslError> &errors) {
-	ServerUser *u = qobject_cast<ServerUser *>(sender());
-	if (!u)
-		return;
-
-	bool ok = true;
+/// Sort out the certificate errors a client may get away with. Those that
+/// only leave its certificate untrusted clear verified; the descriptions
+/// of any others, which fail the connection, are returned.
+QStringList Server::fatalSslErrors(const QList<QSslError> &errors, bool &verified) {
+	QStringList fatal;
 	foreach(QSslError e, errors) {
 		switch (e.error()) {
 			case QSslError::InvalidPurpose:
@@ -1226,15 +2259,25 @@ void Server::sslError(const QList<QSslError> &errors) {
 			case QSslError::HostNameMismatch:
 			case QSslError::CertificateNotYetValid:
 			case QSslError::CertificateExpired:
-				u->bVerified = false;
+				verified = false;
 				break;
 			default:
-				log(u, QString("SSL Error: %1").arg(e.errorString()));
-				ok = false;
+				fatal << e.errorString();
 		}
 	}
+	return fatal;
+}
+
+void Server::sslError(const QList<QSslError> &errors) {
+	ServerUser *u = qobject_cast<ServerUser *>(sender());
+	if (!u)
+		return;
+
+	const QStringList fatal = fatalSslErrors(errors, u->bVerified);
+	foreach(const QString &error, fatal)
+		log(u, QString("SSL Error: %1").arg(error));
 
-	if (ok)
+	if (fatal.isEmpty())
 		u->proceedAnyway();
 	else
 		u->disconnectSocket(true);
@@ -1257,6 +2300,7 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		mpur.set_session(u->uiSession);
 		sendExcept(u, mpur);
 
+		ServerScope ss(this);
 		emit userDisconnected(u);
 	}
 
@@ -1267,13 +2311,20 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 
 		qhUsers.remove(u->uiSession);
 		qhHostUsers[u->haAddress].remove(u);
+		clearUdpHint(u);
 
 		quint16 port = (u->saiUdpAddress.ss_family == AF_INET6) ? (reinterpret_cast<sockaddr_in6 *>(&u->saiUdpAddress)->sin6_port) : (reinterpret_cast<sockaddr_in *>(&u->saiUdpAddress)->sin_port);
-		const QPair<HostAddress, quint16> &key = QPair<HostAddress, quint16>(u->haAddress, port);
-		qhPeerUsers.remove(key);
+		ptPeerUsers.remove(u->haAddress, port);
 
 		if (old)
 			old->removeUser(u);
+
+		++uiRouteGeneration;
+
+		dropWhisperRoutes(u);
+		rebuildWhisperRoutesTo(u);
+		if (old)
+			rebuildWhisperRoutes(old);
 	}
 
 	if (old && old->bTemporary && old->qlUsers.isEmpty())
@@ -1287,12 +2338,56 @@ void Server::connectionClosed(QAbstractSocket::SocketError err, const QString &r
 		recheckCodecVersions(); // Maybe can choose a better codec now
 	}
 
-	u->deleteLater();
+	retireUser(u);
 
 	if (qhUsers.isEmpty())
 		stopThread();
 }
 
+/// Queue u for deletion once no voice thread can still be using it.
+/// u must already be unreachable from qhUsers, ptPeerUsers and, through a
+/// bump of uiRouteGeneration and rebuilt whisper routes, from every route.
+void Server::retireUser(ServerUser *u) {
+	qlRetiredUsers.append(QPair<quint32, ServerUser *>(veVoice.retire(), u));
+	reclaimUsers();
+}
+
+void Server::reclaimUsers() {
+	int reclaimed = 0;
+	while (! qlRetiredUsers.isEmpty()) {
+		if (bRunning && ! veVoice.isQuiescent(qlRetiredUsers.first().first))
+			break;
+		qlRetiredUsers.takeFirst().second->deleteLater();
+		++reclaimed;
+	}
+
+	{
+		QMutexLocker qml(&qmStatistics);
+		qhStatistics[QLatin1String("voice.epoch.reclaimed")] += reclaimed;
+		qhStatistics[QLatin1String("voice.epoch.pending")] = qlRetiredUsers.count();
+	}
+
+	// Voice threads leave their epoch after every batch, so this is short.
+	if (! qlRetiredUsers.isEmpty() && ! qtReclaim->isActive())
+		qtReclaim->start(20);
+}
+
+/// Take qrwlUsers for reading from a voice thread, recording how long it took.
+/// The caller unlocks.
+void Server::lockUsersForVoice() {
+	Timer t;
+	qrwlUsers.lockForRead();
+	const quint64 usec = t.elapsed();
+
+	// Bucket n holds waits of at most 2^n microseconds.
+	int bucket = 0;
+	while ((bucket < VOICE_LOCKWAIT_BUCKETS - 1) && ((static_cast<quint64>(1) << bucket) < usec))
+		++bucket;
+
+	QMutexLocker qml(&qmStatistics);
+	++uiLockWait[bucket];
+}
+
 void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *u) {
 	if (u == NULL) {
 		u = static_cast<ServerUser *>(sender());
@@ -1307,8 +2402,6 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 		if (l < 2)
 			return;
 
-		QReadLocker rl(&qrwlUsers);
-
 		u->bUdp = false;
 
 		const char *buffer = qbaMsg.constData();
@@ -1331,26 +2424,33 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 		return;
 	}
 
+	{
+		QMutexLocker qml(&qmStatistics);
+		++uiControlMessages;
+	}
+
 #ifdef QT_NO_DEBUG
 #define MUMBLE_MH_MSG(x) case MessageHandler:: x : { \
-		MumbleProto:: x msg; \
-		if (msg.ParseFromArray(qbaMsg.constData(), qbaMsg.size())) { \
-			msg.DiscardUnknownFields(); \
-			msg##x(u, msg); \
+		MumbleProto:: x *msg = takeMessage<MumbleProto:: x>(uiType); \
+		if (msg->ParseFromArray(qbaMsg.constData(), qbaMsg.size())) { \
+			msg->DiscardUnknownFields(); \
+			msg##x(u, *msg); \
 		} \
+		releaseMessage(uiType, msg, qbaMsg.size()); \
 		break; \
 	}
 #else
 #define MUMBLE_MH_MSG(x) case MessageHandler:: x : { \
-		MumbleProto:: x msg; \
-		if (msg.ParseFromArray(qbaMsg.constData(), qbaMsg.size())) { \
+		MumbleProto:: x *msg = takeMessage<MumbleProto:: x>(uiType); \
+		if (msg->ParseFromArray(qbaMsg.constData(), qbaMsg.size())) { \
 			if (uiType != MessageHandler::Ping) { \
 				printf("== %s:\n", #x); \
-				msg.PrintDebugString(); \
+				msg->PrintDebugString(); \
 			} \
-			msg.DiscardUnknownFields(); \
-			msg##x(u, msg); \
+			msg->DiscardUnknownFields(); \
+			msg##x(u, *msg); \
 		} \
+		releaseMessage(uiType, msg, qbaMsg.size()); \
 		break; \
 	}
 #endif
@@ -1360,6 +2460,19 @@ void Server::message(unsigned int uiType, const QByteArray &qbaMsg, ServerUser *
 	}
 }
 
+/// Return a message taken with takeMessage() to the pool. Messages that held
+/// something large are freed instead, so a texture doesn't stay allocated,
+/// and a handful per type covers handlers that end up in message() again.
+void Server::releaseMessage(unsigned int type, ::google::protobuf::Message *msg, int size) {
+	QList< ::google::protobuf::Message *> &l = qhMessagePool[type];
+	if ((size > 65536) || (l.count() >= 4)) {
+		delete msg;
+		return;
+	}
+	msg->Clear();
+	l.append(msg);
+}
+
 void Server::checkTimeout() {
 	QList<ServerUser *> qlClose;
 
@@ -1375,21 +2488,33 @@ void Server::checkTimeout() {
 		u->disconnectSocket(true);
 }
 
-void Server::tcpTransmitData(QByteArray a, unsigned int id) {
-	Connection *c = qhUsers.value(id);
-	if (c) {
-		QByteArray qba;
-		int len = a.size();
+/// Write queued TCP voice to its recipients, flushing each socket once.
+void Server::tcpDrain() {
+	tvqTcp->disarm();
+
+	QSet<ServerUser *> qsFlush;
+	int packets = 0;
+	TcpVoiceQueue::Slot *slot;
+	while ((packets < TCP_VOICE_DRAIN) && (slot = tvqTcp->front())) {
+		ServerUser *u = qhUsers.value(slot->uiSession);
+		if (u) {
+			u->sendMessage(slot->data(), slot->iLength);
+			qsFlush.insert(u);
+		}
+		tvqTcp->pop();
+		++packets;
+	}
+
+	foreach(ServerUser *u, qsFlush)
+		u->forceFlush();
 
-		qba.resize(len + 6);
-		unsigned char *uc = reinterpret_cast<unsigned char *>(qba.data());
-		* reinterpret_cast<quint16 *>(& uc[0]) = qToBigEndian(static_cast<quint16>(MessageHandler::UDPTunnel));
-		* reinterpret_cast<quint32 *>(& uc[2]) = qToBigEndian(static_cast<quint32>(len));
-		memcpy(uc + 6, a.constData(), len);
+	// Leave the rest for another round, so connections still get serviced.
+	if (tvqTcp->front() && tvqTcp->arm())
+		emit tcpVoiceReady();
 
-		c->sendMessage(qba);
-		c->forceFlush();
-	}
+	QMutexLocker qml(&qmStatistics);
+	++qhStatistics[QLatin1String("voice.tcp.drains")];
+	qhStatistics[QLatin1String("voice.tcp.packets")] += packets;
 }
 
 void Server::doSync(unsigned int id) {
@@ -1411,6 +2536,8 @@ void Server::sendProtoAll(const ::google::protobuf::Message &msg, unsigned int m
 }
 
 void Server::sendProtoExcept(ServerUser *u, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int version) {
+	updateJoinState(msg, msgType);
+
 	QByteArray cache;
 	foreach(ServerUser *usr, qhUsers)
 		if ((usr != u) && (usr->sState == ServerUser::Authenticated))
@@ -1418,6 +2545,54 @@ void Server::sendProtoExcept(ServerUser *u, const ::google::protobuf::Message &m
 				usr->sendMessage(msg, msgType, cache);
 }
 
+/// Every change to channels or users is broadcast, so the broadcasts tell
+/// which blocks of the cached join state are out of date.
+void Server::updateJoinState(const ::google::protobuf::Message &msg, unsigned int msgType) {
+	switch (msgType) {
+		case MessageHandler::ChannelState: {
+				const MumbleProto::ChannelState &mpcs = static_cast<const MumbleProto::ChannelState &>(msg);
+				const unsigned int id = mpcs.channel_id();
+				for (int i=0;i<2;++i) {
+					// A channel that moves may end up ahead of its new
+					// parent, and drags its subchannels along.
+					if (mpcs.has_parent() && jiChannels[i].contains(id))
+						jiChannels[i].clear();
+					else
+						jiChannels[i].invalidate(id);
+				}
+				if ((mpcs.links_size() > 0) || (mpcs.links_add_size() > 0) || (mpcs.links_remove_size() > 0))
+					qbaJoinLinks = QByteArray();
+			}
+			break;
+		case MessageHandler::ChannelRemove: {
+				const unsigned int id = static_cast<const MumbleProto::ChannelRemove &>(msg).channel_id();
+				for (int i=0;i<2;++i)
+					jiChannels[i].invalidate(id);
+				qbaJoinLinks = QByteArray();
+			}
+			break;
+		case MessageHandler::UserState:
+		case MessageHandler::UserRemove: {
+				unsigned int session;
+				if (msgType == MessageHandler::UserState)
+					session = static_cast<const MumbleProto::UserState &>(msg).session();
+				else
+					session = static_cast<const MumbleProto::UserRemove &>(msg).session();
+				for (int i=0;i<3;++i)
+					jiUsers[i].invalidate(session);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void Server::clearJoinChannels() {
+	jiChannels[0].clear();
+	jiChannels[1].clear();
+	qbaJoinLinks = QByteArray();
+}
+
 void Server::removeChannel(int id) {
 	Channel *c = qhChannels.value(id);
 	if (c)
@@ -1431,7 +2606,11 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 	if (dest == NULL)
 		dest = chan->cParent;
 
-	chan->unlink(NULL);
+	{
+		QWriteLocker wl(&qrwlUsers);
+		chan->unlink(NULL);
+		++uiRouteGeneration;
+	}
 
 	foreach(c, chan->qlChannels) {
 		removeChannel(c, dest);
@@ -1449,6 +2628,7 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 		mpus.set_channel_id(target->iId);
 		userEnterChannel(p, target, mpus);
 		sendAll(mpus);
+		ServerScope ss(this);
 		emit userStateChanged(p);
 	}
 
@@ -1457,6 +2637,7 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 	sendAll(mpcr);
 
 	removeChannelDB(chan);
+	ServerScope ss(this);
 	emit channelRemoved(chan);
 
 	if (chan->cParent) {
@@ -1464,13 +2645,22 @@ void Server::removeChannel(Channel *chan, Channel *dest) {
 		chan->cParent->removeChannel(chan);
 	}
 
+	// Whisper routes that reached it did so as a child or link.
+	QSet<ServerUser *> speakers = qhWhisperChannels.take(chan);
+
 	delete chan;
+
+	foreach(ServerUser *u, speakers)
+		rebuildWhisperRoutes(u);
 }
 
 bool Server::unregisterUser(int id) {
 	if (! unregisterUserDB(id))
 		return false;
 
+	// The id is handed out again, so the compiled ACLs must not keep it.
+	QList<Channel *> stale;
+
 	{
 		QMutexLocker lock(&qmCache);
 
@@ -1484,9 +2674,13 @@ bool Server::unregisterUser(int id) {
 					write = true;
 				}
 			}
+			if (write)
+				stale << c;
 			foreach(Group *g, c->qhGroups) {
 				bool addrem = g->qsAdd.remove(id);
 				bool remrem = g->qsRemove.remove(id);
+				if (addrem || remrem)
+					g->updateIndex(id);
 				write = write || addrem || remrem;
 			}
 			if (write)
@@ -1494,6 +2688,9 @@ bool Server::unregisterUser(int id) {
 		}
 	}
 
+	foreach(Channel *c, stale)
+		clearACLCache(c);
+
 	foreach(ServerUser *u, qhUsers) {
 		if (u->iId == id) {
 			clearACLCache(u);
@@ -1518,8 +2715,13 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 	{
 		QWriteLocker wl(&qrwlUsers);
 		c->addUser(p);
+		++uiRouteGeneration;
 
-		bool mayspeak = ChanACL::hasPermission(static_cast<ServerUser *>(p), c, ChanACL::Speak, NULL);
+		bool mayspeak;
+		{
+			QMutexLocker qml(&qmCache);
+			mayspeak = ChanACL::hasPermission(static_cast<ServerUser *>(p), c, ChanACL::Speak, NULL);
+		}
 		bool sup = p->bSuppress;
 
 		if (mayspeak == sup) {
@@ -1530,6 +2732,8 @@ void Server::userEnterChannel(User *p, Channel *c, MumbleProto::UserState &mpus)
 	}
 
 	clearACLCache(p);
+	if (old)
+		rebuildWhisperRoutes(old);
 	setLastChannel(p);
 
 	if (old && old->bTemporary && old->qlUsers.isEmpty()) {
@@ -1639,6 +2843,13 @@ void Server::clearACLCache(User *p) {
 				delete h;
 			acCache.clear();
 
+			foreach(Channel *c, qhChannels) {
+				delete c->acChain;
+				c->acChain = NULL;
+				qDeleteAll(c->qhGroupIndex);
+				c->qhGroupIndex.clear();
+			}
+
 			foreach(ServerUser *u, qhUsers)
 				if (u->sState == ServerUser::Authenticated)
 					flushClientPermissionCache(u, mppq);
@@ -1647,9 +2858,123 @@ void Server::clearACLCache(User *p) {
 
 	{
 		QWriteLocker lock(&qrwlUsers);
+		++uiRouteGeneration;
+	}
+
+	if (p) {
+		rebuildWhisperRoutes(static_cast<ServerUser *>(p));
+		rebuildWhisperRoutesTo(static_cast<ServerUser *>(p));
+	} else {
+		rebuildWhisperRoutes();
+	}
+}
+
+/* Like flushClientPermissionCache, but only for the channels in chans, and
+ * assumes their cached permissions are already gone. Channels the client
+ * knows about are rechecked, and only those that changed are sent. If the
+ * client knows too many of them, fall back to a flush.
+ */
+
+void Server::refreshClientPermissions(ServerUser *u, const QSet<Channel *> &chans, MumbleProto::PermissionQuery &mppq) {
+	QList<Channel *> known;
+
+	if (u->qmPermissionSent.count() < chans.count()) {
+		QMap<int, unsigned int>::const_iterator i;
+		for (i = u->qmPermissionSent.constBegin(); i != u->qmPermissionSent.constEnd(); ++i) {
+			Channel *c = qhChannels.value(i.key());
+			if (c && chans.contains(c))
+				known << c;
+		}
+	} else {
+		foreach(Channel *c, chans)
+			if (u->qmPermissionSent.contains(c->iId))
+				known << c;
+	}
+
+	if (known.count() >= 20) {
+		flushClientPermissionCache(u, mppq);
+		return;
+	}
+
+	foreach(Channel *c, known) {
+		ChanACL::hasPermission(u, c, ChanACL::Enter, &acCache);
+		unsigned int perm = acCache.value(u)->value(c);
+		if (perm == u->qmPermissionSent.value(c->iId))
+			continue;
+
+		u->qmPermissionSent.insert(c->iId, perm);
+
+		mppq.Clear();
+		mppq.set_channel_id(c->iId);
+		mppq.set_permissions(perm);
+
+		sendMessage(u, mppq);
+	}
+}
+
+/* Invalidate after a change to the ACLs, groups or position of c. Those
+ * only reach permissions in c and below it, so other channels keep their
+ * chains and cached permissions. Voice routes only hold users of channels
+ * whose permissions were checked, so they stay valid if the subtree is
+ * empty.
+ *
+ * If c was moved, the users in it changed depth as well, which changes
+ * their membership of sub groups anywhere; their caches go entirely.
+ */
+
+void Server::clearACLCache(Channel *c, bool moved) {
+	MumbleProto::PermissionQuery mppq;
+	QSet<Channel *> chans = c->allChildren();
+	bool occupied = false;
+
+	chans.insert(c);
+
+	{
+		QMutexLocker qml(&qmCache);
+
+		foreach(Channel *ch, chans) {
+			delete ch->acChain;
+			ch->acChain = NULL;
+			qDeleteAll(ch->qhGroupIndex);
+			ch->qhGroupIndex.clear();
+			if (! ch->qlUsers.isEmpty())
+				occupied = true;
+		}
+
+		foreach(ChanACL::ChanCache *h, acCache) {
+			if (h->count() < chans.count()) {
+				QMutableHashIterator<Channel *, ChanACL::Permissions> i(*h);
+				while (i.hasNext()) {
+					i.next();
+					if (chans.contains(i.key()))
+						i.remove();
+				}
+			} else {
+				foreach(Channel *ch, chans)
+					h->remove(ch);
+			}
+		}
 
 		foreach(ServerUser *u, qhUsers)
-			u->qmTargetCache.clear();
+			if (u->sState == ServerUser::Authenticated)
+				refreshClientPermissions(u, chans, mppq);
+	}
+
+	if (occupied) {
+		{
+			QWriteLocker lock(&qrwlUsers);
+			++uiRouteGeneration;
+		}
+
+		foreach(Channel *ch, chans)
+			if (! ch->qlUsers.isEmpty())
+				rebuildWhisperRoutes(ch);
+	}
+
+	if (moved && occupied) {
+		foreach(Channel *ch, chans)
+			foreach(User *p, ch->qlUsers)
+				clearACLCache(p);
 	}
 }
 
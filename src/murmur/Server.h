@@ -45,6 +45,7 @@
 #include <QtCore/QSocketNotifier>
 #include <QtCore/QThread>
 #include <QtCore/QUrl>
+#include <QtCore/QWaitCondition>
 #include <QtNetwork/QSslCertificate>
 #include <QtNetwork/QSslKey>
 #include <QtNetwork/QSslSocket>
@@ -56,14 +57,22 @@
 #include "ACL.h"
 #include "Message.h"
 #include "Mumble.pb.h"
+#include "JoinImage.h"
 #include "Net.h"
+#include "PeerTable.h"
+#include "TcpVoiceQueue.h"
 #include "User.h"
 #include "Timer.h"
+#include "VoiceEpoch.h"
 
 class BonjourServer;
 class Channel;
 class PacketDataStream;
+class Server;
 class ServerUser;
+class UdpFanout;
+struct FanoutSlice;
+struct VoiceRecipient;
 class User;
 class QNetworkAccessManager;
 
@@ -99,6 +108,9 @@ class SslServer : public QTcpServer {
 
 #define EXEC_QEVENT (QEvent::User + 959)
 
+// 1us .. ~2s, the last bucket collects everything slower.
+#define VOICE_LOCKWAIT_BUCKETS 22
+
 class ExecEvent : public QEvent {
 		Q_DISABLE_COPY(ExecEvent);
 	protected:
@@ -108,12 +120,97 @@ class ExecEvent : public QEvent {
 		void execute();
 };
 
+// Marks the server emitting on this thread. Listeners in another thread
+// don't get a QObject::sender(), so they ask ServerScope::current().
+class ServerScope {
+		Q_DISABLE_COPY(ServerScope);
+	protected:
+		Server *sPrevious;
+	public:
+		ServerScope(Server *s);
+		~ServerScope();
+		static Server *current();
+};
+
+// Additional voice thread, serving its own share of the SO_REUSEPORT sockets.
+class UdpWorker : public QThread {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(UdpWorker);
+	protected:
+		Server *s;
+		int iWorker;
+	public:
+		UdpWorker(Server *srv, int worker);
+		void run();
+};
+
+// Helper thread encrypting and sending slices of very large voice fan-outs.
+class FanoutWorker : public QThread {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(FanoutWorker);
+	protected:
+		Server *s;
+	public:
+		FanoutWorker(Server *srv);
+		void run();
+};
+
+// Runs the TLS handshakes of new connections, so a burst of them does not
+// hold up the control thread. Each socket is handed back to the thread of
+// the server through handshakeDone() once its handshake has ended, either
+// way. Without a thread of its own, it works on the thread of the server.
+class HandshakeWorker : public QObject {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(HandshakeWorker);
+	protected:
+		struct Pending {
+			Timer tStarted;
+			bool bVerified;
+			bool bDone;
+			bool bOk;
+			QString qsReason;
+			Pending() : bVerified(true), bDone(false), bOk(false) {}
+		};
+		QThread *qtThread;
+		QObject *qoOwner;
+		QTimer *qtExpire;
+		QHash<QSslSocket *, Pending> qhPending;
+		int iServerNum;
+		int iTimeout;
+
+		void fail(QSslSocket *sock, const QString &reason);
+	public:
+		HandshakeWorker(QObject *owner, int server, int timeout, bool threaded);
+		~HandshakeWorker();
+		void start(QSslSocket *sock);
+	protected slots:
+		void handshake(QSslSocket *sock);
+		void encrypted();
+		void sslErrors(const QList<QSslError> &);
+		void socketError();
+		void release(QSslSocket *sock);
+		void expire();
+		void shutdown();
+	signals:
+		void handshakeDone(QSslSocket *sock, bool ok, bool verified, const QString &reason);
+};
+
 class Server : public QThread {
 	private:
 		Q_OBJECT;
 		Q_DISABLE_COPY(Server);
 	protected:
 		bool bRunning;
+		// Voice is served by the shared UdpPool instead of our own threads.
+		bool bUdpPooled;
+
+		QList<UdpWorker *> qlUdpWorkers;
+		QList<FanoutWorker *> qlFanoutWorkers;
+		QList<HandshakeWorker *> qlHandshakeWorkers;
+		int iNextHandshakeWorker;
 
 		QNetworkAccessManager *qnamNetwork;
 
@@ -137,6 +234,14 @@ class Server : public QThread {
 		int iMaxTextMessageLength;
 		int iMaxImageMessageLength;
 		int iOpusThreshold;
+		int iUdpBatchSize;
+		int iUdpThreads;
+		int iFanoutThreads;
+		int iFanoutThreshold;
+		int iTlsCoalesce;
+		int iHandshakeThreads;
+		int iHandshakesPerIp;
+		int iHibernateAfter;
 		bool bAllowHTML;
 		QString qsPassword;
 		QString qsWelcomeText;
@@ -192,6 +297,7 @@ class Server : public QThread {
 		// Certificate stuff, implemented partially in Cert.cpp
 	public:
 		static bool isKeyForCert(const QSslKey &key, const QSslCertificate &cert);
+		static QStringList fatalSslErrors(const QList<QSslError> &errors, bool &verified);
 		void initializeCert();
 		const QString getDigest() const;
 
@@ -201,19 +307,38 @@ class Server : public QThread {
 		void sslError(const QList<QSslError> &);
 		void message(unsigned int, const QByteArray &, ServerUser *cCon = NULL);
 		void checkTimeout();
-		void tcpTransmitData(QByteArray, unsigned int);
+		void reclaimUsers();
+		void tcpDrain();
 		void doSync(unsigned int);
-		void encrypted();
+		void handshakeDone(QSslSocket *sock, bool ok, bool verified, const QString &reason);
 		void udpActivated(int);
+		void releaseThread();
+		void hibernate();
 	signals:
 		void reqSync(unsigned int);
-		void tcpTransmit(QByteArray, unsigned int id);
+		void tcpVoiceReady();
 	public:
 		int iServerNum;
 		QQueue<int> qqIds;
 		QList<SslServer *> qlServer;
 		QTimer *qtTimeout;
 
+		// Sockets out on a HandshakeWorker, and how many of them each
+		// address has.
+		QHash<QSslSocket *, HostAddress> qhHandshakeAddress;
+		QHash<HostAddress, int> qhHandshakes;
+		void encrypted(ServerUser *u);
+
+		// While hibernating, the channel tree and bans are not loaded;
+		// anything about to use them calls wake() first.
+		bool bHibernating;
+		int iHibernatedChannels;
+		QTimer *qtHibernate;
+		void scheduleHibernate();
+		void wake();
+
+		// qlUdpSocket holds iUdpThreads consecutive sockets per bind address;
+		// voice thread N serves every socket with index % iUdpThreads == N.
 #ifdef Q_OS_UNIX
 		int aiNotify[2];
 		QList<int> qlUdpSocket;
@@ -225,10 +350,19 @@ class Server : public QThread {
 		QList<QSocketNotifier *> qlUdpNotifier;
 
 		QHash<unsigned int, ServerUser *> qhUsers;
-		QHash<QPair<HostAddress, quint16>, ServerUser *> qhPeerUsers;
+		PeerTable<ServerUser> ptPeerUsers;
 		QHash<HostAddress, QSet<ServerUser *> > qhHostUsers;
+		// Users without UDP yet, by the first IV byte we expect from them.
+		QHash<QPair<HostAddress, unsigned char>, QSet<ServerUser *> > qhHintUsers;
+		// Rotates where the trial decryption of unhinted users starts.
+		QAtomicInt qaiTrialCursor;
 		QHash<unsigned int, Channel *> qhChannels;
 		QReadWriteLock qrwlUsers;
+		// Bumped with qrwlUsers locked for writing whenever channel membership,
+		// links, ACLs, deafness or positional audio contexts change. The voice
+		// threads compare against it without the lock, so a frame may still
+		// go out on the previous route while a change is being applied.
+		unsigned int uiRouteGeneration;
 		ChanACL::ACLCache acCache;
 		QMutex qmCache;
 		QHash<int, QString> qhUserNameCache;
@@ -236,20 +370,99 @@ class Server : public QThread {
 
 		QList<Ban> qlBans;
 
-		void processMsg(ServerUser *u, const char *data, int len);
-		void sendMessage(ServerUser *u, const char *data, int len, QByteArray &cache, bool force = false);
+		// Cumulative counters of the voice path, exported through RPC.
+		QMutex qmStatistics;
+		QHash<QString, qint64> qhStatistics;
+		QHash<QString, qint64> getStatistics();
+		// Time the voice threads spent waiting for qrwlUsers, bucketed by
+		// log2 of microseconds. Guarded by qmStatistics.
+		quint64 uiLockWait[VOICE_LOCKWAIT_BUCKETS];
+		quint64 uiControlMessages;
+
+		// Parsed control messages, kept for the next message of the same
+		// type so their strings and repeated fields keep their storage.
+		QHash<unsigned int, QList< ::google::protobuf::Message *> > qhMessagePool;
+		template <class T> T *takeMessage(unsigned int type) {
+			QList< ::google::protobuf::Message *> &l = qhMessagePool[type];
+			return l.isEmpty() ? new T() : static_cast<T *>(l.takeLast());
+		}
+		void releaseMessage(unsigned int type, ::google::protobuf::Message *msg, int size);
+
+		// What a joining client is sent about channels and other users, kept
+		// serialized between joins. The broadcasts announcing a change mark
+		// the blocks it affects, see updateJoinState().
+		enum JoinVariant { JoinHashes, JoinTextures, JoinPlain };
+		JoinImage jiChannels[2];
+		QByteArray qbaJoinLinks;
+		JoinImage jiUsers[3];
+		QByteArray joinChannel(Channel *c, bool hashes);
+		QByteArray joinUser(ServerUser *u, JoinVariant jv);
+		const QByteArray &joinChannels(bool hashes);
+		const QByteArray &joinLinks();
+		const QByteArray &joinUsers(JoinVariant jv);
+		void updateJoinState(const ::google::protobuf::Message &msg, unsigned int msgType);
+		void clearJoinChannels();
+
+		// Voice threads hold an epoch instead of qrwlUsers while handling
+		// known peers. Disconnected users wait in qlRetiredUsers, with the
+		// stamp they were retired at, until no voice thread can see them.
+		VoiceEpoch veVoice;
+		QList<QPair<quint32, ServerUser *> > qlRetiredUsers;
+		QTimer *qtReclaim;
+		void retireUser(ServerUser *u);
+		void lockUsersForVoice();
+
+		void processMsg(ServerUser *u, const char *data, int len, UdpFanout *fanout = NULL);
+		void buildVoiceRoute(ServerUser *u);
+
+		// Whisper routes are resolved on the control thread and only read by
+		// the voice threads. They are indexed by the channels they reach and
+		// the sessions they name, so a change only rebuilds the routes that
+		// could be affected by it.
+		QHash<Channel *, QSet<ServerUser *> > qhWhisperChannels;
+		QHash<unsigned int, QSet<ServerUser *> > qhWhisperSessions;
+		void buildWhisperRoute(ServerUser *u, int target);
+		void dropWhisperRoutes(ServerUser *u);
+		void rebuildWhisperRoutes();
+		void rebuildWhisperRoutes(ServerUser *u);
+		void rebuildWhisperRoutes(Channel *c);
+		void rebuildWhisperRoutesTo(ServerUser *p);
+		void sendMessage(ServerUser *u, const char *data, int len, bool force = false, UdpFanout *fanout = NULL);
+
+		// Voice for users without UDP, drained by tcpDrain() on the main thread.
+		TcpVoiceQueue *tvqTcp;
+
 		void run();
+		void udpLoop(int worker);
+#ifdef Q_OS_UNIX
+		void udpReceive(int sock, int worker);
+#else
+		void udpReceive(SOCKET sock, int worker);
+#endif
+
+		// Route slices waiting for a FanoutWorker. All guarded by qmFanout.
+		QMutex qmFanout;
+		QWaitCondition qwcFanoutWork;
+		QWaitCondition qwcFanoutDone;
+		QQueue<FanoutSlice *> qqFanoutSlices;
+		bool bFanoutStop;
+		void fanoutLoop();
+		void sendVoiceRoute(const VoiceRecipient *vr, const VoiceRecipient *end, const char *buffer, int len, unsigned int poslen, UdpFanout *fanout);
 
 		bool validateChannelName(const QString &name);
 		bool validateUserName(const QString &name);
 
 		bool checkDecrypt(ServerUser *u, const char *encrypted, char *plain, unsigned int cryptlen);
+		void setUdpHint(ServerUser *u);
+		void clearUdpHint(ServerUser *u);
 
 		bool hasPermission(ServerUser *p, Channel *c, QFlags<ChanACL::Perm> perm);
 		QFlags<ChanACL::Perm> effectivePermissions(ServerUser *p, Channel *c);
 		void sendClientPermission(ServerUser *u, Channel *c, bool updatelast = false);
 		void flushClientPermissionCache(ServerUser *u, MumbleProto::PermissionQuery &mpqq);
+		void refreshClientPermissions(ServerUser *u, const QSet<Channel *> &chans, MumbleProto::PermissionQuery &mpqq);
 		void clearACLCache(User *p = NULL);
+		void clearACLCache(Channel *c, bool moved = false);
 
 		void sendProtoAll(const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
 		void sendProtoExcept(ServerUser *, const ::google::protobuf::Message &msg, unsigned int msgType, unsigned int minversion);
@@ -53,25 +53,61 @@ class TransactionHolder {
 	public:
 		QSqlQuery *qsqQuery;
 		TransactionHolder() {
-			ServerDB::db->transaction();
-			qsqQuery = new QSqlQuery();
+			ServerDB::qmDatabase.lock();
+			QSqlDatabase &qsdb = ServerDB::database();
+			qsdb.transaction();
+			qsqQuery = new QSqlQuery(qsdb);
 		}
 
 		~TransactionHolder() {
 			qsqQuery->clear();
 			delete qsqQuery;
-			ServerDB::db->commit();
+			ServerDB::database().commit();
+			ServerDB::qmDatabase.unlock();
 		}
 		TransactionHolder(const TransactionHolder & other) {
-			ServerDB::db->transaction();
+			ServerDB::qmDatabase.lock();
+			ServerDB::database().transaction();
 			qsqQuery = other.qsqQuery ? new QSqlQuery(*other.qsqQuery) : 0;
 		}
 };
 
+/// Connection of a control thread, cloned from the main one on first use
+/// and removed again when the thread ends.
+class ThreadDatabase {
+	public:
+		QSqlDatabase qsdb;
+		ThreadDatabase(const QSqlDatabase &main) {
+			static QAtomicInt qaiNext;
+			qsdb = QSqlDatabase::cloneDatabase(main, QString::fromLatin1("murmur_thread_%1").arg(qaiNext.fetchAndAddRelaxed(1)));
+			if (! qsdb.open())
+				qFatal("ServerDB: Failed to open connection for control thread: %s", qPrintable(qsdb.lastError().text()));
+		}
+		~ThreadDatabase() {
+			const QString name = qsdb.connectionName();
+			qsdb.close();
+			qsdb = QSqlDatabase();
+			QSqlDatabase::removeDatabase(name);
+		}
+};
+
+static QThreadStorage<ThreadDatabase *> qtsThreadDatabase;
+
 QSqlDatabase *ServerDB::db = NULL;
+QMutex ServerDB::qmDatabase(QMutex::Recursive);
 Timer ServerDB::tLogClean;
 QString ServerDB::qsUpgradeSuffix;
 
+QSqlDatabase &ServerDB::database() {
+	if (QThread::currentThread() == QCoreApplication::instance()->thread())
+		return *db;
+	if (! qtsThreadDatabase.hasLocalData()) {
+		QMutexLocker qml(&qmDatabase);
+		qtsThreadDatabase.setLocalData(new ThreadDatabase(*db));
+	}
+	return qtsThreadDatabase.localData()->qsdb;
+}
+
 ServerDB::ServerDB() {
 	if (! QSqlDatabase::isDriverAvailable(Meta::mp.qsDBDriver)) {
 		qFatal("ServerDB: Database driver %s not available", qPrintable(Meta::mp.qsDBDriver));
@@ -475,7 +511,8 @@ ServerDB::~ServerDB() {
 }
 
 bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool warn) {
-	if (! db->isValid()) {
+	QSqlDatabase &qsdb = database();
+	if (! qsdb.isValid()) {
 		qWarning("SQL [%s] rejected: Database is gone", qPrintable(str));
 		return false;
 	}
@@ -492,18 +529,18 @@ bool ServerDB::prepare(QSqlQuery &query, const QString &str, bool fatal, bool wa
 	if (query.prepare(q)) {
 		return true;
 	} else {
-		db->close();
-		if (! db->open()) {
-			qFatal("Lost connection to SQL Database: Reconnect: %s", qPrintable(db->lastError().text()));
+		qsdb.close();
+		if (! qsdb.open()) {
+			qFatal("Lost connection to SQL Database: Reconnect: %s", qPrintable(qsdb.lastError().text()));
 		}
-		query = QSqlQuery();
+		query = QSqlQuery(qsdb);
 		if (query.prepare(q)) {
 			qWarning("SQL Connection lost, reconnection OK");
 			return true;
 		}
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			qsdb = QSqlDatabase();
 			qFatal("SQL Prepare Error [%s]: %s", qPrintable(q), qPrintable(query.lastError().text()));
 		} else if (warn) {
 			qDebug("SQL Prepare Error [%s]: %s", qPrintable(q), qPrintable(query.lastError().text()));
@@ -520,7 +557,7 @@ bool ServerDB::exec(QSqlQuery &query, const QString &str, bool fatal, bool warn)
 	} else {
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			database() = QSqlDatabase();
 			qFatal("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
 		} else if (warn) {
 			qDebug("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
@@ -537,7 +574,7 @@ bool ServerDB::execBatch(QSqlQuery &query, const QString &str, bool fatal) {
 	} else {
 
 		if (fatal) {
-			*db = QSqlDatabase();
+			database() = QSqlDatabase();
 			qFatal("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
 		} else
 			qDebug("SQL Error [%s]: %s", qPrintable(query.lastQuery()), qPrintable(query.lastError().text()));
@@ -662,6 +699,7 @@ int Server::registerUser(const QMap<int, QString> &info) {
 	qhUserIDCache.remove(name);
 
 	int res = -2;
+	ServerScope ss(this);
 	emit registerUserSig(res, info);
 	if (res != -2) {
 		qhUserIDCache.remove(name);
@@ -709,6 +747,7 @@ bool Server::unregisterUserDB(int id) {
 	qhUserNameCache.remove(id);
 
 	int res = -2;
+	ServerScope ss(this);
 	emit unregisterUserSig(res, id);
 	if (res == 0) {
 		return false;
@@ -733,6 +772,7 @@ bool Server::unregisterUserDB(int id) {
 QList<UserInfo> Server::getRegisteredUsersEx() {
 
 	QMap<int, QString> rpcUsers;
+	ServerScope ss(this);
 	emit getRegisteredUsersSig(QString(), rpcUsers);
 
 	QList<UserInfo> users;
@@ -766,6 +806,7 @@ QList<UserInfo> Server::getRegisteredUsersEx() {
 QMap<int, QString > Server::getRegisteredUsers(const QString &filter) {
 	QMap<int, QString > m;
 
+	ServerScope ss(this);
 	emit getRegisteredUsersSig(filter, m);
 
 	TransactionHolder th;
@@ -792,6 +833,7 @@ QMap<int, QString > Server::getRegisteredUsers(const QString &filter) {
 bool Server::isUserId(int id) {
 	QMap<int, QString> info;
 	int res = -2;
+	ServerScope ss(this);
 	emit getRegistrationSig(res, id, info);
 	if (res >= 0)
 		return (res > 0);
@@ -812,6 +854,7 @@ bool Server::isUserId(int id) {
 QMap<int, QString> Server::getRegistration(int id) {
 	QMap<int, QString> info;
 	int res = -2;
+	ServerScope ss(this);
 	emit getRegistrationSig(res, id, info);
 	if (res >= 0)
 		return info;
@@ -846,6 +889,7 @@ QMap<int, QString> Server::getRegistration(int id) {
 int Server::authenticate(QString &name, const QString &pw, int sessionId, const QStringList &emails, const QString &certhash, bool bStrongCert, const QList<QSslCertificate> &certs) {
 	int res = -2;
 
+	ServerScope ss(this);
 	emit authenticateSig(res, name, sessionId, certs, certhash, bStrongCert, pw);
 
 	if (res != -2) {
@@ -966,6 +1010,7 @@ bool Server::setInfo(int id, const QMap<int, QString> &setinfo) {
 		qhUserIDCache.remove(info.value(ServerDB::User_Name));
 	}
 
+	ServerScope ss(this);
 	emit setInfoSig(res, id, info);
 	if (res >= 0)
 		return (res > 0);
@@ -1035,6 +1080,7 @@ bool Server::setTexture(int id, const QByteArray &texture) {
 	}
 
 	int res = -2;
+	ServerScope ss(this);
 	emit setTextureSig(res, id, tex);
 	if (res >= 0)
 		return (res > 0);
@@ -1082,6 +1128,7 @@ QString Server::getUserName(int id) {
 	if (qhUserNameCache.contains(id))
 		return qhUserNameCache.value(id);
 	QString name;
+	ServerScope ss(this);
 	emit idToNameSig(name, id);
 	if (! name.isEmpty()) {
 		qhUserIDCache.insert(name, id);
@@ -1107,6 +1154,7 @@ int Server::getUserID(const QString &name) {
 	if (qhUserIDCache.contains(name))
 		return qhUserIDCache.value(name);
 	int id = -2;
+	ServerScope ss(this);
 	emit nameToIdSig(id, name);
 	if (id != -2) {
 		qhUserIDCache.insert(name, id);
@@ -1135,6 +1183,7 @@ int Server::getUserID(const QString &name) {
 
 QByteArray Server::getUserTexture(int id) {
 	QByteArray qba;
+	ServerScope ss(this);
 	emit idToTextureSig(qba, id);
 	if (! qba.isNull()) {
 		return qba;
@@ -1157,7 +1206,14 @@ QByteArray Server::getUserTexture(int id) {
 }
 
 void Server::addLink(Channel *c, Channel *l) {
-	c->link(l);
+	{
+		QWriteLocker wl(&qrwlUsers);
+		c->link(l);
+		++uiRouteGeneration;
+	}
+
+	rebuildWhisperRoutes(c);
+	rebuildWhisperRoutes(l);
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1177,7 +1233,14 @@ void Server::addLink(Channel *c, Channel *l) {
 }
 
 void Server::removeLink(Channel *c, Channel *l) {
-	c->unlink(l);
+	{
+		QWriteLocker wl(&qrwlUsers);
+		c->unlink(l);
+		++uiRouteGeneration;
+	}
+
+	rebuildWhisperRoutes(c);
+	rebuildWhisperRoutes(l);
 
 	if (c->bTemporary || l->bTemporary)
 		return;
@@ -1240,6 +1303,9 @@ Channel *Server::addChannel(Channel *p, const QString &name, bool temporary, int
 	c->bTemporary = temporary;
 	c->iPosition = position;
 	qhChannels.insert(id, c);
+
+	// Whisper routes to the parent's tree may now reach it as a child.
+	rebuildWhisperRoutes(p);
 	return c;
 }
 
@@ -1380,10 +1446,10 @@ void Server::readChannelPrivs(Channel *c) {
 		g->bInherit = query.value(2).toBool();
 		g->bInheritable = query.value(3).toBool();
 
-		QSqlQuery mem;
-		mem.prepare(QString::fromLatin1("SELECT user_id, addit FROM %1group_members WHERE group_id = ?").arg(Meta::mp.qsDBPrefix));
+		QSqlQuery mem(ServerDB::database());
+		ServerDB::prepare(mem, QLatin1String("SELECT `user_id`, `addit` FROM `%1group_members` WHERE `group_id` = ?"));
 		mem.addBindValue(gid);
-		mem.exec();
+		ServerDB::exec(mem);
 		while (mem.next()) {
 			int uid = mem.value(0).toInt();
 			if (mem.value(1).toBool())
@@ -1411,7 +1477,7 @@ void Server::readChannelPrivs(Channel *c) {
 void Server::readChannels(Channel *p) {
 	QList<Channel *> kids;
 	Channel *c;
-	QSqlQuery query;
+	QSqlQuery query(ServerDB::database());
 	int parentid = -1;
 
 	if (p) {
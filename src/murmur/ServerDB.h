@@ -31,6 +31,7 @@
 #ifndef MUMBLE_MURMUR_DATABASE_H_
 #define MUMBLE_MURMUR_DATABASE_H_
 
+#include <QtCore/QMutex>
 #include <QtCore/QVariant>
 
 #include "Timer.h"
@@ -50,6 +51,12 @@ class ServerDB {
 		typedef QPair<unsigned int, QString> LogRecord;
 		static Timer tLogClean;
 		static QSqlDatabase *db;
+		// Held for the lifetime of every transaction. Control threads have
+		// connections of their own, but SQLite still allows only a single
+		// writer at a time.
+		static QMutex qmDatabase;
+		// db on the main thread, a per-thread clone of it elsewhere.
+		static QSqlDatabase &database();
 		static QString qsUpgradeSuffix;
 		static void setSUPW(int iServNum, const QString &pw);
 		static QList<int> getBootServers();
@@ -35,6 +35,10 @@
 #include "ServerUser.h"
 #include "Meta.h"
 
+#ifdef USE_TLS_RESUMPTION
+#include "TlsSession.h"
+#endif
+
 ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), User(), s(NULL) {
 	sState = ServerUser::Connected;
 	sUdpSocket = INVALID_SOCKET;
@@ -50,6 +54,12 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 	uiVersion = 0;
 	bVerified = true;
 	iLastPermissionCheck = -1;
+
+	cRouteChannel = NULL;
+
+	bUdpHint = false;
+	ucUdpHint = 0;
+	uiRouteGeneration = 0;
 	
 	bOpus = false;
 }
@@ -58,6 +68,13 @@ ServerUser::ServerUser(Server *p, QSslSocket *socket) : Connection(p, socket), U
 ServerUser::operator const QString() const {
 	return QString::fromLatin1("%1:%2(%3)").arg(qsName).arg(uiSession).arg(iId);
 }
+
+#ifdef USE_TLS_RESUMPTION
+bool ServerUser::isTlsResumed() const {
+	return TlsSessionCache::isResumed(qtsSocket);
+}
+#endif
+
 BandwidthRecord::BandwidthRecord() {
 	iRecNum = 0;
 	iSum = 0;
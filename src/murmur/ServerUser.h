@@ -32,7 +32,10 @@
 #ifndef MUMBLE_MURMUR_SERVERUSER_H_
 #define MUMBLE_MURMUR_SERVERUSER_H_
 
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
 #include <QtCore/QStringList>
+#include <QtCore/QVector>
 
 #ifdef Q_OS_UNIX
 #include <sys/socket.h>
@@ -79,6 +82,16 @@ struct WhisperTarget {
 };
 
 class Server;
+class ServerUser;
+
+// A recipient of normal speech, as precomputed by Server::buildVoiceRoute().
+struct VoiceRecipient {
+	ServerUser *pDst;
+	// Recipient shares the speaker's positional audio context.
+	bool bPositional;
+};
+
+Q_DECLARE_TYPEINFO(VoiceRecipient, Q_PRIMITIVE_TYPE);
 
 class ServerUser : public Connection, public User {
 	private:
@@ -110,15 +123,41 @@ class ServerUser : public Connection, public User {
 		bool bUdp;
 
 		QList<int> qlCodecs;
+		// Voice cipher modes announced in Version, fastest first.
+		QList<int> qlCryptModes;
 		bool bOpus;
 
 		QStringList qslAccessTokens;
+		// qslAccessTokens case folded, for #token groups.
+		QSet<QString> qsAccessTokens;
 
 		QMap<int, WhisperTarget> qmTargets;
-		typedef QPair<QSet<ServerUser *>, QSet<ServerUser *> > TargetCache;
-		QMap<int, TargetCache> qmTargetCache;
 		QMap<QString, QString> qmWhisperRedirect;
 
+		// Voice recipients, read by the voice threads without qrwlUsers.
+		// Entries are copied out under qmRoute and never modified in place.
+		// The normal speech route is only valid while cRouteChannel is the
+		// current channel and uiRouteGeneration matches the server's.
+		// Whisper routes are kept current by the control thread, see
+		// Server::buildWhisperRoute().
+		struct TargetCache {
+			QVector<VoiceRecipient> qvChannel;
+			QVector<VoiceRecipient> qvDirect;
+		};
+		QMutex qmRoute;
+		QVector<VoiceRecipient> qvRoute;
+		Channel *cRouteChannel;
+		unsigned int uiRouteGeneration;
+		QMap<int, TargetCache> qmTargetCache;
+
+		// The channels and sessions each whisper route was resolved from.
+		// Control thread only.
+		struct TargetSource {
+			QSet<Channel *> qsChannels;
+			QList<unsigned int> qlSessions;
+		};
+		QMap<int, TargetSource> qmTargetSources;
+
 		int iLastPermissionCheck;
 		QMap<int, unsigned int> qmPermissionSent;
 #ifdef Q_OS_UNIX
@@ -127,9 +166,17 @@ class ServerUser : public Connection, public User {
 		SOCKET sUdpSocket;
 #endif
 		BandwidthRecord bwr;
+		// Serializes csCrypt between the voice threads and the main thread.
+		QMutex qmCrypt;
+		// Entry in Server::qhHintUsers, if any.
+		bool bUdpHint;
+		unsigned char ucUdpHint;
 		struct sockaddr_storage saiUdpAddress;
 		struct sockaddr_storage saiTcpLocalAddress;
 		ServerUser(Server *parent, QSslSocket *socket);
+#ifdef USE_TLS_RESUMPTION
+		bool isTlsResumed() const;
+#endif
 };
 
 #endif
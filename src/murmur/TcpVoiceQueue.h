@@ -0,0 +1,158 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_TCPVOICEQUEUE_H_
+#define MUMBLE_MURMUR_TCPVOICEQUEUE_H_
+
+#include <QtCore/QtEndian>
+#include <QtCore/QtGlobal>
+
+#include <string.h>
+
+#include "Message.h"
+
+#if defined(_MSC_VER)
+#define TCPVOICE_BARRIER() MemoryBarrier()
+#define TCPVOICE_CAS(p, o, n) (InterlockedCompareExchange(reinterpret_cast<volatile LONG *>(p), static_cast<LONG>(n), static_cast<LONG>(o)) == static_cast<LONG>(o))
+#else
+#define TCPVOICE_BARRIER() __sync_synchronize()
+#define TCPVOICE_CAS(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+/// Bounded queue of voice packets headed for TCP-only users. Any number of
+/// voice threads push, the main thread drains.
+///
+/// Each slot carries a sequence number telling whose turn it is: a producer
+/// may claim slot (pos & mask) once its sequence equals pos, and the consumer
+/// may read it once the sequence equals pos + 1. Packets are stored already
+/// framed as a UDPTunnel message, so the consumer writes them out as is.
+///
+/// The queue is armed when a producer should wake the consumer. Only the
+/// producer that arms it sends a wakeup, so one wakeup covers everything
+/// pushed until the consumer disarms it again at the start of its drain.
+class TcpVoiceQueue {
+	private:
+		Q_DISABLE_COPY(TcpVoiceQueue)
+	public:
+		struct Slot {
+			volatile quint32 uiSequence;
+			unsigned int uiSession;
+			int iLength;
+			char *data() {
+				return reinterpret_cast<char *>(this) + sizeof(Slot);
+			}
+		};
+	protected:
+		char *pcSlots;
+		int iStride;
+		quint32 uiMask;
+		volatile quint32 uiTail;
+		quint32 uiHead;
+		volatile quint32 uiArmed;
+
+		Slot *slot(quint32 pos) const {
+			return reinterpret_cast<Slot *>(pcSlots + (pos & uiMask) * iStride);
+		}
+	public:
+		/// capacity must be a power of two.
+		TcpVoiceQueue(int capacity, int maxpacket) : uiMask(capacity - 1), uiTail(0), uiHead(0), uiArmed(0) {
+			iStride = (sizeof(Slot) + 6 + maxpacket + 7) & ~7;
+			pcSlots = new char[capacity * iStride];
+			for (int i=0;i<capacity;++i)
+				slot(i)->uiSequence = i;
+		}
+
+		~TcpVoiceQueue() {
+			delete [] pcSlots;
+		}
+
+		/// Append a voice packet for session. Returns false if the queue is full.
+		bool push(unsigned int session, const char *data, int len) {
+			quint32 pos = uiTail;
+			Slot *s;
+			forever {
+				s = slot(pos);
+				quint32 seq = s->uiSequence;
+				TCPVOICE_BARRIER();
+				qint32 diff = static_cast<qint32>(seq - pos);
+				if (diff == 0) {
+					if (TCPVOICE_CAS(&uiTail, pos, pos + 1))
+						break;
+				} else if (diff < 0) {
+					return false;
+				}
+				pos = uiTail;
+			}
+
+			unsigned char *uc = reinterpret_cast<unsigned char *>(s->data());
+			qToBigEndian<quint16>(static_cast<quint16>(MessageHandler::UDPTunnel), & uc[0]);
+			qToBigEndian<quint32>(static_cast<quint32>(len), & uc[2]);
+			memcpy(uc + 6, data, len);
+			s->uiSession = session;
+			s->iLength = len + 6;
+
+			TCPVOICE_BARRIER();
+			s->uiSequence = pos + 1;
+			return true;
+		}
+
+		/// Returns true if the caller has to wake the consumer.
+		bool arm() {
+			if (uiArmed)
+				return false;
+			return TCPVOICE_CAS(&uiArmed, 0, 1);
+		}
+
+		/// Called by the consumer before it drains. Anything pushed after
+		/// this arms the queue again.
+		void disarm() {
+			uiArmed = 0;
+			TCPVOICE_BARRIER();
+		}
+
+		/// Oldest packet, or NULL if there is none. Consumer only.
+		Slot *front() const {
+			Slot *s = slot(uiHead);
+			quint32 seq = s->uiSequence;
+			TCPVOICE_BARRIER();
+			return (seq == uiHead + 1) ? s : NULL;
+		}
+
+		/// Release the packet returned by front(). Consumer only.
+		void pop() {
+			Slot *s = slot(uiHead);
+			TCPVOICE_BARRIER();
+			s->uiSequence = uiHead + uiMask + 1;
+			++uiHead;
+		}
+};
+
+#endif
@@ -0,0 +1,222 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "murmur_pch.h"
+
+#include "TlsSession.h"
+
+#include "Meta.h"
+
+#include <QtCore/private/qobject_p.h>
+#include <QtNetwork/private/qsslcontext_openssl_p.h>
+#include <QtNetwork/private/qsslsocket_openssl_p.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+// Serialized sessions kept for session id based resumption. Clients that
+// support tickets never need these, so the oldest are simply dropped.
+// There is no remove callback: OpenSSL drops every session whose connection
+// ended without a close_notify, which is exactly how connections end when
+// the network blips, and stale entries fail its expiry check on lookup.
+#define TLSSESSION_CACHE_SIZE 20000
+
+TlsSessionCache *TlsSessionCache::instance() {
+	static TlsSessionCache *tsc = NULL;
+	if (! tsc)
+		tsc = new TlsSessionCache();
+	return tsc;
+}
+
+TlsSessionCache::TlsSessionCache() {
+	bPrevious = false;
+	uiRotations = 0;
+	generate(tkCurrent);
+}
+
+void TlsSessionCache::generate(TicketKey &tk) {
+	if ((RAND_bytes(tk.name, sizeof(tk.name)) != 1) ||
+	        (RAND_bytes(tk.hmac, sizeof(tk.hmac)) != 1) ||
+	        (RAND_bytes(tk.aes, sizeof(tk.aes)) != 1))
+		qFatal("TlsSessionCache: Failed to generate session ticket key");
+	tRotated.restart();
+}
+
+void TlsSessionCache::rotate() {
+	if ((Meta::mp.iTlsTicketLifetime <= 0) || (tRotated.elapsed() < static_cast<quint64>(Meta::mp.iTlsTicketLifetime) * 1000000ULL))
+		return;
+
+	tkPrevious = tkCurrent;
+	bPrevious = true;
+	generate(tkCurrent);
+	++uiRotations;
+}
+
+quint64 TlsSessionCache::rotations() {
+	QMutexLocker qml(&qmCache);
+	return uiRotations;
+}
+
+int TlsSessionCache::ticketKey(SSL *, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, TLSSESSION_MAC_CTX *hctx, int enc) {
+	TlsSessionCache *tsc = instance();
+	QMutexLocker qml(&tsc->qmCache);
+	tsc->rotate();
+
+	const TicketKey *tk = NULL;
+	int ret = 1;
+
+	if (enc) {
+		tk = &tsc->tkCurrent;
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1)
+			return -1;
+		memcpy(name, tk->name, sizeof(tk->name));
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, tk->aes, iv) != 1)
+			return -1;
+	} else {
+		if (memcmp(name, tsc->tkCurrent.name, sizeof(tsc->tkCurrent.name)) == 0) {
+			tk = &tsc->tkCurrent;
+		} else if (tsc->bPrevious && (memcmp(name, tsc->tkPrevious.name, sizeof(tsc->tkPrevious.name)) == 0)) {
+			// Still valid, but have the client pick up a ticket under the current key.
+			tk = &tsc->tkPrevious;
+			ret = 2;
+		} else {
+			return 0;
+		}
+		if (EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, tk->aes, iv) != 1)
+			return -1;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(tk->hmac), sizeof(tk->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+		return -1;
+#else
+	if (HMAC_Init_ex(hctx, tk->hmac, sizeof(tk->hmac), EVP_sha256(), NULL) != 1)
+		return -1;
+#endif
+
+	return ret;
+}
+
+int TlsSessionCache::newSession(SSL *, SSL_SESSION *session) {
+	TlsSessionCache *tsc = instance();
+
+	unsigned int idlen = 0;
+	const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+
+	int len = i2d_SSL_SESSION(session, NULL);
+	if ((idlen == 0) || (len <= 0))
+		return 0;
+
+	QByteArray qba(len, 0);
+	unsigned char *p = reinterpret_cast<unsigned char *>(qba.data());
+	i2d_SSL_SESSION(session, &p);
+
+	QMutexLocker qml(&tsc->qmCache);
+
+	const QByteArray key(reinterpret_cast<const char *>(id), idlen);
+	if (! tsc->qhSessions.contains(key))
+		tsc->qqSessions.enqueue(key);
+	tsc->qhSessions.insert(key, qba);
+
+	while (tsc->qqSessions.count() > TLSSESSION_CACHE_SIZE)
+		tsc->qhSessions.remove(tsc->qqSessions.dequeue());
+
+	// We keep the serialized form only, so OpenSSL keeps its reference.
+	return 0;
+}
+
+SSL_SESSION *TlsSessionCache::getSession(SSL *, TLSSESSION_ID_CONST unsigned char *id, int len, int *copy) {
+	TlsSessionCache *tsc = instance();
+
+	*copy = 0;
+
+	QMutexLocker qml(&tsc->qmCache);
+	const QByteArray qba = tsc->qhSessions.value(QByteArray::fromRawData(reinterpret_cast<const char *>(id), len));
+	if (qba.isEmpty())
+		return NULL;
+
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(qba.constData());
+	return d2i_SSL_SESSION(NULL, &p, qba.size());
+}
+
+/// Give sock the context it will encrypt with, set up for resumption.
+/// Must be called before startServerEncryption(), which would otherwise
+/// create a context of its own and may take the ClientHello right away.
+bool TlsSessionCache::attach(QSslSocket *sock, int server) {
+	QSharedPointer<QSslContext> context = QSslContext::sharedFromConfiguration(QSslSocket::SslServerMode, sock->sslConfiguration(), false);
+	if (! context || (context->error() != QSslError::NoError))
+		return false;
+
+	// QSslContext keeps its SSL_CTX to itself, but an SSL made from it
+	// points back at it.
+	SSL *ssl = context->createSsl();
+	if (! ssl)
+		return false;
+	SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+	SSL_free(ssl);
+
+	const QByteArray sid = QString::fromLatin1("murmur/%1").arg(server).toLatin1();
+	SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char *>(sid.constData()), sid.size());
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, TlsSessionCache::newSession);
+	SSL_CTX_sess_set_get_cb(ctx, TlsSessionCache::getSession);
+
+	if (Meta::mp.iTlsTicketLifetime > 0) {
+		// A ticket is honoured for up to two key lifetimes.
+		SSL_CTX_set_timeout(ctx, 2 * Meta::mp.iTlsTicketLifetime);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TlsSessionCache::ticketKey);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, TlsSessionCache::ticketKey);
+#endif
+	} else {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	QSslSocketPrivate::checkSettingSslContext(sock, context);
+	return true;
+}
+
+bool TlsSessionCache::isResumed(QSslSocket *sock) {
+	QSslSocketBackendPrivate *d = static_cast<QSslSocketBackendPrivate *>(QObjectPrivate::get(sock));
+	return d->ssl && SSL_session_reused(d->ssl);
+}
@@ -0,0 +1,110 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_TLSSESSION_H_
+#define MUMBLE_MURMUR_TLSSESSION_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+
+#include <openssl/ssl.h>
+
+#include "Timer.h"
+
+class QSslSocket;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define TLSSESSION_ID_CONST const
+#else
+#define TLSSESSION_ID_CONST
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define TLSSESSION_MAC_CTX EVP_MAC_CTX
+#else
+#define TLSSESSION_MAC_CTX HMAC_CTX
+#endif
+
+/// TLS session resumption for incoming connections, shared by every
+/// virtual server in the process.
+///
+/// QSslSocket gives each connection an SSL_CTX of its own, so neither the
+/// OpenSSL session cache nor its ticket keys would ever see a returning
+/// client. attach() hands a server socket, before its encryption starts, a
+/// context that points at this object instead: sessions go to one external
+/// cache, and tickets are
+/// sealed with keys that are common to all virtual servers and replaced
+/// every Meta::mp.iTlsTicketLifetime seconds. Tickets sealed with the
+/// previous key are still accepted, and renewed. With a lifetime of 0 no
+/// tickets are issued and only the session cache is used.
+///
+/// Sessions are bound to their virtual server through the session id
+/// context, so they only resume on the server that created them.
+///
+/// Handshakes run on the handshake worker threads, so all state is
+/// guarded by qmCache. instance() must first be called on the main thread.
+class TlsSessionCache {
+	private:
+		Q_DISABLE_COPY(TlsSessionCache)
+	protected:
+		QMutex qmCache;
+
+		struct TicketKey {
+			unsigned char name[16];
+			unsigned char hmac[16];
+			unsigned char aes[16];
+		};
+		TicketKey tkCurrent;
+		TicketKey tkPrevious;
+		bool bPrevious;
+		Timer tRotated;
+		quint64 uiRotations;
+
+		QHash<QByteArray, QByteArray> qhSessions;
+		QQueue<QByteArray> qqSessions;
+
+		TlsSessionCache();
+		void generate(TicketKey &tk);
+		void rotate();
+
+		static int ticketKey(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, TLSSESSION_MAC_CTX *hctx, int enc);
+		static int newSession(SSL *ssl, SSL_SESSION *session);
+		static SSL_SESSION *getSession(SSL *ssl, TLSSESSION_ID_CONST unsigned char *id, int len, int *copy);
+	public:
+		static TlsSessionCache *instance();
+		quint64 rotations();
+		bool attach(QSslSocket *sock, int server);
+		static bool isResumed(QSslSocket *sock);
+};
+
+#endif
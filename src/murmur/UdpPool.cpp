@@ -0,0 +1,173 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "murmur_pch.h"
+
+#include "UdpPool.h"
+
+#include <sys/epoll.h>
+
+#include "Server.h"
+
+#define UDPPOOL_EVENTS 64
+
+UdpPoolWorker::UdpPoolWorker(int worker, int notify) : QThread(), iWorker(worker), uiNextId(0) {
+	iEpoll = epoll_create1(EPOLL_CLOEXEC);
+	if (iEpoll == -1)
+		return;
+
+	// The notify socket is never drained, so every worker sees it.
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	if (epoll_ctl(iEpoll, EPOLL_CTL_ADD, notify, &ev) != 0) {
+		close(iEpoll);
+		iEpoll = -1;
+	}
+}
+
+UdpPoolWorker::~UdpPoolWorker() {
+	if (iEpoll != -1)
+		close(iEpoll);
+}
+
+void UdpPoolWorker::run() {
+	struct epoll_event events[UDPPOOL_EVENTS];
+
+	while (true) {
+		int n = epoll_wait(iEpoll, events, UDPPOOL_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			qCritical("UdpPool: epoll_wait failed");
+			return;
+		}
+
+		QMutexLocker qml(&qmDispatch);
+		for (int i=0;i<n;++i) {
+			if (events[i].data.u64 == 0)
+				return;
+
+			// The socket may have been removed since epoll_wait() returned.
+			QHash<quint64, Entry>::const_iterator it = qhEntries.constFind(events[i].data.u64);
+			if (it == qhEntries.constEnd())
+				continue;
+
+			it.value().s->udpReceive(it.value().sock, iWorker);
+		}
+	}
+}
+
+UdpPool::UdpPool(int threads) : iNextWorker(0) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, aiNotify) != 0) {
+		aiNotify[0] = aiNotify[1] = -1;
+		qCritical("UdpPool: Failed to create notify socket");
+		return;
+	}
+
+	for (int i=0;i<threads;++i) {
+		UdpPoolWorker *upw = new UdpPoolWorker(i, aiNotify[0]);
+		if (upw->iEpoll == -1) {
+			qCritical("UdpPool: Failed to create epoll set");
+			delete upw;
+			break;
+		}
+		upw->start(QThread::HighestPriority);
+		qlWorkers << upw;
+	}
+}
+
+UdpPool::~UdpPool() {
+	if (aiNotify[1] != -1) {
+		unsigned char val = 0;
+		if (::write(aiNotify[1], &val, 1) != 1)
+			qCritical("UdpPool: Failed to signal workers");
+	}
+
+	foreach(UdpPoolWorker *upw, qlWorkers) {
+		upw->wait();
+		delete upw;
+	}
+
+	if (aiNotify[0] != -1)
+		close(aiNotify[0]);
+	if (aiNotify[1] != -1)
+		close(aiNotify[1]);
+}
+
+bool UdpPool::isValid() const {
+	return ! qlWorkers.isEmpty();
+}
+
+/// Have the workers serve the given sockets of s, spread over them in turn.
+void UdpPool::add(Server *s, const QList<int> &sockets) {
+	foreach(int sock, sockets) {
+		UdpPoolWorker *upw;
+		{
+			QMutexLocker qml(&qmWorkers);
+			upw = qlWorkers.at(iNextWorker);
+			iNextWorker = (iNextWorker + 1) % qlWorkers.count();
+		}
+
+		QMutexLocker qml(&upw->qmDispatch);
+		UdpPoolWorker::Entry e;
+		e.s = s;
+		e.sock = sock;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = ++upw->uiNextId;
+		if (epoll_ctl(upw->iEpoll, EPOLL_CTL_ADD, sock, &ev) != 0) {
+			s->log(QString("UdpPool: Failed to add UDP socket: %1").arg(QString::fromLocal8Bit(strerror(errno))));
+			continue;
+		}
+		upw->qhEntries.insert(ev.data.u64, e);
+	}
+}
+
+/// Take all sockets of s off the workers. Once this returns, no worker
+/// calls into s anymore.
+void UdpPool::remove(Server *s) {
+	foreach(UdpPoolWorker *upw, qlWorkers) {
+		QMutexLocker qml(&upw->qmDispatch);
+		QHash<quint64, UdpPoolWorker::Entry>::iterator it = upw->qhEntries.begin();
+		while (it != upw->qhEntries.end()) {
+			if (it.value().s == s) {
+				epoll_ctl(upw->iEpoll, EPOLL_CTL_DEL, it.value().sock, NULL);
+				it = upw->qhEntries.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+}
@@ -0,0 +1,87 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_UDPPOOL_H_
+#define MUMBLE_MURMUR_UDPPOOL_H_
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+
+class Server;
+class UdpPool;
+
+// One thread of the UdpPool, waiting on its own epoll set.
+class UdpPoolWorker : public QThread {
+	private:
+		Q_OBJECT;
+		Q_DISABLE_COPY(UdpPoolWorker);
+	protected:
+		friend class UdpPool;
+		struct Entry {
+			Server *s;
+			int sock;
+		};
+		int iWorker;
+		int iEpoll;
+		// Held while events are dispatched, and while the sockets change.
+		// Once a socket is removed, no event for it is dispatched anymore.
+		QMutex qmDispatch;
+		QHash<quint64, Entry> qhEntries;
+		quint64 uiNextId;
+	public:
+		UdpPoolWorker(int worker, int notify);
+		~UdpPoolWorker();
+		void run();
+};
+
+// Serves the UDP sockets of all virtual servers from a fixed set of epoll
+// threads, instead of voice threads of their own. Each worker is a voice
+// epoch reader of every server it calls into, so there are at most
+// VOICEEPOCH_MAX_READERS of them.
+class UdpPool {
+	private:
+		Q_DISABLE_COPY(UdpPool);
+	protected:
+		QList<UdpPoolWorker *> qlWorkers;
+		int aiNotify[2];
+		QMutex qmWorkers;
+		int iNextWorker;
+	public:
+		UdpPool(int threads);
+		~UdpPool();
+		bool isValid() const;
+		void add(Server *s, const QList<int> &sockets);
+		void remove(Server *s);
+};
+
+#endif
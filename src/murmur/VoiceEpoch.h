@@ -0,0 +1,106 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef MUMBLE_MURMUR_VOICEEPOCH_H_
+#define MUMBLE_MURMUR_VOICEEPOCH_H_
+
+#include <QtCore/QtGlobal>
+
+#if defined(_MSC_VER)
+#define VOICEEPOCH_BARRIER() MemoryBarrier()
+#else
+#define VOICEEPOCH_BARRIER() __sync_synchronize()
+#endif
+
+#define VOICEEPOCH_MAX_READERS 64
+
+/// Quiescent state based reclamation for the voice threads.
+///
+/// A voice thread brackets the work it does without qrwlUsers with enter()
+/// and leave(). After the main thread has unlinked an object from everything
+/// the voice threads can reach it through, it stamps it with retire(). The
+/// object may be freed once isQuiescent() says every reader has either left
+/// or entered again since the stamp; such a reader can no longer find it.
+///
+/// Each reader index must be used by one thread only.
+class VoiceEpoch {
+	private:
+		Q_DISABLE_COPY(VoiceEpoch)
+	protected:
+		volatile quint32 uiEpoch;
+		volatile quint32 uiReader[VOICEEPOCH_MAX_READERS];
+	public:
+		VoiceEpoch();
+		void enter(int reader);
+		void leave(int reader);
+		quint32 retire();
+		bool isQuiescent(quint32 stamp) const;
+};
+
+inline VoiceEpoch::VoiceEpoch() : uiEpoch(1) {
+	for (int i=0;i<VOICEEPOCH_MAX_READERS;++i)
+		uiReader[i] = 0;
+}
+
+inline void VoiceEpoch::enter(int reader) {
+	uiReader[reader] = uiEpoch;
+	// Pairs with the barrier in retire(); either the main thread sees us
+	// here, or we see its unlinking.
+	VOICEEPOCH_BARRIER();
+}
+
+inline void VoiceEpoch::leave(int reader) {
+	VOICEEPOCH_BARRIER();
+	uiReader[reader] = 0;
+}
+
+/// Called by the main thread after unlinking; returns the stamp to wait for.
+inline quint32 VoiceEpoch::retire() {
+	VOICEEPOCH_BARRIER();
+	quint32 stamp = uiEpoch + 1;
+	if (stamp == 0)
+		stamp = 1;
+	uiEpoch = stamp;
+	VOICEEPOCH_BARRIER();
+	return stamp;
+}
+
+inline bool VoiceEpoch::isQuiescent(quint32 stamp) const {
+	VOICEEPOCH_BARRIER();
+	for (int i=0;i<VOICEEPOCH_MAX_READERS;++i) {
+		quint32 r = uiReader[i];
+		if (r && (static_cast<qint32>(r - stamp) < 0))
+			return false;
+	}
+	return true;
+}
+
+#endif
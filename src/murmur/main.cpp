@@ -60,6 +60,9 @@ static LogEmitter le;
 
 static QStringList qlErrors;
 
+// Servers log from their control threads too.
+static QMutex qmLog;
+
 static void murmurMessageOutputQString(QtMsgType type, const QString &msg) {
 	char c;
 	switch (type) {
@@ -82,6 +85,8 @@ static void murmurMessageOutputQString(QtMsgType type, const QString &msg) {
 	}
 	QString m= QString::fromLatin1("<%1>%2 %3").arg(QChar::fromLatin1(c)).arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss.zzz")).arg(msg);
 
+	QMutexLocker qml(&qmLog);
+
 	if (! qfLog || ! qfLog->isOpen()) {
 #ifdef Q_OS_UNIX
 		if (! detach)
@@ -9,6 +9,9 @@ CONFIG(static):!macx {
 CONFIG(ermine) {
 	QMAKE_LFLAGS *= -Wl,-rpath,$$(MUMBLE_PREFIX)/lib:$$(MUMBLE_ICE_PREFIX)/lib
 }
+CONFIG(alloc-counter) {
+	DEFINES *= USE_ALLOC_COUNTER
+}
 CONFIG	-= gui
 QT *= network sql xml
 QT -= gui
@@ -16,8 +19,8 @@ TARGET = murmur
 DBFILE  = murmur.db
 LANGUAGE	= C++
 FORMS =
-HEADERS *= Server.h ServerUser.h Meta.h
-SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp
+HEADERS *= Server.h ServerUser.h Meta.h PeerTable.h VoiceEpoch.h TcpVoiceQueue.h AllocCounter.h JoinImage.h
+SOURCES *= main.cpp Server.cpp ServerUser.cpp ServerDB.cpp Register.cpp Cert.cpp Messages.cpp Meta.cpp RPC.cpp AllocCounter.cpp
 
 DIST = DBus.h ServerDB.h ../../icons/murmur.ico Murmur.ice MurmurI.h MurmurIceWrapper.cpp murmur.plist
 PRECOMPILED_HEADER = murmur_pch.h
@@ -50,6 +53,8 @@ win32 {
 unix {
   contains(UNAME, Linux) {
     LIBS *= -lcap
+    HEADERS *= UdpPool.h
+    SOURCES *= UdpPool.cpp
   }
 
   HEADERS *= UnixMurmur.h
@@ -63,6 +68,14 @@ macx {
   QMAKE_LFLAGS += -sectcreate __TEXT __info_plist murmur.plist
 }
 
+# Built on private Qt 5 headers, so only on request.
+tls-resumption {
+	DEFINES *= USE_TLS_RESUMPTION
+	QT *= network-private
+	HEADERS *= TlsSession.h
+	SOURCES *= TlsSession.cpp
+}
+
 dbus {
 	DEFINES *= USE_DBUS
 	CONFIG *= qdbus
@@ -0,0 +1,196 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+ * Throughput and per-packet cost of CryptState for every voice cipher mode,
+ * printed as CSV on stdout so runs can be compared across builds and hosts.
+ *
+ * Scenarios:
+ *   encrypt  - sender side.
+ *   inorder  - receiver, packets arrive in sequence.
+ *   reorder  - receiver, every group of 8 packets arrives reversed.
+ *   replay   - receiver, every packet is delivered a second time and rejected.
+ *   loss     - receiver, 3 of every 4 packets are lost.
+ *   resync   - receiver loses sync; a failed decrypt, a new IV as from
+ *              CryptSetup and a good decrypt make up one packet.
+ */
+
+#include <QtCore>
+#include <stdio.h>
+
+#include "CryptState.h"
+#include "Timer.h"
+
+#define WINDOW 1024
+#define ROUNDS 200
+
+static const char *modeName(CryptState::Mode mode) {
+	switch (mode) {
+		case CryptState::OCB2_AES128:
+			return "OCB2_AES128";
+		case CryptState::AES128_GCM:
+			return "AES128_GCM";
+		case CryptState::CHACHA20_POLY1305:
+			return "CHACHA20_POLY1305";
+	}
+	return "unknown";
+}
+
+static void report(CryptState::Mode mode, const char *scenario, unsigned int bytes, quint64 packets, quint64 usecs) {
+	double ns = (usecs * 1000.0) / static_cast<double>(packets);
+	double pps = (usecs > 0) ? (packets * 1000000.0) / static_cast<double>(usecs) : 0.0;
+	printf("%s,%s,%u,%llu,%.1f,%.0f\n", modeName(mode), scenario, bytes, static_cast<unsigned long long>(packets), ns, pps);
+	fflush(stdout);
+}
+
+static void bench(CryptState::Mode mode, unsigned int bytes) {
+	CryptState enc, dec;
+	enc.genKey(mode);
+	dec.setKey(enc.raw_key, enc.decrypt_iv, enc.encrypt_iv, mode);
+
+	const unsigned int crypted_len = bytes + enc.overhead();
+	const unsigned int stride = bytes + CRYPT_MAX_OVERHEAD;
+	unsigned char *crypted = new unsigned char[WINDOW * stride];
+	unsigned char plain[256], decr[256];
+	int order[WINDOW];
+
+	for (unsigned int i=0;i<bytes;++i)
+		plain[i] = static_cast<unsigned char>(qrand());
+
+	Timer t;
+	quint64 usecs;
+	unsigned int ok;
+
+	// Sender
+	usecs = 0;
+	for (int r=0;r<ROUNDS;++r) {
+		t.restart();
+		for (int i=0;i<WINDOW;++i)
+			enc.encrypt(plain, crypted + i * stride, bytes);
+		usecs += t.elapsed();
+	}
+	report(mode, "encrypt", bytes, ROUNDS * WINDOW, usecs);
+	dec.setDecryptIV(enc.encrypt_iv);
+
+	// In order, reordered and replayed delivery all start from packets the
+	// receiver is in step with.
+	const char *scenarios[] = { "inorder", "reorder", "replay" };
+	for (int s=0;s<3;++s) {
+		for (int i=0;i<WINDOW;++i)
+			order[i] = (s == 1) ? ((i & ~7) | (7 - (i & 7))) : i;
+
+		usecs = 0;
+		ok = 0;
+		for (int r=0;r<ROUNDS;++r) {
+			for (int i=0;i<WINDOW;++i)
+				enc.encrypt(plain, crypted + i * stride, bytes);
+			if (s == 2) {
+				for (int i=0;i<WINDOW;++i)
+					dec.decrypt(crypted + i * stride, decr, crypted_len);
+			}
+			t.restart();
+			for (int i=0;i<WINDOW;++i)
+				if (dec.decrypt(crypted + order[i] * stride, decr, crypted_len))
+					++ok;
+			usecs += t.elapsed();
+		}
+		if (ok != ((s == 2) ? 0U : static_cast<unsigned int>(ROUNDS * WINDOW)))
+			qFatal("%s/%s/%u: %u of %u packets accepted", modeName(mode), scenarios[s], bytes, ok, ROUNDS * WINDOW);
+		report(mode, scenarios[s], bytes, ROUNDS * WINDOW, usecs);
+	}
+
+	// Heavy loss; only every fourth packet reaches the receiver.
+	usecs = 0;
+	ok = 0;
+	for (int r=0;r<ROUNDS;++r) {
+		for (int i=0;i<WINDOW;++i) {
+			enc.encrypt(plain, crypted + i * stride, bytes);
+			for (int j=0;j<3;++j)
+				enc.encrypt(plain, decr, 0);
+		}
+		t.restart();
+		for (int i=0;i<WINDOW;++i)
+			if (dec.decrypt(crypted + i * stride, decr, crypted_len))
+				++ok;
+		usecs += t.elapsed();
+	}
+	if (ok != static_cast<unsigned int>(ROUNDS * WINDOW))
+		qFatal("%s/loss/%u: %u of %u packets accepted", modeName(mode), bytes, ok, ROUNDS * WINDOW);
+	report(mode, "loss", bytes, ROUNDS * WINDOW, usecs);
+
+	// Resync. The sender jumps far ahead, so its next packet fails; the
+	// receiver then takes the sender's IV, as from CryptSetup, and the
+	// packet after that verifies.
+	const int resyncs = (ROUNDS * WINDOW) / 16;
+	unsigned char iv[AES_BLOCK_SIZE];
+	usecs = 0;
+	ok = 0;
+	for (int r=0;r<resyncs;++r) {
+		enc.encrypt_iv[8]++;
+		enc.encrypt(plain, crypted, bytes);
+		memcpy(iv, enc.encrypt_iv, AES_BLOCK_SIZE);
+		enc.encrypt(plain, crypted + stride, bytes);
+		t.restart();
+		if (! dec.decrypt(crypted, decr, crypted_len)) {
+			dec.setDecryptIV(iv);
+			if (dec.decrypt(crypted + stride, decr, crypted_len))
+				++ok;
+		}
+		usecs += t.elapsed();
+	}
+	if (ok != static_cast<unsigned int>(resyncs))
+		qFatal("%s/resync/%u: %u of %d packets accepted", modeName(mode), bytes, ok, resyncs);
+	report(mode, "resync", bytes, resyncs, usecs);
+
+	delete [] crypted;
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	const unsigned int sizes[] = { 20, 40, 60, 80, 120, 160, 200 };
+	const CryptState::Mode modes[] = { CryptState::OCB2_AES128, CryptState::AES128_GCM, CryptState::CHACHA20_POLY1305 };
+
+	printf("mode,scenario,bytes,packets,ns_per_packet,packets_per_sec\n");
+
+	for (unsigned int m=0;m<sizeof(modes)/sizeof(modes[0]);++m) {
+		CryptState probe;
+		probe.genKey(modes[m]);
+		if (! probe.isValid()) {
+			qWarning("%s not supported by this OpenSSL, skipped", modeName(modes[m]));
+			continue;
+		}
+		for (unsigned int s=0;s<sizeof(sizes)/sizeof(sizes[0]);++s)
+			bench(modes[m], sizes[s]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG  += qt thread warn_on release
+CONFIG -= app_bundle
+LANGUAGE = C++
+TARGET = CryptBenchmark
+HEADERS = Timer.h CryptState.h
+SOURCES = CryptBenchmark.cpp CryptState.cpp Timer.cpp
+VPATH += ..
+INCLUDEPATH += .. ../murmur ../mumble
+LIBS += -lcrypto
@@ -0,0 +1,121 @@
+/* Copyright (C) 2005-2011, Thorvald Natvig <thorvald@natvig.com>
+
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   - Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   - Neither the name of the Mumble Developers nor the names of its
+     contributors may be used to endorse or promote products derived from this
+     software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+ * Benchmark of UDP peer lookup; QHash on (HostAddress, port) against PeerTable.
+ */
+
+#include <QtCore>
+
+#include "Net.h"
+#include "PeerTable.h"
+#include "Timer.h"
+
+#define LOOKUPS 1000000
+
+typedef QPair<HostAddress, quint16> PeerKey;
+
+static void bench(int npeers) {
+	QVector<HostAddress> addrs(npeers);
+	QVector<quint16> ports(npeers);
+	QVector<int> order(LOOKUPS);
+
+	qsrand(npeers);
+	for (int i=0;i<npeers;++i) {
+		HostAddress &ha = addrs[i];
+		ha.addr[0] = 0ULL;
+		ha.shorts[4] = 0;
+		ha.shorts[5] = 0xffff;
+		ha.hash[3] = (static_cast<quint32>(qrand()) << 16) ^ static_cast<quint32>(qrand());
+		ports[i] = static_cast<quint16>(qrand());
+	}
+	for (int i=0;i<LOOKUPS;++i)
+		order[i] = qrand() % npeers;
+
+	int *values = new int[npeers];
+
+	Timer t;
+	quint64 usins, uslookup;
+	int found;
+
+	{
+		QHash<PeerKey, int *> h;
+		t.restart();
+		for (int i=0;i<npeers;++i)
+			h.insert(PeerKey(addrs[i], ports[i]), &values[i]);
+		usins = t.restart();
+		found = 0;
+		for (int i=0;i<LOOKUPS;++i) {
+			int j = order[i];
+			if (h.value(PeerKey(addrs[j], ports[j])) == &values[j])
+				++found;
+		}
+		uslookup = t.restart();
+	}
+	qWarning("%6d peers: QHash     %7lldus insert, %5.1fns/lookup (%d found)", npeers, usins, uslookup * 1000.0 / LOOKUPS, found);
+
+	{
+		PeerTable<int> pt;
+		t.restart();
+		for (int i=0;i<npeers;++i)
+			pt.insert(addrs[i], ports[i], &values[i]);
+		usins = t.restart();
+		found = 0;
+		for (int i=0;i<LOOKUPS;++i) {
+			int j = order[i];
+			if (pt.value(addrs[j], ports[j]) == &values[j])
+				++found;
+		}
+		uslookup = t.restart();
+
+		// Removal has to keep every remaining peer reachable.
+		for (int i=0;i<npeers;i+=2)
+			pt.remove(addrs[i], ports[i]);
+		for (int i=0;i<npeers;++i) {
+			int *expect = (i & 1) ? &values[i] : NULL;
+			if (pt.value(addrs[i], ports[i]) != expect)
+				qFatal("PeerTable lost peer %d after removal", i);
+		}
+	}
+	qWarning("%6d peers: PeerTable %7lldus insert, %5.1fns/lookup (%d found)", npeers, usins, uslookup * 1000.0 / LOOKUPS, found);
+
+	delete [] values;
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication a(argc, argv);
+
+	bench(1000);
+	bench(10000);
+	bench(100000);
+
+	return 0;
+}
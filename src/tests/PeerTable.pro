@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG  += qt thread warn_on network release
+CONFIG -= app_bundle
+QT += network
+LANGUAGE = C++
+TARGET = PeerTable
+HEADERS = Net.h Timer.h PeerTable.h
+SOURCES = PeerTable.cpp Net.cpp Timer.cpp
+VPATH += .. ../murmur
+INCLUDEPATH += .. ../murmur ../mumble
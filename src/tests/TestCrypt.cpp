@@ -12,6 +12,8 @@ class TestCrypt : public QObject {
 		void ivrecovery();
 		void reverserecovery();
 		void tamper();
+		void aead_data();
+		void aead();
 };
 
 void TestCrypt::reverserecovery() {
@@ -202,5 +204,56 @@ void TestCrypt::tamper() {
 	QVERIFY(cs.decrypt(encrypted, decrypted, len+4));
 }
 
+void TestCrypt::aead_data() {
+	QTest::addColumn<int>("mode");
+
+	QTest::newRow("AES128_GCM") << static_cast<int>(CryptState::AES128_GCM);
+	QTest::newRow("CHACHA20_POLY1305") << static_cast<int>(CryptState::CHACHA20_POLY1305);
+}
+
+void TestCrypt::aead() {
+	QFETCH(int, mode);
+
+	CryptState enc, dec;
+	enc.genKey(static_cast<CryptState::Mode>(mode));
+	if (! enc.isValid())
+		QSKIP("Mode not supported by this OpenSSL", SkipSingle);
+
+	dec.setKey(enc.raw_key, enc.decrypt_iv, enc.encrypt_iv, static_cast<CryptState::Mode>(mode));
+	QVERIFY(dec.isValid());
+
+	const unsigned int overhead = enc.overhead();
+	unsigned char src[256];
+	unsigned char crypted[30][256 + CRYPT_MAX_OVERHEAD];
+	unsigned char decr[256];
+
+	for (int i=0;i<256;i++)
+		src[i] = static_cast<unsigned char>(i);
+
+	for (unsigned int len=0;len<256;len++) {
+		enc.encrypt(src, crypted[0], len);
+		QVERIFY(dec.decrypt(crypted[0], decr, len + overhead));
+		QVERIFY(memcmp(src, decr, len) == 0);
+		// Replays are caught by the history window.
+		QVERIFY(! dec.decrypt(crypted[0], decr, len + overhead));
+	}
+
+	enc.encrypt(src, crypted[0], 40);
+	for (unsigned int i=0;i<(40 + overhead)*8;i++) {
+		crypted[0][i/8] ^= 1 << (i % 8);
+		QVERIFY(! dec.decrypt(crypted[0], decr, 40 + overhead));
+		crypted[0][i/8] ^= 1 << (i % 8);
+	}
+	QVERIFY(dec.decrypt(crypted[0], decr, 40 + overhead));
+
+	// Out of order within the window, then replayed.
+	for (int i=0;i<30;i++)
+		enc.encrypt(src, crypted[i], 40);
+	for (int i=29;i>=0;i--)
+		QVERIFY(dec.decrypt(crypted[i], decr, 40 + overhead));
+	for (int i=0;i<30;i++)
+		QVERIFY(! dec.decrypt(crypted[i], decr, 40 + overhead));
+}
+
 QTEST_MAIN(TestCrypt)
 #include "TestCrypt.moc"